@@ -24,317 +24,4800 @@
 
 #ifdef ENABLE_DREADLOCK
 
+// the library itself is written against the standard lock types, even
+// in a target that force-includes DreadlockStd.h with
+// DREADLOCK_INTERPOSE_STD
+#undef lock_guard
+#undef unique_lock
+#undef shared_lock
+#undef condition_variable
+
 #include <iostream>
 #include <chrono>
+#include <thread>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <map>
+#include <memory>
+#include <algorithm>
 
 #include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <dbghelp.h>
+#include <intrin.h>
+#pragma comment(lib, "dbghelp.lib")
+#else
+#include <cxxabi.h>
+#include <execinfo.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "Dreadlock.h"
 
 using namespace std::chrono_literals;
 
-uint32_t Dreadlock::next_id{0};
-std::mutex Dreadlock::tracking_mutex;
-Dreadlock::tracking_map_t Dreadlock::tracking;
+static_assert((DREADLOCK_TRACKING_CAPACITY & (DREADLOCK_TRACKING_CAPACITY - 1)) == 0, "DREADLOCK_TRACKING_CAPACITY must be a power of two");
+static_assert((DREADLOCK_LOG_CAPACITY & (DREADLOCK_LOG_CAPACITY - 1)) == 0, "DREADLOCK_LOG_CAPACITY must be a power of two");
+static_assert((DREADLOCK_LOCK_ORDER_CAPACITY & (DREADLOCK_LOCK_ORDER_CAPACITY - 1)) == 0, "DREADLOCK_LOCK_ORDER_CAPACITY must be a power of two");
+static_assert((DREADLOCK_TRACE_CAPACITY & (DREADLOCK_TRACE_CAPACITY - 1)) == 0, "DREADLOCK_TRACE_CAPACITY must be a power of two");
+static_assert((DREADLOCK_STACK_CAPACITY & (DREADLOCK_STACK_CAPACITY - 1)) == 0, "DREADLOCK_STACK_CAPACITY must be a power of two");
 
-std::mutex Dreadlock::printing_mutex;
+// statistics histograms have two buckets per power of two nanoseconds,
+// which covers everything up to about 18 minutes at +/-25% resolution
+static const int StatsBuckets{80};
+static const int StatsBlockers{4};
 
-Dreadlock::Dreadlock(std::mutex& mtx, const std::string& name, const std::string& file, int line, bool defer) : mtx(mtx), id(name)
+// the phases of a contended acquisition (see WaitSpins)
+enum WaitPhase
 {
-	mtx_key = reinterpret_cast<size_t>(&mtx);
+	Spinning,
+	BackingOff,
+	Parked,
+	WaitPhaseCount,
+};
 
-	std::unique_lock<std::mutex> tracking_lock(tracking_mutex);
-	this_dreadlock = next_id++;
-	tracking_lock.unlock();
+static int64_t steady_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
-	if (!defer)
-		lock(file, line);
+// a hint to the CPU that this is a spin-wait loop
+static inline void cpu_relax()
+{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	_mm_pause();
+#elif defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	asm volatile("yield");
+#else
+	std::this_thread::yield();
+#endif
 }
 
-Dreadlock::~Dreadlock()
+// the clock behind all of Dreadlock's timing: nanoseconds on the
+// steady clock's epoch, but read from the CPU's own counter where it
+// ticks at a constant rate--the invariant TSC on x86, the generic timer
+// on ARM--which costs a fraction of a steady_clock::now().  the
+// counter is converted with a fixed-point multiply.  the background
+// writer calibrates it against the steady clock on its first ticks, and
+// re-anchors it every ReanchorInterval, steering out the error that
+// has built up over the next interval rather than jumping, so the time
+// never steps back, and stays close enough to the steady clock to be
+// compared with it, and across processes.  until then (or without
+// such a counter, or with DREADLOCK_STEADY_CLOCK set), it's the steady
+// clock itself.
+struct CounterClock
 {
-	// if the mutex has an entry in the tracking database,
-	// then it was instantiated without an explicit unlock
+	static const int64_t CalibrationInterval{20000000}; // nanoseconds between the first two readings
+	static const int64_t ReanchorInterval{1000000000};
+
+	// the conversion, published under a sequence count that's odd
+	// while the writer is changing it
+	std::atomic<bool> enabled{false};
+	std::atomic<uint32_t> sequence{0};
+	std::atomic<uint64_t> base_ticks{0};
+	std::atomic<int64_t> base_ns{0};
+	std::atomic<uint64_t> mult{0}; // nanoseconds per tick, in fixed point...
+	std::atomic<unsigned> shift{0}; // ...with this many fraction bits
+
+	// the writer's own: whether to calibrate at all, and the last
+	// reading it took
+	bool wanted{false};
+	uint64_t sample_ticks{0};
+	int64_t sample_ns{0};
+
+	CounterClock()
+	{
+		auto text{getenv("DREADLOCK_STEADY_CLOCK")};
+		wanted = !(text && *text && strcmp(text, "0")) && available();
+	}
+
+	static bool available()
+	{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+		int info[4];
+		__cpuid(info, 0x80000000);
+		if (static_cast<unsigned>(info[0]) < 0x80000007)
+			return false;
+		__cpuid(info, 0x80000007);
+		return (info[3] & (1 << 8)) != 0;
+#elif defined(__x86_64__) || defined(__i386__)
+		unsigned eax, ebx, ecx, edx;
+		if (__get_cpuid_max(0x80000000, nullptr) < 0x80000007 || !__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+			return false;
+		return (edx & (1 << 8)) != 0;
+#elif defined(__aarch64__)
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	static uint64_t ticks()
+	{
+#if (defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))) || defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+#elif defined(__aarch64__)
+		uint64_t value;
+		asm volatile("isb; mrs %0, cntvct_el0" : "=r"(value));
+		return value;
+#else
+		return 0;
+#endif
+	}
+
+	// a reading of the counter and the steady clock taken together,
+	// keeping the tightest of a few tries
+	static void sample(uint64_t& at_ticks, int64_t& at_ns)
+	{
+		uint64_t best{~0ull};
+		for (int i = 0; i < 8; ++i)
+		{
+			auto before{ticks()};
+			auto ns{steady_ns()};
+			auto after{ticks()};
+			if (after - before < best)
+			{
+				best = after - before;
+				at_ticks = before + (after - before) / 2;
+				at_ns = ns;
+			}
+		}
+	}
+
+	// the counter reading 'at', in nanoseconds
+	int64_t convert(uint64_t at) const
+	{
+		uint64_t from_ticks, by, bits;
+		int64_t from_ns;
+		for (;;)
+		{
+			auto before{sequence.load(std::memory_order_acquire)};
+			from_ticks = base_ticks.load(std::memory_order_relaxed);
+			from_ns = base_ns.load(std::memory_order_relaxed);
+			by = mult.load(std::memory_order_relaxed);
+			bits = shift.load(std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (!(before & 1) && sequence.load(std::memory_order_relaxed) == before)
+				break;
+			cpu_relax();
+		}
+
+		// a core whose counter runs a little behind the one anchored on can't go back before the anchor
+		auto delta{at - from_ticks};
+		if (static_cast<int64_t>(delta) < 0)
+			delta = 0;
+
+		return from_ns + static_cast<int64_t>((delta >> bits) * by + (((delta & ((1ull << bits) - 1)) * by) >> bits));
+	}
+
+	void publish(uint64_t at_ticks, int64_t at_ns, double ns_per_tick)
+	{
+		// as many fraction bits as keep the multiplier within 32 bits,
+		// so the fraction's product can't overflow
+		unsigned bits{32};
+		while (bits && ns_per_tick * static_cast<double>(1ull << bits) >= 4294967296.0)
+			--bits;
+
+		auto current{sequence.load(std::memory_order_relaxed)};
+		sequence.store(current + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		base_ticks.store(at_ticks, std::memory_order_relaxed);
+		base_ns.store(at_ns, std::memory_order_relaxed);
+		mult.store(static_cast<uint64_t>(ns_per_tick * static_cast<double>(1ull << bits) + 0.5), std::memory_order_relaxed);
+		shift.store(bits, std::memory_order_relaxed);
+		sequence.store(current + 2, std::memory_order_release);
+		enabled.store(true, std::memory_order_release);
+	}
+
+	// called on every tick of the background writer
+	void tick()
+	{
+		if (!wanted)
+			return;
+
+		if (!sample_ns)
+		{
+			sample(sample_ticks, sample_ns);
+			return;
+		}
 
-	std::unique_lock<std::mutex> tracking_lock(tracking_mutex);
-	auto is_locked{tracking.find(mtx_key) != tracking.end()};
-	bool locked_by_me{is_locked && tracking[mtx_key].dreadlock_id == this_dreadlock};
-	tracking_lock.unlock();
+		bool running{enabled.load(std::memory_order_relaxed)};
+		auto interval{running ? ReanchorInterval : CalibrationInterval};
+		if (steady_ns() - sample_ns < interval)
+			return;
 
-	if (locked_by_me)
-		unlock(destruct_file.empty() ? "Dreadlock::~Dreadlock()" : destruct_file, destruct_line ? destruct_line : __LINE__);
+		uint64_t at_ticks{0};
+		int64_t at_ns{0};
+		sample(at_ticks, at_ns);
+		if (at_ticks <= sample_ticks || at_ns <= sample_ns)
+		{
+			// the counter didn't move on with the clock; start over
+			sample_ticks = at_ticks;
+			sample_ns = at_ns;
+			return;
+		}
+
+		auto elapsed{at_ns - sample_ns};
+		auto ns_per_tick{static_cast<double>(elapsed) / static_cast<double>(at_ticks - sample_ticks)};
+		auto anchor_ns{at_ns};
+
+		if (running)
+		{
+			// carry on from the counter's own reading, and make up the
+			// difference from the steady clock over the next interval.
+			// a difference too large to make up (the machine slept, say)
+			// is stepped over instead.
+			auto reading{convert(at_ticks)};
+			auto error{at_ns - reading};
+			if (error > -elapsed / 10 && error < elapsed / 10)
+			{
+				anchor_ns = reading;
+				ns_per_tick *= static_cast<double>(elapsed + error) / static_cast<double>(elapsed);
+			}
+		}
+
+		if (ns_per_tick > 0.0)
+			publish(at_ticks, anchor_ns, ns_per_tick);
+
+		sample_ticks = at_ticks;
+		sample_ns = at_ns;
+	}
+};
+
+static CounterClock counter_clock; // the steady clock until the writer has calibrated it
+
+static int64_t now_ns()
+{
+	if (!counter_clock.enabled.load(std::memory_order_acquire))
+		return steady_ns();
+
+	return counter_clock.convert(CounterClock::ticks());
 }
 
-#if defined(_WIN32) && defined(ENABLE_WIN32_CONSOLE)
-int Dreadlock::output_win32_console(const char* format, ...)
+static int stats_bucket(int64_t ns)
 {
-	static char s_printf_buf[1024];
-	va_list args;
-	va_start(args, format);
-	_vsnprintf_s(s_printf_buf, sizeof(s_printf_buf), sizeof(s_printf_buf), format, args);
-	va_end(args);
-	OutputDebugStringA(s_printf_buf);
-	return 0;
+	if (ns < 2)
+		return ns < 0 ? 0 : static_cast<int>(ns);
+
+	int msb{0};
+	for (auto value = static_cast<uint64_t>(ns); value >>= 1;)
+		++msb;
+
+	return std::min(2 * msb + static_cast<int>((ns >> (msb - 1)) & 1), StatsBuckets - 1);
 }
-#endif
 
-std::string Dreadlock::get_module_name(const std::string& path)
+// the smallest value that falls in the bucket following 'bucket'
+static int64_t stats_bucket_limit(int bucket)
 {
-	std::regex regex{R"([\\/]+)"}; // split path separator
-	std::sregex_token_iterator it{path.begin(), path.end(), regex, -1};
-	std::vector<std::string> items{it, {}};
-	return items.back();
+	++bucket;
+	if (bucket < 2)
+		return bucket;
+	return static_cast<int64_t>(2 + (bucket & 1)) << ((bucket >> 1) - 1);
 }
 
-void Dreadlock::lock(const std::string& file, int line)
+static void format_duration(char* buffer, size_t size, int64_t ns)
 {
-#if defined(DREADLOCK_VERBOSE)
-	std::unique_lock<std::mutex> printing_lock(printing_mutex);
-#if defined(_WIN32) && defined(ENABLE_WIN32_CONSOLE)
-	output_win32_console("[[ Dreadlock ]] Locking %s in module %s:%d\n", id.c_str(), file.c_str(), line);
-#endif
-	std::cout << "[[ Dreadlock ]] Locking " << id << " in module " << file << ":" << line << std::endl;
-	printing_lock.unlock();
-#endif
+	if (ns < 1000)
+		snprintf(buffer, size, "%dns", static_cast<int>(ns));
+	else if (ns < 1000000)
+		snprintf(buffer, size, "%.1fus", ns / 1000.0);
+	else if (ns < 1000000000)
+		snprintf(buffer, size, "%.2fms", ns / 1000000.0);
+	else
+		snprintf(buffer, size, "%.2fs", ns / 1000000000.0);
+}
+
+// one thread's counters for one mutex, locked from one site.  only
+// the owning thread writes them, so updates are plain load/store
+// pairs; they're atomic so dump_stats() can read them at any time.
+struct Dreadlock::LockStats
+{
+	uint32_t slot{0};
+	const char* id{nullptr};
+	const DreadlockSite* site{nullptr};
 
-	std::unique_lock<std::mutex> tracking_lock(tracking_mutex);
+	std::atomic<uint64_t> acquisitions{0};
+	std::atomic<uint64_t> contended{0};
+	std::atomic<uint64_t> wait_total{0};
+	std::atomic<uint64_t> wait_max{0};
+	std::atomic<uint64_t> hold_total{0};
+	std::atomic<uint64_t> hold_max{0};
+	std::atomic<const DreadlockSite*> hold_max_release{nullptr};
+	std::atomic<uint32_t> wait_histogram[StatsBuckets]{};
+	std::atomic<uint32_t> hold_histogram[StatsBuckets]{};
+	std::atomic<uint64_t> over_budget{0}; // holds that outlasted their budget (see DREADLOCK_BUDGET)
 
-	auto module{file};
-	if (ShortModuleNames)
-		module = get_module_name(file);
+	// the contended acquisitions that got the lock in each WaitPhase,
+	// and the time spent in each phase, whichever one it ended in
+	std::atomic<uint64_t> phase_acquired[WaitPhaseCount]{};
+	std::atomic<uint64_t> phase_total[WaitPhaseCount]{};
 
-	// if the mutex is not present in the tracking database,
-	// then it is not currently lock (as far as we know, of course)
-	auto is_locked{tracking.find(mtx_key) != tracking.end()};
+	// condition variable waits made at this site (see Dreadlock::wait())
+	std::atomic<uint64_t> cv_blocks{0};
+	std::atomic<uint64_t> cv_unsatisfied{0}; // woken with the predicate still false
+	std::atomic<uint64_t> cv_timeouts{0};
+	std::atomic<uint64_t> cv_blocked_total{0};
+	std::atomic<uint64_t> cv_blocked_max{0};
+	std::atomic<uint32_t> cv_histogram[StatsBuckets]{};
 
-	// is the mutex currently locked?
-	if (!is_locked && mtx.try_lock())
-		tracking.emplace(mtx_key, LockInfo(this_dreadlock, module, line));
-	else
+	// the sites that held the mutex when this one started waiting for
+	// it, in order of appearance, along with the time spent waiting
+	// behind each (see Dreadlock::dump_contention()).  a null site is an
+	// unknown holder; waits behind any more than fit count as 'other'.
+	struct Blocker
 	{
-		LockInfo* info{nullptr};
+		std::atomic<const DreadlockSite*> site{nullptr};
+		std::atomic<uint64_t> waits{0};
+		std::atomic<uint64_t> wait_total{0};
+	};
+	Blocker blockers[StatsBlockers];
+	std::atomic<uint32_t> blocker_count{0};
+	std::atomic<uint64_t> other_waits{0};
+	std::atomic<uint64_t> other_wait_total{0};
+
+	void blocked_by(const DreadlockSite* holder, int64_t waited);
+};
 
-		if (is_locked)
+template <typename T, typename V>
+static void bump(std::atomic<T>& counter, V amount)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + static_cast<T>(amount), std::memory_order_relaxed);
+}
+
+void Dreadlock::LockStats::blocked_by(const DreadlockSite* holder, int64_t waited)
+{
+	auto count{blocker_count.load(std::memory_order_relaxed)};
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		if (blockers[i].site.load(std::memory_order_relaxed) == holder)
 		{
-			// grab the locker's info
-			info = &tracking[mtx_key];
+			bump(blockers[i].waits, 1);
+			bump(blockers[i].wait_total, waited);
+			return;
+		}
+	}
 
-			std::unique_lock<std::mutex> printing_lock(printing_mutex);
-			if (info->dreadlock_id == this_dreadlock)
-			{
-				// we already hold this lock!
+	if (count == StatsBlockers)
+	{
+		bump(other_waits, 1);
+		bump(other_wait_total, waited);
+		return;
+	}
 
-#if defined(_WIN32) && defined(ENABLE_WIN32_CONSOLE)
-				output_win32_console(
-					"[[ Dreadlock ]] Illegal lock of mutex %s in module %s:%d when already held!;\n   ... currently locked in module %s:%d.\n",
-					id.c_str(),
-					module.c_str(),
-					line,
-					info->lock_file.c_str(),
-					info->lock_line);
-#endif
-				std::cout << "[[ Dreadlock ]] Illegal lock of mutex " << id << " in module " << module << ":" << line
-						  << " when already held!;";
-				if(!ShortModuleNames)
-					std::cout << "\n   ...";
-				std::cout << " currently locked in module " << info->lock_file << ":" << info->lock_line << std::endl;
+	// the entry is complete before it's counted
+	blockers[count].site.store(holder, std::memory_order_relaxed);
+	blockers[count].waits.store(1, std::memory_order_relaxed);
+	blockers[count].wait_total.store(waited, std::memory_order_relaxed);
+	blocker_count.store(count + 1, std::memory_order_release);
+}
 
-				assert(false);
-			}
-#if defined(DREADLOCK_VERBOSE)
-			else
-			{
-#if defined(_WIN32) && defined(ENABLE_WIN32_CONSOLE)
-				output_win32_console(
-					"[[ Dreadlock ]] Attempting to lock mutex %s in module %s:%d;\n   ... currently locked in module %s:%d.\n",
-					id.c_str(),
-					module.c_str(),
-					line,
-					info->lock_file.c_str(),
-					info->lock_line);
-#endif
-				std::cout << "[[ Dreadlock ]] Attempting to lock mutex " << id << " in module " << module << ":" << line << ";";
-				if (!ShortModuleNames)
-					std::cout << "\n   ...";
-				std::cout << " currently locked in module " << info->lock_file << ":" << info->lock_line << std::endl;
-			}
-#endif
-			printing_lock.unlock();
-		}
+// a thread's statistics are allocated a block at a time, each block
+// twice the size of the one before, and never freed.  entries are
+// filled in before 'used' counts them, so dump_stats() can walk the
+// blocks without a lock.
+struct Dreadlock::StatsBlock
+{
+	explicit StatsBlock(uint32_t size) : capacity(size), entries(new LockStats[size]) {}
 
-		// this mutex is already locked ... wait for it a reasonable
-		// amount of time before we consider it deadlocked
+	StatsBlock* next{nullptr}; // the previous (smaller) block
+	uint32_t capacity;
+	std::atomic<uint32_t> used{0};
+	std::unique_ptr<LockStats[]> entries;
+};
 
-		auto start{std::chrono::steady_clock::now()};
-		bool reported_performance{false};
-		bool reported_deadlock{false};
+static size_t stats_hash(uint32_t slot, const DreadlockSite* site)
+{
+	return static_cast<size_t>(((reinterpret_cast<uintptr_t>(site) ^ slot) * 0x9E3779B97F4A7C15ull) >> 32);
+}
 
-		tracking_lock.unlock();
+// a slice (or one end of a flow arrow) on a thread's lock timeline
+struct Dreadlock::TraceEvent
+{
+	enum Kind : uint8_t
+	{
+		Hold,		 // start..end: the lock was held, from 'site' until released at 'other_site'
+		Wait,		 // start..end: waited at 'site' while 'other_site' held the lock
+		HandoffOut,	 // at start: a release that a waiter was blocked on
+		HandoffIn,	 // at start: the waiter's acquisition
+		CvWait,		 // start..end: blocked on a condition variable at 'site', with the lock released
+	};
 
-		for (;;)
-		{
-			std::this_thread::sleep_for(500000ns);
+	enum Wakeup : uint8_t
+	{
+		Satisfied,
+		Unsatisfied, // a spurious (or stolen) wakeup
+		TimedOut,
+	};
 
-			tracking_lock.lock();
+	Kind kind{Hold};
+	Wakeup wakeup{Satisfied}; // CvWait only
+	bool shared{false};
+	uint32_t thread{0};
+	uint32_t dreadlock_id{0};
+	uint32_t other_id{0};
+	uint32_t readers{0};
+	int64_t start{0};
+	int64_t end{0};
+	uint64_t flow{0};
+	const char* id{nullptr};
+	const DreadlockSite* site{nullptr};
+	const DreadlockSite* other_site{nullptr};
+};
 
-			is_locked = tracking.find(mtx_key) != tracking.end();
+// a thread's wait for a lock, timed either by the waiting thread
+// itself, or by the watchdog.  for a watched wait, 'mutex' keeps the
+// waiting instance from going away while the watchdog is using it.
+struct Dreadlock::WaitRecord
+{
+	std::mutex mutex;
+	std::atomic<bool> active{false};
+	std::atomic<bool> deadlocked{false}; // the watchdog's verdict
+	Dreadlock* waiter{nullptr};
+	const DreadlockSite* site{nullptr};
+	int64_t start{0}; // restarts after a starvation report
+	uint32_t progress{0};
+	int performance_timeout{0};
+	int deadlock_timeout{0};
+	uint32_t stack{0}; // the waiter's, if captured
+	uint32_t shared_thread{0}; // the waiter's record in the shared table, if there is one
+	bool reported_performance{false};
+	bool reported_starvation{false};
+};
 
-			if (!is_locked)
-			{
-				// should be able to acquire the lock now.  if
-				// we don't get it for some reason, that's a fail!
-				if (mtx.try_lock())
-					tracking.emplace(mtx_key, LockInfo(this_dreadlock, module, line));
+// a held lock, or a wait in progress, as other threads see it (see
+// Dreadlock::snapshot()).  only the owning thread writes it, inside
+// its view sequence.
+struct ViewLock
+{
+	std::atomic<uint32_t> slot{0}; // the ownership table index plus one, or zero for none
+	std::atomic<uint32_t> dreadlock_id{0};
+	std::atomic<const char*> id{nullptr};
+	std::atomic<const DreadlockSite*> site{nullptr};
+	std::atomic<int64_t> since{0}; // zero if the lock wasn't timed
+	std::atomic<bool> shared{false};
 
-				tracking_lock.unlock();
+	void set(uint32_t slot_number, uint32_t instance, const char* name, const DreadlockSite* at, int64_t start, bool is_shared)
+	{
+		slot.store(slot_number, std::memory_order_relaxed);
+		dreadlock_id.store(instance, std::memory_order_relaxed);
+		id.store(name, std::memory_order_relaxed);
+		site.store(at, std::memory_order_relaxed);
+		since.store(start, std::memory_order_relaxed);
+		shared.store(is_shared, std::memory_order_relaxed);
+	}
+};
 
-				break;
-			}
+// everything a thread needs to record diagnostics without touching
+// shared state.  states are allocated the first time a thread uses
+// Dreadlock, published on a lock-free list, and handed to a new
+// thread when their owner exits, so the writer can traverse the list
+// without locks and never sees a state disappear.
+struct Dreadlock::ThreadState
+{
+	ThreadState* next{nullptr}; // never changes once published
+	std::atomic<bool> in_use{false};
 
-			tracking_lock.unlock();
+	// single producer (the owning thread), single consumer (whoever
+	// holds printing_mutex)
+	std::atomic<uint32_t> log_head{0};
+	std::atomic<uint32_t> log_tail{0};
+	std::atomic<uint32_t> log_dropped{0};
+	LogEvent log[DREADLOCK_LOG_CAPACITY];
 
-			auto elapsed{std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count()};
-			if (elapsed >= DeadlockTimeout)
-			{
-				break; // this is a fail!
-			}
-			else if (PerformanceTimeout && !reported_performance && elapsed >= PerformanceTimeout)
+	// the lock timeline, while tracing.  the same kind of ring as
+	// 'log', but only allocated once the thread records into it.
+	std::atomic<TraceEvent*> trace{nullptr};
+	std::atomic<uint32_t> trace_head{0};
+	std::atomic<uint32_t> trace_tail{0};
+	std::atomic<uint32_t> trace_dropped{0};
+	uint32_t thread_number{0}; // the trace's thread id for the thread currently using this state
+
+	// locks currently held by this thread, in acquisition order;
+	// 'held_count' may exceed DREADLOCK_MAX_HELD, in which case only
+	// the outermost locks are recorded
+	uint32_t held_count{0};
+	HeldLock held[DREADLOCK_MAX_HELD];
+	int level{0}; // the highest lock hierarchy level in 'held' (see DREADLOCK_LEVEL)
+
+	WaitRecord wait; // used by watched waits
+
+	uint32_t shared_thread{0}; // this thread's record in the shared table, plus one
+
+	DreadlockEventRing* event_ring{nullptr}; // this state's ring in the event log, once it has one
+	uint32_t event_thread{0}; // the thread the ring's last events came from
+
+	// a copy of 'held', and of a wait in progress, that snapshot() can
+	// read from other threads without stopping this one: a sequence
+	// lock, whose sequence is odd while this thread is changing it
+	std::atomic<uint32_t> view_sequence{0};
+	std::atomic<uint32_t> view_thread{0}; // 'thread_number'
+	std::atomic<uint32_t> view_count{0};
+	ViewLock view[DREADLOCK_MAX_HELD];
+	ViewLock view_wait;
+
+	void begin_view()
+	{
+		view_sequence.store(view_sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+
+	void end_view() { view_sequence.store(view_sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+	// republishes 'held' from index 'from' up
+	void view_held(uint32_t from)
+	{
+		auto depth{std::min<uint32_t>(held_count, DREADLOCK_MAX_HELD)};
+		begin_view();
+		for (auto i = from; i < depth; ++i)
+			view[i].set(static_cast<uint32_t>(held[i].slot - tracking) + 1, held[i].dreadlock_id, held[i].id, held[i].site, held[i].acquired_at, held[i].shared);
+		view_count.store(depth, std::memory_order_relaxed);
+		end_view();
+	}
+
+	void view_waiting(const Dreadlock* waiter, const DreadlockSite* site, int64_t since)
+	{
+		begin_view();
+		if (waiter)
+			view_wait.set(static_cast<uint32_t>(waiter->slot - tracking) + 1, waiter->this_dreadlock, waiter->id, site, since, waiter->shared);
+		else
+			view_wait.slot.store(0, std::memory_order_relaxed);
+		end_view();
+	}
+
+	// statistics for each mutex and site this thread has locked, in
+	// blocks (see StatsBlock), newest first.  the owning thread finds
+	// its entries through 'stats_index', an open-addressed table that
+	// it keeps at most half full, and that no other thread reads.
+	std::atomic<StatsBlock*> stats_blocks{nullptr};
+	std::unique_ptr<LockStats*[]> stats_index;
+	uint32_t stats_index_size{0}; // a power of two
+	uint32_t stats_count{0};
+
+	void index_stats(LockStats* stats)
+	{
+		auto mask{stats_index_size - 1};
+		auto i{stats_hash(stats->slot, stats->site) & mask};
+		while (stats_index[i])
+			i = (i + 1) & mask;
+		stats_index[i] = stats;
+	}
+};
+
+// the global lock-order graph.  nodes are ownership table indices, and
+// an edge from -> to means some thread has locked 'to' while holding
+// 'from'.  the graph is kept acyclic, along with a topological order
+// of its nodes that is maintained incrementally (Pearce & Kelly, "A
+// Dynamic Topological Sort Algorithm for Directed Acyclic Graphs"):
+// an edge that agrees with the current order costs O(1), and one that
+// doesn't only searches the nodes whose order lies between its ends.
+// an edge that would close a cycle is a lock-order inversion, and is
+// reported instead of added.  only touched under lock_order_mutex.
+struct Dreadlock::LockOrderGraph
+{
+	struct Edge
+	{
+		HeldLock from;
+		HeldLock to;
+	};
+
+	std::vector<int> order; // -1 for mutexes never seen nested
+	std::vector<std::vector<uint32_t>> successors;
+	std::vector<std::vector<uint32_t>> predecessors;
+	std::unordered_map<uint64_t, Edge> edges;
+	int next_order{0};
+
+	// search scratch space
+	std::vector<uint8_t> visited;
+	std::vector<uint32_t> parent;
+	std::vector<uint32_t> forward;
+	std::vector<uint32_t> backward;
+	std::vector<uint32_t> pending;
+
+	LockOrderGraph()
+		: order(DREADLOCK_TRACKING_CAPACITY, -1), successors(DREADLOCK_TRACKING_CAPACITY), predecessors(DREADLOCK_TRACKING_CAPACITY),
+		  visited(DREADLOCK_TRACKING_CAPACITY, 0), parent(DREADLOCK_TRACKING_CAPACITY, 0)
+	{
+	}
+
+	static uint64_t key(uint32_t from, uint32_t to) { return (static_cast<uint64_t>(from + 1) << 32) | (to + 1); }
+
+	// adds from -> to, or returns false and fills 'cycle' with the path
+	// of existing edges from 'to' back to 'from' if it would close one
+	bool add(uint32_t from, uint32_t to, std::vector<uint32_t>& cycle)
+	{
+		if (order[from] == -1)
+			order[from] = next_order++;
+		if (order[to] == -1)
+			order[to] = next_order++;
+
+		auto lower{order[to]};
+		auto upper{order[from]};
+
+		if (lower > upper)
+		{
+			successors[from].push_back(to);
+			predecessors[to].push_back(from);
+			return true;
+		}
+
+		// everything reachable from 'to' that is ordered no later than
+		// 'from'; reaching 'from' itself means a cycle
+		forward.clear();
+		pending.assign(1, to);
+		visited[to] = 1;
+		bool found{false};
+		while (!pending.empty() && !found)
+		{
+			auto node{pending.back()};
+			pending.pop_back();
+			forward.push_back(node);
+
+			for (auto next : successors[node])
 			{
-				std::unique_lock<std::mutex> printing_lock(printing_mutex);
-#if defined(_WIN32) && defined(ENABLE_WIN32_CONSOLE)
-				output_win32_console(
-					"[[ Dreadlock ]] Waited for %s in module %s:%d longer than %dms; definite performance issue, potential deadlock.\n",
-					PerformanceTimeout,
-					id.c_str(),
-					module.c_str(),
-					line);
-#endif
-				std::cout << "[[ Dreadlock ]] Waited for " << id << " in module " << module << ":" << line << " longer than " << PerformanceTimeout
-						  << "ms";
-				if (info)
+				if (visited[next] || order[next] > upper)
+					continue;
+				visited[next] = 1;
+				parent[next] = node;
+				if (next == from)
 				{
-					std::cout << ";";
-					if (!ShortModuleNames)
-						std::cout << "\n   ...";
-					if (info)
-						std::cout << " currently locked in module " << info->lock_file << ":" << info->lock_line;
+					found = true;
+					break;
 				}
-				std::cout << std::endl;
+				pending.push_back(next);
+			}
+		}
+
+		if (found)
+		{
+			cycle.clear();
+			for (auto node = from; node != to; node = parent[node])
+				cycle.push_back(node);
+			cycle.push_back(to);
+			std::reverse(cycle.begin(), cycle.end());
+
+			for (auto node : forward)
+				visited[node] = 0;
+			for (auto node : pending)
+				visited[node] = 0;
+			visited[from] = 0;
+			return false;
+		}
 
-				printing_lock.unlock();
+		// everything that reaches 'from' and is ordered no earlier than 'to'
+		backward.clear();
+		pending.assign(1, from);
+		visited[from] = 1;
+		while (!pending.empty())
+		{
+			auto node{pending.back()};
+			pending.pop_back();
+			backward.push_back(node);
 
-				reported_performance = true;
+			for (auto previous : predecessors[node])
+			{
+				if (visited[previous] || order[previous] < lower)
+					continue;
+				visited[previous] = 1;
+				pending.push_back(previous);
 			}
 		}
 
-		tracking_lock.lock();
+		// reassign the order indices of both regions so that everything
+		// that reaches 'from' comes before everything 'to' reaches
+		auto by_order = [this](uint32_t a, uint32_t b) { return order[a] < order[b]; };
+		std::sort(forward.begin(), forward.end(), by_order);
+		std::sort(backward.begin(), backward.end(), by_order);
 
-		is_locked = tracking.find(mtx_key) != tracking.end();
-		bool locked_by_me{is_locked && tracking[mtx_key].dreadlock_id == this_dreadlock};
+		std::vector<int> indices;
+		indices.reserve(forward.size() + backward.size());
+		for (auto node : backward)
+			indices.push_back(order[node]);
+		for (auto node : forward)
+			indices.push_back(order[node]);
+		std::sort(indices.begin(), indices.end());
 
-		if (!locked_by_me)
+		size_t next_index{0};
+		for (auto node : backward)
+		{
+			order[node] = indices[next_index++];
+			visited[node] = 0;
+		}
+		for (auto node : forward)
 		{
-			std::unique_lock<std::mutex> printing_lock(printing_mutex);
+			order[node] = indices[next_index++];
+			visited[node] = 0;
+		}
+
+		successors[from].push_back(to);
+		predecessors[to].push_back(from);
+		return true;
+	}
+};
+
+struct Dreadlock::LogWriter
+{
+	std::mutex wake_mutex;
+	std::condition_variable wake_cv;
+	bool woken{false};
+	std::atomic<bool> running{true};
+	std::thread thread;
+
+	void wake()
+	{
+		std::unique_lock<std::mutex> wake_lock(wake_mutex);
+		woken = true;
+		wake_lock.unlock();
+		wake_cv.notify_one();
+	}
+};
+
+struct Dreadlock::Watchdog
+{
+	std::mutex wake_mutex;
+	std::condition_variable wake_cv;
+	bool running{true}; // guarded by wake_mutex
+	std::thread thread;
+};
+
+std::atomic<uint32_t> Dreadlock::next_id{0};
+Dreadlock::TrackingSlot Dreadlock::tracking[DREADLOCK_TRACKING_CAPACITY];
+
+std::atomic<uint64_t> Dreadlock::lock_order_edges[DREADLOCK_LOCK_ORDER_CAPACITY];
+std::atomic<bool> Dreadlock::lock_order_full{false};
+std::mutex Dreadlock::lock_order_mutex;
+
+std::atomic<Dreadlock::ThreadState*> Dreadlock::thread_states{nullptr};
 #if defined(_WIN32) && defined(ENABLE_WIN32_CONSOLE)
-			output_win32_console(
-				"[[ Dreadlock ]] Deadlock detected on mutex %s in module %s:%d;\n   ... currently locked in module %s:%d\n",
-				id.c_str(),
-				module.c_str(),
-				line,
-				info->lock_file.c_str(),
-				info->lock_line);
+std::atomic<unsigned> Dreadlock::outputs{OutputConsole | OutputDebugger};
+#else
+std::atomic<unsigned> Dreadlock::outputs{OutputConsole};
+#endif
+
+std::mutex Dreadlock::printing_mutex;
+
+std::atomic<uint32_t> Dreadlock::sample_one_in{1};
+std::atomic<uint32_t> Dreadlock::sample_hot_threshold{0};
+std::atomic<uint32_t> Dreadlock::perturb_us{0};
+std::atomic<uint32_t> Dreadlock::perturb_seed{0};
+
+static FILE* output_file{nullptr}; // guarded by printing_mutex; never closed at exit so late messages still land
+
+static std::atomic<bool> tracing{false};
+static FILE* trace_file{nullptr}; // guarded by printing_mutex
+static bool trace_empty{true};
+static std::atomic<uint32_t> next_thread_number{0};
+static const int64_t stats_start{now_ns()}; // the contention report's rates are measured from here
+
+// the live copy of Dreadlock::Settings.  each setting is read with a
+// relaxed load where it's used, so configure() takes effect with the
+// next lock, without taking a lock of its own
+struct LiveSettings
+{
+	std::atomic<bool> assert_on_deadlock{AssertOnDeadlock};
+	std::atomic<int> performance_timeout{PerformanceTimeout};
+	std::atomic<int> deadlock_timeout{DeadlockTimeout};
+	std::atomic<bool> short_module_names{ShortModuleNames};
+	std::atomic<bool> blocking_wait{BlockingWait};
+	std::atomic<int> wait_poll_interval{WaitPollInterval};
+	std::atomic<int> wait_spins{WaitSpins};
+	std::atomic<int> wait_backoff{WaitBackoff};
+	std::atomic<bool> detect_lock_order{DetectLockOrder};
+	std::atomic<bool> collect_statistics{CollectStatistics};
+	std::atomic<bool> watch_waits{WatchWaits};
+	std::atomic<int> watchdog_interval{WatchdogInterval};
+	std::atomic<bool> capture_stacks{CaptureStacks};
+	std::atomic<int> contention_report{ContentionReport};
+};
+
+static LiveSettings live_settings;
+
+// timeouts overridden for a lock site; only consulted when a lock has
+// to wait, and then only if there are any
+struct SiteTimeouts
+{
+	std::string module;
+	int line;
+	int performance_timeout;
+	int deadlock_timeout;
+};
+
+static std::mutex site_timeouts_mutex;
+static std::vector<SiteTimeouts> site_timeouts;
+static std::atomic<bool> any_site_timeouts{false};
+
+// the captured call stacks (see CaptureStacks), hash-consed so that a
+// lock taken from the same place over and over costs one entry.  an
+// entry is claimed by the hash of its frames, which are written once,
+// before 'ready' is set, and never change; a stack is known by its
+// index in the table, plus one.
+struct CapturedStack
+{
+	std::atomic<uint64_t> hash{0};
+	std::atomic<bool> ready{false};
+	uint32_t depth{0};
+	void* frames[DREADLOCK_STACK_DEPTH];
+};
+
+static CapturedStack captured_stacks[DREADLOCK_STACK_CAPACITY];
+
+// captures the caller's stack, returning zero if the table is full
+static uint32_t capture_stack()
+{
+	void* frames[DREADLOCK_STACK_DEPTH + 1];
+#if defined(_WIN32)
+	auto depth{static_cast<uint32_t>(CaptureStackBackTrace(1, DREADLOCK_STACK_DEPTH, frames + 1, nullptr))};
+#else
+	auto depth{static_cast<uint32_t>(std::max(backtrace(frames, DREADLOCK_STACK_DEPTH + 1), 1)) - 1};
 #endif
-			std::cout << "[[ Dreadlock ]] Deadlock detected on mutex " << id << " in module " << module << ":" << line << ";";
-			if (!ShortModuleNames)
-				std::cout << "\n   ...";
-			std::cout << " currently locked in module " << info->lock_file << ":" << info->lock_line << std::endl;
 
-			printing_lock.unlock();
+	uint64_t hash{0xcbf29ce484222325ull};
+	for (uint32_t i = 0; i < depth; ++i)
+		hash = (hash ^ reinterpret_cast<uintptr_t>(frames[i + 1])) * 0x100000001b3ull;
+	if (!hash)
+		hash = 1; // zero marks a free entry
+
+	const size_t mask{DREADLOCK_STACK_CAPACITY - 1};
+	auto index{static_cast<size_t>(hash >> 32) & mask};
+
+	for (size_t probe = 0; probe < DREADLOCK_STACK_CAPACITY; ++probe)
+	{
+		auto& entry{captured_stacks[(index + probe) & mask]};
 
-			assert(!AssertOnDeadlock);
+		auto current{entry.hash.load(std::memory_order_acquire)};
+		if (current == 0)
+		{
+			if (entry.hash.compare_exchange_strong(current, hash, std::memory_order_acq_rel))
+			{
+				entry.depth = depth;
+				std::copy(frames + 1, frames + 1 + depth, entry.frames);
+				entry.ready.store(true, std::memory_order_release);
+				return static_cast<uint32_t>(((index + probe) & mask) + 1);
+			}
 		}
+
+		if (current != hash)
+			continue;
+
+		// claimed by the same hash; wait for its frames to compare them
+		while (!entry.ready.load(std::memory_order_acquire))
+			std::this_thread::yield();
+		if (entry.depth == depth && std::equal(frames + 1, frames + 1 + depth, entry.frames))
+			return static_cast<uint32_t>(((index + probe) & mask) + 1);
 	}
+
+	return 0;
 }
 
-void Dreadlock::unlock(const std::string& file, int line)
+// the shared ownership table (see Dreadlock::set_shared_table()), and
+// the regions of shared memory this process has named.  a region is
+// claimed by bumping the count, and published by storing its base.
+static std::atomic<DreadlockSharedHeader*> shared_table{nullptr};
+
+struct SharedRegion
 {
-	std::unique_lock<std::mutex> tracking_lock(tracking_mutex);
+	std::atomic<uintptr_t> base{0};
+	size_t size{0};
+	uint64_t id{0};
+};
 
-	auto module{file};
-	if (ShortModuleNames)
-		module = get_module_name(file);
+static SharedRegion shared_regions[DREADLOCK_SHARED_REGIONS];
+static std::atomic<uint32_t> shared_region_count{0};
+static std::atomic<uint32_t> shared_pid{0}; // this process's, updated by a fork()
 
-	auto is_locked{tracking.find(mtx_key) != tracking.end()};
-	bool locked_by_me{is_locked && tracking[mtx_key].dreadlock_id == this_dreadlock};
+static uint64_t shared_region_id(const char* name)
+{
+	uint64_t hash{0xcbf29ce484222325ull};
+	for (; *name; ++name)
+		hash = (hash ^ static_cast<unsigned char>(*name)) * 0x100000001b3ull;
+	return hash | (1ull << 63); // never a pid
+}
 
-	if (locked_by_me)
-	{
-#if defined(DREADLOCK_VERBOSE)
-		auto info{&tracking[mtx_key]};
+static void copy_text(char* to, size_t size, const char* from)
+{
+	size_t i{0};
+	for (; from && from[i] && i + 1 < size; ++i)
+		to[i] = from[i];
+	to[i] = 0;
+}
 
-		std::unique_lock<std::mutex> printing_lock(printing_mutex);
-#if defined(_WIN32) && defined(ENABLE_WIN32_CONSOLE)
-		output_win32_console(
-			"[[ Dreadlock ]] Unlocking mutex %s in module %s:%d;\n   ... locked in module %s:%d\n",
-			module.c_str(),
-			line,
-			id.c_str(),
-			info->lock_file.c_str(),
-			info->lock_line);
-#endif
-		std::cout << "[[ Dreadlock ]] Unlocking mutex " << id << " in module " << module << ":" << line << ";";
-		if (!ShortModuleNames)
-			std::cout << "\n   ...";
-		std::cout << " locked in module " << info->lock_file << ":" << info->lock_line << std::endl;
-		printing_lock.unlock();
+static uint32_t current_pid()
+{
+#if defined(_WIN32)
+	return static_cast<uint32_t>(GetCurrentProcessId());
+#else
+	return static_cast<uint32_t>(getpid());
 #endif
+}
 
-		mtx.unlock();
+// frees a process's records: its threads, its own mutexes, and its
+// ownership of any shared ones, when it exits (or is found to have
+// died without doing so)
+static void release_process(DreadlockSharedHeader* table, uint32_t pid)
+{
+	auto threads{table->threads()};
+	auto mutexes{table->mutexes()};
 
-		tracking.erase(mtx_key);
-	}
-	else
+	for (uint32_t i = 0; i < table->mutex_capacity; ++i)
 	{
-		std::unique_lock<std::mutex> printing_lock(printing_mutex);
+		auto& entry{mutexes[i]};
+		if (entry.claimed.load(std::memory_order_acquire) != DreadlockSharedMutex::InUse)
+			continue;
 
-		if (!is_locked)
+		if (entry.region == pid)
 		{
-#if defined(_WIN32) && defined(ENABLE_WIN32_CONSOLE)
-			output_win32_console("[[ Dreadlock ]] Attempt to unlock unowned mutex %s in module %s:%d\n", id.c_str(), module.c_str(), line);
-#endif
-			std::cout << "[[ Dreadlock ]] Attempt to unlock unowned mutex " << id << " in module " << module << ":" << line << std::endl;
+			entry.claimed.store(DreadlockSharedMutex::Retired, std::memory_order_release);
+			continue;
 		}
-		else if (!locked_by_me)
-		{
-			// we don't hold this lock!
 
-			auto info{&tracking[mtx_key]};
+		auto owner{entry.owner.load(std::memory_order_relaxed)};
+		if (owner && owner <= table->thread_capacity && threads[owner - 1].pid.load(std::memory_order_relaxed) == pid)
+			entry.owner.compare_exchange_strong(owner, 0, std::memory_order_relaxed);
+	}
 
-#if defined(_WIN32) && defined(ENABLE_WIN32_CONSOLE)
-			output_win32_console(
-				"[[ Dreadlock ]] Illegal unlock of mutex %s by %d in module %s:%d;\n   ... locked currently held by %d in module %s:%d\n",
-				id.c_str(),
-				this_dreadlock,
-				module.c_str(),
-				line,
-				info->dreadlock_id,
-				info->lock_file.c_str(),
-				inof->lock_line);
-#endif
-			std::cout << "[[ Dreadlock ]] Illegal unlock of mutex " << id << " by " << this_dreadlock << " in module " << module << ":" << line
-					  << ";";
-			if (!ShortModuleNames)
-				std::cout << "\n   ...";
-			std::cout << " locked currently held by " << info->dreadlock_id << " in module " << info->lock_file << ":" << info->lock_line
-					  << std::endl;
-		}
+	for (uint32_t i = 0; i < table->thread_capacity; ++i)
+	{
+		auto current{pid};
+		threads[i].pid.compare_exchange_strong(current, 0, std::memory_order_release);
+	}
+}
 
-		printing_lock.unlock();
+// the binary event log (see Dreadlock::set_event_log()).  each name
+// and site goes into its string area once, and is found again through
+// 'event_strings', keyed by its address: the first thread to claim a
+// key writes the text, and storing the offset publishes it.
+static std::atomic<DreadlockEventLogHeader*> event_log{nullptr};
 
-		assert(false);
+struct EventString
+{
+	std::atomic<const void*> key{nullptr};
+	std::atomic<uint32_t> offset{0}; // in the string area, plus one; NoRoom if it didn't fit
+	static constexpr uint32_t NoRoom{~0u};
+};
+
+static EventString event_strings[DREADLOCK_EVENT_LOG_STRING_CAPACITY];
+
+static_assert((DREADLOCK_EVENT_LOG_CAPACITY & (DREADLOCK_EVENT_LOG_CAPACITY - 1)) == 0, "DREADLOCK_EVENT_LOG_CAPACITY must be a power of two");
+static_assert((DREADLOCK_EVENT_LOG_STRING_CAPACITY & (DREADLOCK_EVENT_LOG_STRING_CAPACITY - 1)) == 0, "DREADLOCK_EVENT_LOG_STRING_CAPACITY must be a power of two");
+static_assert(DREADLOCK_EVENT_LOG_STRINGS % 64 == 0, "DREADLOCK_EVENT_LOG_STRINGS must be a multiple of 64");
+
+// returns the offset (plus one) of a name (with line < 0) or a site in
+// the string area, writing it there first if this is its first use,
+// or zero if there's no room for it
+static uint32_t event_string(DreadlockEventLogHeader* log, const void* key, const char* text, int line)
+{
+	if (!key || !text)
+		return 0;
+
+	constexpr uint32_t mask{DREADLOCK_EVENT_LOG_STRING_CAPACITY - 1};
+	auto index{static_cast<uint32_t>((reinterpret_cast<uintptr_t>(key) >> 3) * 0x9e3779b97f4a7c15ull >> 40)};
+	for (uint32_t probe = 0; probe < 64; ++probe)
+	{
+		auto& entry{event_strings[(index + probe) & mask]};
+		auto current{entry.key.load(std::memory_order_acquire)};
+		if (!current && entry.key.compare_exchange_strong(current, key, std::memory_order_acq_rel))
+		{
+			char buffer[512];
+			auto length{line < 0 ? snprintf(buffer, sizeof(buffer), "%s", text) : snprintf(buffer, sizeof(buffer), "%s:%d", text, line)};
+			auto size{static_cast<uint32_t>(std::min<int>(std::max(length, 0), sizeof(buffer) - 1)) + 1};
+
+			auto offset{log->strings_used.fetch_add(size, std::memory_order_relaxed)};
+			auto result{EventString::NoRoom};
+			if (offset <= log->string_capacity && size <= log->string_capacity - offset)
+			{
+				memcpy(log->strings() + offset, buffer, size);
+				result = offset + 1;
+			}
+
+			entry.offset.store(result, std::memory_order_release);
+			return result == EventString::NoRoom ? 0 : result;
+		}
+
+		if (current == key)
+		{
+			uint32_t offset;
+			while (!(offset = entry.offset.load(std::memory_order_acquire)))
+				std::this_thread::yield(); // being written
+			return offset == EventString::NoRoom ? 0 : offset;
+		}
+	}
+
+	return 0;
+}
+
+// the sites and names of the drop-in lock types (see
+// Dreadlock::site_at() and name_at()).  a record is claimed by moving
+// its state from free to being written, and published by moving it on
+// to ready.
+enum RuntimeRecordState : uint32_t
+{
+	RecordFree,
+	RecordWriting,
+	RecordReady,
+};
+
+struct RuntimeSite
+{
+	std::atomic<uint32_t> state{RecordFree};
+	DreadlockSite site;
+};
+
+struct RuntimeName
+{
+	std::atomic<uint32_t> state{RecordFree};
+	const void* mutex{nullptr};
+	char name[32];
+};
+
+static RuntimeSite runtime_sites[DREADLOCK_RUNTIME_SITES];
+static RuntimeName runtime_names[DREADLOCK_RUNTIME_NAMES];
+static const DreadlockSite unknown_runtime_site{"(unknown)", "(unknown)", 0};
+
+static_assert((DREADLOCK_RUNTIME_SITES & (DREADLOCK_RUNTIME_SITES - 1)) == 0, "DREADLOCK_RUNTIME_SITES must be a power of two");
+static_assert((DREADLOCK_RUNTIME_NAMES & (DREADLOCK_RUNTIME_NAMES - 1)) == 0, "DREADLOCK_RUNTIME_NAMES must be a power of two");
+
+// finds the record 'matches' accepts in 'records', claiming a free one
+// and filling it in with 'write' if there's none yet
+template <typename Record, size_t Count, typename Matches, typename Write>
+static Record* runtime_record(Record (&records)[Count], uint64_t key, Matches matches, Write write)
+{
+	constexpr uint64_t mask{Count - 1};
+	auto index{(key * 0x9E3779B97F4A7C15ull) >> 40};
+
+	for (uint64_t probe = 0; probe < 64; ++probe)
+	{
+		auto& record{records[(index + probe) & mask]};
+		auto state{record.state.load(std::memory_order_acquire)};
+
+		if (state == RecordFree && record.state.compare_exchange_strong(state, RecordWriting, std::memory_order_acquire))
+		{
+			write(record);
+			record.state.store(RecordReady, std::memory_order_release);
+			return &record;
+		}
+
+		while (state == RecordWriting)
+		{
+			std::this_thread::yield();
+			state = record.state.load(std::memory_order_acquire);
+		}
+
+		if (matches(record))
+			return &record;
+	}
+
+	return nullptr;
+}
+
+static void environment_flag(const char* name, bool& value)
+{
+	auto text{getenv(name)};
+	if (text && *text)
+		value = !(!strcmp(text, "0") || !strcmp(text, "false") || !strcmp(text, "no") || !strcmp(text, "off"));
+}
+
+static void environment_number(const char* name, int& value)
+{
+	auto text{getenv(name)};
+	char* end{nullptr};
+	if (text && *text)
+	{
+		auto number{strtol(text, &end, 10)};
+		if (!*end)
+			value = static_cast<int>(number);
+	}
+}
+
+// applies the DREADLOCK_* environment variables when the program
+// starts, so settings can be changed without rebuilding
+static struct EnvironmentSettings
+{
+	EnvironmentSettings()
+	{
+		auto settings{Dreadlock::settings()};
+		environment_flag("DREADLOCK_ASSERT_ON_DEADLOCK", settings.assert_on_deadlock);
+		environment_number("DREADLOCK_PERFORMANCE_TIMEOUT", settings.performance_timeout);
+		environment_number("DREADLOCK_DEADLOCK_TIMEOUT", settings.deadlock_timeout);
+		environment_flag("DREADLOCK_SHORT_MODULE_NAMES", settings.short_module_names);
+		environment_flag("DREADLOCK_BLOCKING_WAIT", settings.blocking_wait);
+		environment_number("DREADLOCK_WAIT_POLL_INTERVAL", settings.wait_poll_interval);
+		environment_number("DREADLOCK_WAIT_SPINS", settings.wait_spins);
+		environment_number("DREADLOCK_WAIT_BACKOFF", settings.wait_backoff);
+		environment_flag("DREADLOCK_DETECT_LOCK_ORDER", settings.detect_lock_order);
+		environment_flag("DREADLOCK_COLLECT_STATISTICS", settings.collect_statistics);
+		environment_flag("DREADLOCK_WATCH_WAITS", settings.watch_waits);
+		environment_number("DREADLOCK_WATCHDOG_INTERVAL", settings.watchdog_interval);
+		environment_flag("DREADLOCK_CAPTURE_STACKS", settings.capture_stacks);
+		environment_number("DREADLOCK_CONTENTION_REPORT", settings.contention_report);
+		Dreadlock::configure(settings);
+
+		// "one_in" or "one_in,hot_threshold"
+		if (auto sample = getenv("DREADLOCK_SAMPLE"))
+		{
+			char* end{nullptr};
+			auto one_in{strtoul(sample, &end, 10)};
+			auto hot_threshold{*end == ',' ? strtoul(end + 1, &end, 10) : 0};
+			if (end != sample && !*end)
+				Dreadlock::set_sampling(static_cast<uint32_t>(one_in), static_cast<uint32_t>(hot_threshold));
+		}
+
+		// "max_us" or "max_us,seed"
+		if (auto perturb = getenv("DREADLOCK_PERTURB"))
+		{
+			char* end{nullptr};
+			auto max_us{strtoul(perturb, &end, 10)};
+			auto seed{*end == ',' ? strtoul(end + 1, &end, 10) : 0};
+			if (end != perturb && !*end)
+				Dreadlock::set_perturbation(static_cast<uint32_t>(max_us), static_cast<uint32_t>(seed));
+		}
+
+		auto trace{getenv("DREADLOCK_TRACE")};
+		if (trace && *trace)
+			Dreadlock::set_trace(trace);
+
+		auto shared{getenv("DREADLOCK_SHARED_TABLE")};
+		if (shared && *shared)
+			Dreadlock::set_shared_table(shared);
+
+		auto event_log_path{getenv("DREADLOCK_EVENT_LOG")};
+		if (event_log_path && *event_log_path)
+			Dreadlock::set_event_log(event_log_path);
+	}
+} environment_settings;
+
+void Dreadlock::configure(const Settings& settings)
+{
+	live_settings.assert_on_deadlock.store(settings.assert_on_deadlock, std::memory_order_relaxed);
+	live_settings.performance_timeout.store(settings.performance_timeout, std::memory_order_relaxed);
+	live_settings.deadlock_timeout.store(settings.deadlock_timeout, std::memory_order_relaxed);
+	live_settings.short_module_names.store(settings.short_module_names, std::memory_order_relaxed);
+	live_settings.blocking_wait.store(settings.blocking_wait, std::memory_order_relaxed);
+	live_settings.wait_poll_interval.store(settings.wait_poll_interval, std::memory_order_relaxed);
+	live_settings.wait_spins.store(settings.wait_spins, std::memory_order_relaxed);
+	live_settings.wait_backoff.store(settings.wait_backoff, std::memory_order_relaxed);
+	live_settings.detect_lock_order.store(settings.detect_lock_order, std::memory_order_relaxed);
+	live_settings.collect_statistics.store(settings.collect_statistics, std::memory_order_relaxed);
+	live_settings.watch_waits.store(settings.watch_waits, std::memory_order_relaxed);
+	live_settings.watchdog_interval.store(settings.watchdog_interval, std::memory_order_relaxed);
+	live_settings.capture_stacks.store(settings.capture_stacks, std::memory_order_relaxed);
+	live_settings.contention_report.store(settings.contention_report, std::memory_order_relaxed);
+
+	if (settings.contention_report)
+		log_writer(); // which prints the reports
+}
+
+Dreadlock::Settings Dreadlock::settings()
+{
+	Settings settings;
+	settings.assert_on_deadlock = live_settings.assert_on_deadlock.load(std::memory_order_relaxed);
+	settings.performance_timeout = live_settings.performance_timeout.load(std::memory_order_relaxed);
+	settings.deadlock_timeout = live_settings.deadlock_timeout.load(std::memory_order_relaxed);
+	settings.short_module_names = live_settings.short_module_names.load(std::memory_order_relaxed);
+	settings.blocking_wait = live_settings.blocking_wait.load(std::memory_order_relaxed);
+	settings.wait_poll_interval = live_settings.wait_poll_interval.load(std::memory_order_relaxed);
+	settings.wait_spins = live_settings.wait_spins.load(std::memory_order_relaxed);
+	settings.wait_backoff = live_settings.wait_backoff.load(std::memory_order_relaxed);
+	settings.detect_lock_order = live_settings.detect_lock_order.load(std::memory_order_relaxed);
+	settings.collect_statistics = live_settings.collect_statistics.load(std::memory_order_relaxed);
+	settings.watch_waits = live_settings.watch_waits.load(std::memory_order_relaxed);
+	settings.watchdog_interval = live_settings.watchdog_interval.load(std::memory_order_relaxed);
+	settings.capture_stacks = live_settings.capture_stacks.load(std::memory_order_relaxed);
+	settings.contention_report = live_settings.contention_report.load(std::memory_order_relaxed);
+	return settings;
+}
+
+void Dreadlock::set_mutex_timeouts(void* mtx, int performance_ms, int deadlock_ms)
+{
+	// claims the mutex's slot now if it has never been locked
+	auto slot{find_slot(reinterpret_cast<size_t>(mtx))};
+	if (!slot)
+		return; // the table is full; the first lock will report it
+
+	slot->performance_timeout.store(performance_ms, std::memory_order_relaxed);
+	slot->deadlock_timeout.store(deadlock_ms, std::memory_order_relaxed);
+}
+
+void Dreadlock::set_site_timeouts(const char* module, int line, int performance_ms, int deadlock_ms)
+{
+	std::unique_lock<std::mutex> site_timeouts_lock(site_timeouts_mutex);
+
+	for (auto& entry : site_timeouts)
+	{
+		if (entry.module == module && entry.line == line)
+		{
+			entry.performance_timeout = performance_ms;
+			entry.deadlock_timeout = deadlock_ms;
+			return;
+		}
+	}
+
+	site_timeouts.push_back(SiteTimeouts{module, line, performance_ms, deadlock_ms});
+	any_site_timeouts.store(true, std::memory_order_release);
+}
+
+void Dreadlock::timeouts_for(const DreadlockSite& site, int& performance_ms, int& deadlock_ms)
+{
+	// a site setting beats a mutex setting beats the global one, and a
+	// setting for a site's line beats one for its whole module
+
+	performance_ms = live_settings.performance_timeout.load(std::memory_order_relaxed);
+	deadlock_ms = live_settings.deadlock_timeout.load(std::memory_order_relaxed);
+
+	auto mutex_performance{slot->performance_timeout.load(std::memory_order_relaxed)};
+	if (mutex_performance >= 0)
+		performance_ms = mutex_performance;
+	auto mutex_deadlock{slot->deadlock_timeout.load(std::memory_order_relaxed)};
+	if (mutex_deadlock >= 0)
+		deadlock_ms = mutex_deadlock;
+
+	if (!any_site_timeouts.load(std::memory_order_acquire))
+		return;
+
+	std::unique_lock<std::mutex> site_timeouts_lock(site_timeouts_mutex);
+
+	const SiteTimeouts* module_match{nullptr};
+	const SiteTimeouts* line_match{nullptr};
+	for (const auto& entry : site_timeouts)
+	{
+		if (entry.module != site.module && entry.module != site.file)
+			continue;
+		if (entry.line == site.line)
+			line_match = &entry;
+		else if (!entry.line)
+			module_match = &entry;
+	}
+
+	for (auto match : {module_match, line_match})
+	{
+		if (match && match->performance_timeout >= 0)
+			performance_ms = match->performance_timeout;
+		if (match && match->deadlock_timeout >= 0)
+			deadlock_ms = match->deadlock_timeout;
+	}
+}
+
+const char* Dreadlock::module_name(const DreadlockSite* site)
+{
+	return live_settings.short_module_names.load(std::memory_order_relaxed) ? site->module : site->file;
+}
+
+void Dreadlock::destruct_unlock()
+{
+	// this instance still owns the mutex, so it was
+	// instantiated without an explicit unlock
+
+	static constexpr DreadlockSite destructor_site{"Dreadlock::~Dreadlock()", "Dreadlock::~Dreadlock()", __LINE__};
+
+	unlock(destruct_site ? *destruct_site : destructor_site);
+}
+
+#if defined(_WIN32) && defined(ENABLE_WIN32_CONSOLE)
+int Dreadlock::output_win32_console(const char* format, ...)
+{
+	static char s_printf_buf[1024];
+	va_list args;
+	va_start(args, format);
+	_vsnprintf_s(s_printf_buf, sizeof(s_printf_buf), sizeof(s_printf_buf), format, args);
+	va_end(args);
+	OutputDebugStringA(s_printf_buf);
+	return 0;
+}
+#endif
+
+Dreadlock::TrackingSlot* Dreadlock::find_slot(size_t key)
+{
+	// fibonacci hashing spreads the (heavily aligned) mutex addresses
+	// across the table; open addressing with linear probing then finds
+	// the slot, claiming an empty one on the first lock of a mutex
+
+	const size_t mask{DREADLOCK_TRACKING_CAPACITY - 1};
+	auto index{static_cast<size_t>((static_cast<uint64_t>(key) * 0x9E3779B97F4A7C15ull) >> 32) & mask};
+
+	for (size_t probe = 0; probe < DREADLOCK_TRACKING_CAPACITY; ++probe)
+	{
+		auto& candidate{tracking[(index + probe) & mask]};
+
+		auto current{candidate.key.load(std::memory_order_acquire)};
+		if (current == key)
+			return &candidate;
+
+		if (current == 0)
+		{
+			if (candidate.key.compare_exchange_strong(current, key, std::memory_order_acq_rel))
+				return &candidate;
+			if (current == key)
+				return &candidate; // another thread claimed it for the same mutex
+		}
+	}
+
+	return nullptr; // the table is full
+}
+
+uint32_t Dreadlock::allocate_id()
+{
+	// each thread takes instance ids from the shared counter a block
+	// at a time, so the counter is only touched once per block.  zero
+	// is reserved for "unowned" in the ownership table, and is skipped
+	// (along with the rest of the block) if the counter ever wraps.
+
+	static const uint32_t IdBlock{1024};
+	static thread_local uint32_t next{0};
+	static thread_local uint32_t last{0};
+
+	if (next == last)
+	{
+		next = next_id.fetch_add(IdBlock, std::memory_order_relaxed);
+		last = next + IdBlock;
+		if (next == 0)
+			++next;
+	}
+
+	return next++;
+}
+
+Dreadlock::ThreadState& Dreadlock::thread_state()
+{
+	// hands the state back to the pool when the thread exits.  any
+	// locks it still holds are forgotten, so they aren't mistaken for
+	// the next owner's.
+	struct Holder
+	{
+		ThreadState* state{nullptr};
+		~Holder()
+		{
+			if (state)
+			{
+				state->held_count = 0;
+				state->level = 0;
+				state->view_held(0);
+				if (auto table = shared_table.load(std::memory_order_acquire); table && state->shared_thread)
+				{
+					auto pid{shared_pid.load(std::memory_order_relaxed)};
+					table->threads()[state->shared_thread - 1].pid.compare_exchange_strong(pid, 0, std::memory_order_release);
+				}
+				state->shared_thread = 0;
+				if (state->event_ring)
+				{
+					DreadlockEvent event{};
+					event.kind = DreadlockEvent::ThreadExited;
+					append_event(*state, event);
+				}
+				state->in_use.store(false, std::memory_order_release);
+			}
+		}
+	};
+
+	static thread_local Holder holder;
+	if (holder.state)
+		return *holder.state;
+
+	for (auto state = thread_states.load(std::memory_order_acquire); state; state = state->next)
+	{
+		bool expected{false};
+		if (!state->in_use.load(std::memory_order_relaxed) && state->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire))
+		{
+			state->thread_number = next_thread_number.fetch_add(1, std::memory_order_relaxed) + 1;
+			state->view_thread.store(state->thread_number, std::memory_order_relaxed);
+			holder.state = state;
+			return *state;
+		}
+	}
+
+	log_writer(); // whose ticks also calibrate the clock
+
+	auto state{new ThreadState};
+	state->in_use.store(true, std::memory_order_relaxed);
+	state->thread_number = next_thread_number.fetch_add(1, std::memory_order_relaxed) + 1;
+	state->view_thread.store(state->thread_number, std::memory_order_relaxed);
+	state->next = thread_states.load(std::memory_order_relaxed);
+	while (!thread_states.compare_exchange_weak(state->next, state, std::memory_order_release, std::memory_order_relaxed))
+		;
+
+	holder.state = state;
+	return *state;
+}
+
+Dreadlock::LogWriter& Dreadlock::log_writer()
+{
+	// created on first use and never destroyed, so threads that are
+	// still logging during static destruction always have a writer to
+	// talk to.  the atexit() handler stops the thread and drains what
+	// is left; anything raised after that is written synchronously.
+	static LogWriter* writer{[] {
+		auto writer{new LogWriter};
+		writer->thread = std::thread([writer] {
+			counter_clock.tick();
+			auto last_report{now_ns()};
+			while (writer->running.load(std::memory_order_relaxed))
+			{
+				std::unique_lock<std::mutex> wake_lock(writer->wake_mutex);
+				writer->wake_cv.wait_for(wake_lock, 20ms, [writer] { return writer->woken || !writer->running.load(std::memory_order_relaxed); });
+				writer->woken = false;
+				wake_lock.unlock();
+
+				drain_log();
+				drain_trace();
+				counter_clock.tick();
+
+				auto report_interval{live_settings.contention_report.load(std::memory_order_relaxed)};
+				auto now{now_ns()};
+				if (report_interval > 0 && now - last_report >= report_interval * 1000000000ll)
+				{
+					dump_contention();
+					last_report = now;
+				}
+			}
+		});
+
+		std::atexit([] {
+			auto& writer{log_writer()};
+			writer.running.store(false, std::memory_order_relaxed);
+			writer.wake();
+			if (writer.thread.joinable())
+				writer.thread.join();
+			drain_log();
+			if (live_settings.contention_report.load(std::memory_order_relaxed))
+				dump_contention();
+			set_trace(nullptr);
+		});
+
+		return writer;
+	}()};
+
+	return *writer;
+}
+
+Dreadlock::Watchdog& Dreadlock::watchdog()
+{
+	// started by the first watched wait, and stopped at exit
+	static Watchdog* watchdog{[] {
+		auto watchdog{new Watchdog};
+		watchdog->thread = std::thread([watchdog] {
+			std::unique_lock<std::mutex> wake_lock(watchdog->wake_mutex);
+			while (watchdog->running)
+			{
+				auto interval{std::max(1, live_settings.watchdog_interval.load(std::memory_order_relaxed))};
+				watchdog->wake_cv.wait_for(wake_lock, std::chrono::milliseconds(interval), [watchdog] { return !watchdog->running; });
+				if (!watchdog->running)
+					break;
+
+				wake_lock.unlock();
+				watch_waits();
+				wake_lock.lock();
+			}
+		});
+
+		std::atexit([] {
+			auto& watchdog{Dreadlock::watchdog()};
+			std::unique_lock<std::mutex> wake_lock(watchdog.wake_mutex);
+			watchdog.running = false;
+			wake_lock.unlock();
+			watchdog.wake_cv.notify_one();
+			if (watchdog.thread.joinable())
+				watchdog.thread.join();
+		});
+
+		return watchdog;
+	}()};
+
+	return *watchdog;
+}
+
+void Dreadlock::set_output(unsigned new_outputs, const char* path)
+{
+	flush();
+
+	std::unique_lock<std::mutex> printing_lock(printing_mutex);
+
+	if (output_file)
+	{
+		fclose(output_file);
+		output_file = nullptr;
+	}
+
+	if ((new_outputs & OutputFile) && path)
+		output_file = fopen(path, "a");
+
+	outputs.store(new_outputs, std::memory_order_relaxed);
+}
+
+void Dreadlock::set_sampling(uint32_t one_in, uint32_t hot_threshold)
+{
+	sample_one_in.store(one_in, std::memory_order_relaxed);
+	sample_hot_threshold.store(hot_threshold, std::memory_order_relaxed);
+}
+
+void Dreadlock::set_perturbation(uint32_t max_us, uint32_t seed)
+{
+	perturb_seed.store(seed, std::memory_order_relaxed);
+	perturb_us.store(max_us, std::memory_order_relaxed);
+}
+
+void Dreadlock::flush()
+{
+	drain_log();
+	drain_trace();
+}
+
+bool Dreadlock::set_trace(const char* path)
+{
+	log_writer(); // so the trace is completed at exit
+
+	tracing.store(false, std::memory_order_relaxed);
+	drain_trace();
+
+	std::unique_lock<std::mutex> printing_lock(printing_mutex);
+
+	if (trace_file)
+	{
+		fputs("\n]\n", trace_file);
+		fclose(trace_file);
+		trace_file = nullptr;
+	}
+
+	if (!path)
+		return true;
+
+	trace_file = fopen(path, "w");
+	if (!trace_file)
+		return false;
+
+	fputs("[", trace_file);
+	trace_empty = true;
+	tracing.store(true, std::memory_order_relaxed);
+
+	return true;
+}
+
+int Dreadlock::format_event(const LogEvent& event, char* buffer, size_t size)
+{
+	auto module{module_name(event.site)};
+	auto line{event.site->line};
+	auto owner_module{event.owner_site ? module_name(event.owner_site) : ""};
+	auto owner_line{event.owner_site ? event.owner_site->line : 0};
+	auto more{live_settings.short_module_names.load(std::memory_order_relaxed) ? "" : "\n   ..."};
+
+	// who holds the mutex, for the reports that say
+	char holder[256];
+	if (event.readers && event.owner_site)
+		snprintf(holder, sizeof(holder), "currently shared by %u owners, including module %s:%d", event.readers, owner_module, owner_line);
+	else if (event.readers)
+		snprintf(holder, sizeof(holder), "currently shared by %u owners", event.readers);
+	else if (event.owner_site)
+		snprintf(holder, sizeof(holder), "currently locked in module %s:%d", owner_module, owner_line);
+	else
+		snprintf(holder, sizeof(holder), "currently locked outside of Dreadlock's tracking (or sample)");
+
+	switch (event.kind)
+	{
+		case LogKind::Locking:
+			return snprintf(buffer, size, "[[ Dreadlock ]] Locking %s in module %s:%d", event.id, module, line);
+
+		case LogKind::Attempting:
+			return snprintf(buffer, size, "[[ Dreadlock ]] Attempting to lock mutex %s in module %s:%d;%s %s", event.id, module, line, more, holder);
+
+		case LogKind::Unlocking:
+			if (!event.owner_site)
+				return snprintf(buffer, size, "[[ Dreadlock ]] Unlocking mutex %s in module %s:%d", event.id, module, line);
+			return snprintf(buffer,
+							size,
+							"[[ Dreadlock ]] Unlocking mutex %s in module %s:%d;%s locked in module %s:%d",
+							event.id,
+							module,
+							line,
+							more,
+							owner_module,
+							owner_line);
+
+		case LogKind::TableFull:
+			return snprintf(buffer,
+							size,
+							"[[ Dreadlock ]] Ownership table is full; mutex %s in module %s:%d will not be tracked (increase DREADLOCK_TRACKING_CAPACITY)",
+							event.id,
+							module,
+							line);
+
+		case LogKind::IllegalLock:
+			if (!event.owner_site)
+				return snprintf(buffer, size, "[[ Dreadlock ]] Illegal lock of mutex %s in module %s:%d when already held!", event.id, module, line);
+			return snprintf(buffer,
+							size,
+							"[[ Dreadlock ]] Illegal lock of mutex %s in module %s:%d when already held!;%s currently locked in module %s:%d",
+							event.id,
+							module,
+							line,
+							more,
+							owner_module,
+							owner_line);
+
+		case LogKind::PerformanceWait:
+			if (!event.owner_site && !event.readers)
+				return snprintf(buffer, size, "[[ Dreadlock ]] Waited for %s in module %s:%d longer than %dms", event.id, module, line, event.value);
+			return snprintf(buffer,
+							size,
+							"[[ Dreadlock ]] Waited for %s in module %s:%d longer than %dms;%s %s",
+							event.id,
+							module,
+							line,
+							event.value,
+							more,
+							holder);
+
+		case LogKind::Deadlock:
+			return snprintf(buffer, size, "[[ Dreadlock ]] Deadlock detected on mutex %s in module %s:%d;%s %s", event.id, module, line, more, holder);
+
+		case LogKind::ForeignUnlock:
+			return snprintf(buffer, size, "[[ Dreadlock ]] Illegal unlock of mutex %s in module %s:%d by a thread that didn't lock it", event.id, module, line);
+
+		case LogKind::UnlockUnowned:
+			return snprintf(buffer, size, "[[ Dreadlock ]] Attempt to unlock unowned mutex %s in module %s:%d", event.id, module, line);
+
+		case LogKind::IllegalUnlock:
+			if (event.readers)
+				return snprintf(buffer,
+								size,
+								"[[ Dreadlock ]] Illegal unlock of mutex %s by %u in module %s:%d;%s %s",
+								event.id,
+								event.dreadlock_id,
+								module,
+								line,
+								more,
+								holder);
+			return snprintf(buffer,
+							size,
+							"[[ Dreadlock ]] Illegal unlock of mutex %s by %u in module %s:%d;%s locked currently held by %u in module %s:%d",
+							event.id,
+							event.dreadlock_id,
+							module,
+							line,
+							more,
+							event.owner_id,
+							owner_module,
+							owner_line);
+
+		case LogKind::LockOrder:
+			return snprintf(buffer,
+							size,
+							"[[ Dreadlock ]] Potential deadlock: locking mutex %s in module %s:%d while holding %s (locked in module %s:%d) inverts the lock "
+							"order established by:",
+							event.id,
+							module,
+							line,
+							event.owner_name,
+							owner_module,
+							owner_line);
+
+		case LogKind::LockOrderEdge:
+			return snprintf(buffer,
+							size,
+							"   ... %s locked in module %s:%d while holding %s locked in module %s:%d",
+							event.id,
+							module,
+							line,
+							event.owner_name,
+							owner_module,
+							owner_line);
+
+		case LogKind::Starvation:
+			return snprintf(buffer,
+							size,
+							"[[ Dreadlock ]] Starvation: waited for %s in module %s:%d longer than %dms while it was acquired %u times by others;%s %s",
+							event.id,
+							module,
+							line,
+							event.value,
+							event.count,
+							more,
+							holder);
+
+		case LogKind::SharedUpgrade:
+			return snprintf(buffer,
+							size,
+							"[[ Dreadlock ]] Illegal exclusive lock of mutex %s in module %s:%d by a thread that holds it shared (upgrading will deadlock);%s shared in "
+							"module %s:%d",
+							event.id,
+							module,
+							line,
+							more,
+							owner_module,
+							owner_line);
+
+		case LogKind::SharedWhileExclusive:
+			return snprintf(buffer,
+							size,
+							"[[ Dreadlock ]] Illegal shared lock of mutex %s in module %s:%d by a thread that holds it exclusively;%s locked in module %s:%d",
+							event.id,
+							module,
+							line,
+							more,
+							owner_module,
+							owner_line);
+
+		case LogKind::SharedRelock:
+			return snprintf(buffer,
+							size,
+							"[[ Dreadlock ]] Recursive shared lock of mutex %s in module %s:%d will deadlock if a writer is waiting;%s already shared in module %s:%d",
+							event.id,
+							module,
+							line,
+							more,
+							owner_module,
+							owner_line);
+
+		case LogKind::LevelInversion:
+			return snprintf(buffer,
+							size,
+							"[[ Dreadlock ]] Lock hierarchy inverted: locking mutex %s (level %d) in module %s:%d while holding %s (level %u),%s locked in module %s:%d",
+							event.id,
+							event.value,
+							module,
+							line,
+							event.owner_name,
+							event.count,
+							more,
+							owner_module,
+							owner_line);
+
+		case LogKind::LockOrderFull:
+			return snprintf(buffer,
+							size,
+							"[[ Dreadlock ]] Lock-order table is full; mutex %s in module %s:%d and any new pair of mutexes will not be checked (increase DREADLOCK_LOCK_ORDER_CAPACITY)",
+							event.id,
+							module,
+							line);
+
+		case LogKind::OverBudget:
+		{
+			char held[16], budget[16];
+			format_duration(held, sizeof(held), event.duration);
+			format_duration(budget, sizeof(budget), event.limit);
+			return snprintf(buffer,
+							size,
+							"[[ Dreadlock ]] Held %s for %s, over its %s budget; locked in module %s:%d,%s unlocked in module %s:%d",
+							event.id,
+							held,
+							budget,
+							owner_module,
+							owner_line,
+							more,
+							module,
+							line);
+		}
+	}
+
+	return 0;
+}
+
+void Dreadlock::drain_log()
+{
+	std::unique_lock<std::mutex> printing_lock(printing_mutex);
+
+	std::vector<LogEvent> batch;
+	uint32_t dropped{0};
+
+	for (auto state = thread_states.load(std::memory_order_acquire); state; state = state->next)
+	{
+		auto tail{state->log_tail.load(std::memory_order_relaxed)};
+		auto head{state->log_head.load(std::memory_order_acquire)};
+
+		for (; tail != head; ++tail)
+			batch.push_back(state->log[tail & (DREADLOCK_LOG_CAPACITY - 1)]);
+
+		state->log_tail.store(tail, std::memory_order_release);
+		dropped += state->log_dropped.exchange(0, std::memory_order_relaxed);
+	}
+
+	if (batch.empty() && !dropped)
+		return;
+
+	// put the events raised by different threads back in order
+	std::stable_sort(batch.begin(), batch.end(), [](const LogEvent& a, const LogEvent& b) { return a.timestamp < b.timestamp; });
+
+	auto current_outputs{outputs.load(std::memory_order_relaxed)};
+	char buffer[1024];
+
+	for (const auto& event : batch)
+	{
+		if (format_event(event, buffer, sizeof(buffer)) >= 0)
+			write_output(buffer, current_outputs);
+
+		// the stacks are only worth their length on a deadlock
+		if (event.kind == LogKind::Deadlock)
+		{
+			write_stack("   waiting in:", event.stack, current_outputs);
+			write_stack("   owner locked it in:", event.owner_stack, current_outputs);
+		}
+	}
+
+	if (dropped)
+	{
+		snprintf(buffer, sizeof(buffer), "[[ Dreadlock ]] %u verbose and over-budget messages were dropped (increase DREADLOCK_LOG_CAPACITY)", dropped);
+		write_output(buffer, current_outputs);
+	}
+
+	if (current_outputs & OutputConsole)
+		std::cout.flush();
+	if ((current_outputs & OutputFile) && output_file)
+		fflush(output_file);
+}
+
+// writes a JSON string, without the quotes
+static void trace_string(const char* text)
+{
+	for (; *text; ++text)
+	{
+		if (*text == '"' || *text == '\\')
+			fputc('\\', trace_file);
+		if (static_cast<unsigned char>(*text) >= ' ')
+			fputc(*text, trace_file);
+	}
+}
+
+void Dreadlock::drain_trace()
+{
+	std::unique_lock<std::mutex> printing_lock(printing_mutex);
+
+	uint32_t dropped{0};
+
+	for (auto state = thread_states.load(std::memory_order_acquire); state; state = state->next)
+	{
+		auto trace{state->trace.load(std::memory_order_acquire)};
+		if (!trace)
+			continue;
+
+		auto tail{state->trace_tail.load(std::memory_order_relaxed)};
+		auto head{state->trace_head.load(std::memory_order_acquire)};
+
+		for (; trace_file && tail != head; ++tail)
+		{
+			const auto& event{trace[tail & (DREADLOCK_TRACE_CAPACITY - 1)]};
+
+			// timestamps are in microseconds
+			fputs(trace_empty ? "\n" : ",\n", trace_file);
+			trace_empty = false;
+
+			switch (event.kind)
+			{
+				case TraceEvent::Hold:
+				case TraceEvent::Wait:
+					fputs(event.kind == TraceEvent::Wait ? "{\"name\":\"wait " : "{\"name\":\"", trace_file);
+					trace_string(event.id);
+					fprintf(trace_file,
+							"\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{\"site\":\"",
+							event.kind == TraceEvent::Wait ? "wait" : "lock",
+							event.start / 1000.0,
+							(event.end - event.start) / 1000.0,
+							event.thread);
+					trace_string(module_name(event.site));
+					fprintf(trace_file, ":%d\",\"dreadlock_id\":%u,\"mode\":\"%s\"", event.site->line, event.dreadlock_id, event.shared ? "shared" : "exclusive");
+					if (event.other_site)
+					{
+						fputs(event.kind == TraceEvent::Wait ? ",\"owner\":\"" : ",\"released\":\"", trace_file);
+						trace_string(module_name(event.other_site));
+						fprintf(trace_file, ":%d\"", event.other_site->line);
+					}
+					if (event.kind == TraceEvent::Wait && event.other_id)
+						fprintf(trace_file, ",\"owner_id\":%u", event.other_id);
+					if (event.readers)
+						fprintf(trace_file, ",\"readers\":%u", event.readers);
+					fputs("}}", trace_file);
+					break;
+
+				case TraceEvent::CvWait:
+					fputs("{\"name\":\"cv wait ", trace_file);
+					trace_string(event.id);
+					fprintf(trace_file,
+							"\",\"cat\":\"cv\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u,\"args\":{\"site\":\"",
+							event.start / 1000.0,
+							(event.end - event.start) / 1000.0,
+							event.thread);
+					trace_string(module_name(event.site));
+					fprintf(trace_file,
+							":%d\",\"dreadlock_id\":%u,\"wakeup\":\"%s\"}}",
+							event.site->line,
+							event.dreadlock_id,
+							event.wakeup == TraceEvent::TimedOut ? "timed out" : event.wakeup == TraceEvent::Unsatisfied ? "unsatisfied" : "satisfied");
+					break;
+
+				case TraceEvent::HandoffOut:
+				case TraceEvent::HandoffIn:
+					fprintf(trace_file,
+							"{\"name\":\"handoff\",\"cat\":\"handoff\",\"ph\":\"%s\",\"id\":%llu,\"ts\":%.3f,\"pid\":1,\"tid\":%u}",
+							event.kind == TraceEvent::HandoffOut ? "s" : "f\",\"bp\":\"e",
+							static_cast<unsigned long long>(event.flow),
+							event.start / 1000.0,
+							event.thread);
+					break;
+			}
+		}
+
+		state->trace_tail.store(head, std::memory_order_release); // anything left over when tracing stopped is discarded
+		dropped += state->trace_dropped.exchange(0, std::memory_order_relaxed);
+	}
+
+	if (trace_file)
+		fflush(trace_file);
+
+	if (dropped && trace_file)
+	{
+		char buffer[128];
+		snprintf(buffer, sizeof(buffer), "[[ Dreadlock ]] %u trace events were dropped (increase DREADLOCK_TRACE_CAPACITY)", dropped);
+		write_output(buffer, outputs.load(std::memory_order_relaxed));
+	}
+}
+
+void Dreadlock::record(TraceEvent& event)
+{
+	auto& state{thread_state()};
+
+	auto trace{state.trace.load(std::memory_order_relaxed)};
+	if (!trace)
+	{
+		trace = new TraceEvent[DREADLOCK_TRACE_CAPACITY];
+		state.trace.store(trace, std::memory_order_release);
+	}
+
+	event.thread = state.thread_number;
+
+	auto head{state.trace_head.load(std::memory_order_relaxed)};
+	auto used{head - state.trace_tail.load(std::memory_order_acquire)};
+	if (used >= DREADLOCK_TRACE_CAPACITY)
+	{
+		state.trace_dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	trace[head & (DREADLOCK_TRACE_CAPACITY - 1)] = event;
+	state.trace_head.store(head + 1, std::memory_order_release);
+
+	if (used == DREADLOCK_TRACE_CAPACITY / 2)
+		log_writer().wake();
+}
+
+void Dreadlock::write_output(const char* text, unsigned current_outputs)
+{
+	// the caller holds printing_mutex
+
+	if (current_outputs & OutputConsole)
+		std::cout << text << '\n';
+#if defined(_WIN32) && defined(ENABLE_WIN32_CONSOLE)
+	if (current_outputs & OutputDebugger)
+		output_win32_console("%s\n", text);
+#endif
+	if ((current_outputs & OutputFile) && output_file)
+		fprintf(output_file, "%s\n", text);
+}
+
+void Dreadlock::write_stack(const char* heading, uint32_t stack, unsigned current_outputs)
+{
+	// the caller holds printing_mutex, which also keeps the (single
+	// threaded) Win32 symbol lookups to one thread.  the frames inside
+	// Dreadlock itself are left off the top of the stack.
+
+	if (!stack)
+		return;
+
+	const auto& entry{captured_stacks[stack - 1]};
+	write_output(heading, current_outputs);
+
+	char line[1024];
+	bool inside{true};
+	int number{0};
+
+#if defined(_WIN32)
+	auto process{GetCurrentProcess()};
+	static bool symbols{SymInitialize(process, nullptr, TRUE) != FALSE};
+
+	char storage[sizeof(SYMBOL_INFO) + 256];
+	auto symbol{reinterpret_cast<SYMBOL_INFO*>(storage)};
+
+	for (uint32_t i = 0; i < entry.depth; ++i)
+	{
+		auto address{reinterpret_cast<DWORD64>(entry.frames[i])};
+
+		memset(storage, 0, sizeof(storage));
+		symbol->SizeOfStruct = sizeof(SYMBOL_INFO);
+		symbol->MaxNameLen = 255;
+		DWORD64 displacement{0};
+		bool named{symbols && SymFromAddr(process, address, &displacement, symbol)};
+
+		if (inside && named && !strncmp(symbol->Name, "Dreadlock::", 11))
+			continue;
+		inside = false;
+
+		IMAGEHLP_LINE64 source{};
+		source.SizeOfStruct = sizeof(source);
+		DWORD column{0};
+
+		if (named && SymGetLineFromAddr64(process, address, &column, &source))
+			snprintf(line, sizeof(line), "      #%d %p %s+0x%llx (%s:%lu)", number++, entry.frames[i], symbol->Name, static_cast<unsigned long long>(displacement), source.FileName, source.LineNumber);
+		else if (named)
+			snprintf(line, sizeof(line), "      #%d %p %s+0x%llx", number++, entry.frames[i], symbol->Name, static_cast<unsigned long long>(displacement));
+		else
+			snprintf(line, sizeof(line), "      #%d %p", number++, entry.frames[i]);
+		write_output(line, current_outputs);
+	}
+#else
+	auto symbols{backtrace_symbols(entry.frames, static_cast<int>(entry.depth))};
+
+	for (uint32_t i = 0; i < entry.depth; ++i)
+	{
+		// "module(mangled+offset) [address]", where the name is only
+		// known for exported functions (link with -rdynamic)
+		std::string text(symbols ? symbols[i] : "");
+		std::string module(text), name, offset;
+
+		auto open{text.find('(')};
+		auto plus{text.find('+', open)};
+		auto close{text.find(')', open)};
+		if (open != std::string::npos && plus != std::string::npos && close != std::string::npos && plus < close)
+		{
+			module = text.substr(0, open);
+			name = text.substr(open + 1, plus - open - 1);
+			offset = text.substr(plus, close - plus);
+		}
+
+		if (!name.empty())
+		{
+			int status{0};
+			auto demangled{abi::__cxa_demangle(name.c_str(), nullptr, nullptr, &status)};
+			if (demangled && status == 0)
+				name = demangled;
+			free(demangled);
+		}
+
+		if (inside && !name.compare(0, 11, "Dreadlock::"))
+			continue;
+		inside = false;
+
+		if (!name.empty())
+			snprintf(line, sizeof(line), "      #%d %p %s%s (%s)", number++, entry.frames[i], name.c_str(), offset.c_str(), module.c_str());
+		else
+			snprintf(line, sizeof(line), "      #%d %p (%s%s)", number++, entry.frames[i], module.c_str(), offset.c_str());
+		write_output(line, current_outputs);
+	}
+
+	free(symbols);
+#endif
+}
+
+void Dreadlock::post(const LogEvent& event)
+{
+	auto& writer{log_writer()};
+	auto& state{thread_state()};
+	bool verbose{event.kind <= LogKind::Unlocking || event.kind == LogKind::OverBudget}; // the ones that can come by the thousand
+	bool filling{false};
+
+	for (;;)
+	{
+		auto head{state.log_head.load(std::memory_order_relaxed)};
+		auto used{head - state.log_tail.load(std::memory_order_acquire)};
+		if (used < DREADLOCK_LOG_CAPACITY)
+		{
+			state.log[head & (DREADLOCK_LOG_CAPACITY - 1)] = event;
+			state.log_head.store(head + 1, std::memory_order_release);
+			filling = used == DREADLOCK_LOG_CAPACITY / 2;
+			break;
+		}
+
+		if (verbose)
+		{
+			state.log_dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+
+		drain_log(); // reports are never dropped
+	}
+
+	if (!writer.running.load(std::memory_order_relaxed))
+		drain_log();
+	else if (!verbose || filling)
+		writer.wake();
+}
+
+void Dreadlock::log(LogKind kind, const DreadlockSite* site, const LockInfo* owner, int value, uint32_t readers, uint32_t count, uint32_t stack)
+{
+	LogEvent event;
+	event.timestamp = now_ns();
+	event.kind = kind;
+	event.id = id;
+	event.site = site;
+	event.dreadlock_id = this_dreadlock;
+	if (owner)
+	{
+		event.owner_site = owner->site;
+		event.owner_id = owner->dreadlock_id;
+		event.owner_stack = owner->stack;
+	}
+	event.readers = readers;
+	event.count = count;
+	event.value = value;
+	event.stack = stack;
+
+	post(event);
+}
+
+// the longest probe in 'lock_order_edges'.  the set is kept at most
+// half full, so an edge that isn't found within it is treated as if
+// the set had filled up.
+static constexpr size_t LockOrderProbes{64};
+
+bool Dreadlock::lock_order_known(uint64_t edge)
+{
+	const size_t mask{DREADLOCK_LOCK_ORDER_CAPACITY - 1};
+	auto index{static_cast<size_t>((edge * 0x9E3779B97F4A7C15ull) >> 32) & mask};
+
+	for (size_t probe = 0; probe < LockOrderProbes; ++probe)
+	{
+		auto current{lock_order_edges[(index + probe) & mask].load(std::memory_order_acquire)};
+		if (current == edge)
+			return true;
+		if (current == 0)
+			return false;
+	}
+
+	return false;
+}
+
+void Dreadlock::add_lock_order(const HeldLock& from, const HeldLock& to, uint64_t edge)
+{
+	static LockOrderGraph& graph{*new LockOrderGraph}; // outlives static destruction
+	static std::vector<uint32_t> cycle;
+
+	std::unique_lock<std::mutex> lock_order_lock(lock_order_mutex);
+
+	if (graph.edges.find(edge) != graph.edges.end())
+		return; // raced with another thread adding it
+
+	if (graph.edges.size() >= DREADLOCK_LOCK_ORDER_CAPACITY / 2)
+	{
+		lock_order_lock.unlock();
+		lock_order_filled(to);
+		return;
+	}
+
+	auto source{static_cast<uint32_t>(from.slot - tracking)};
+	auto target{static_cast<uint32_t>(to.slot - tracking)};
+
+	// inversions are remembered too (but kept out of the graph), so
+	// each one is only reported once
+	graph.edges.emplace(edge, LockOrderGraph::Edge{from, to});
+
+	if (!graph.add(source, target, cycle))
+	{
+		LogEvent event;
+		event.timestamp = now_ns();
+		event.kind = LogKind::LockOrder;
+		event.id = to.id;
+		event.site = to.site;
+		event.dreadlock_id = to.dreadlock_id;
+		event.owner_name = from.id;
+		event.owner_site = from.site;
+		event.owner_id = from.dreadlock_id;
+		post(event);
+
+		for (size_t i = 0; i + 1 < cycle.size(); ++i)
+		{
+			auto& established{graph.edges[LockOrderGraph::key(cycle[i], cycle[i + 1])]};
+
+			event.kind = LogKind::LockOrderEdge;
+			event.id = established.to.id;
+			event.site = established.to.site;
+			event.dreadlock_id = established.to.dreadlock_id;
+			event.owner_name = established.from.id;
+			event.owner_site = established.from.site;
+			event.owner_id = established.from.dreadlock_id;
+			post(event);
+		}
+	}
+
+	lock_order_lock.unlock();
+
+	// publish the edge for the lock-free check
+	const size_t mask{DREADLOCK_LOCK_ORDER_CAPACITY - 1};
+	auto index{static_cast<size_t>((edge * 0x9E3779B97F4A7C15ull) >> 32) & mask};
+
+	for (size_t probe = 0; probe < LockOrderProbes; ++probe)
+	{
+		uint64_t expected{0};
+		auto& candidate{lock_order_edges[(index + probe) & mask]};
+		if (candidate.compare_exchange_strong(expected, edge, std::memory_order_acq_rel) || expected == edge)
+			return;
+	}
+
+	// it would be looked up (and taken to the graph) every time
+	lock_order_filled(to);
+}
+
+void Dreadlock::lock_order_filled(const HeldLock& to)
+{
+	// stops adding edges, so lock order is only checked against the
+	// ones already known, and says so the first time
+
+	if (lock_order_full.exchange(true, std::memory_order_relaxed))
+		return;
+
+	LogEvent event;
+	event.timestamp = now_ns();
+	event.kind = LogKind::LockOrderFull;
+	event.id = to.id;
+	event.site = to.site;
+	event.dreadlock_id = to.dreadlock_id;
+	post(event);
+}
+
+void Dreadlock::report_level_inversion(const DreadlockSite* site)
+{
+	// names the highest-level lock held, once for each pair of sites,
+	// as an inversion in a loop would otherwise be reported every time
+
+	auto& state{thread_state()};
+	auto depth{std::min<uint32_t>(state.held_count, DREADLOCK_MAX_HELD)};
+
+	const HeldLock* highest{nullptr};
+	for (uint32_t i = 0; i < depth; ++i)
+	{
+		if (!highest || state.held[i].level > highest->level)
+			highest = &state.held[i];
+	}
+	if (!highest)
+		return;
+
+	static std::atomic<uint64_t> reported[DREADLOCK_LOCK_ORDER_CAPACITY];
+	const size_t mask{DREADLOCK_LOCK_ORDER_CAPACITY - 1};
+	auto key{((reinterpret_cast<uintptr_t>(site) * 0x9E3779B97F4A7C15ull) ^ reinterpret_cast<uintptr_t>(highest->site)) | 1};
+	auto index{static_cast<size_t>((key * 0x9E3779B97F4A7C15ull) >> 32) & mask};
+
+	for (size_t probe = 0; probe < 16; ++probe)
+	{
+		uint64_t expected{0};
+		auto& candidate{reported[(index + probe) & mask]};
+		if (candidate.compare_exchange_strong(expected, key, std::memory_order_relaxed))
+			break;
+		if (expected == key)
+			return;
+	}
+
+	LogEvent event;
+	event.timestamp = now_ns();
+	event.kind = LogKind::LevelInversion;
+	event.id = id;
+	event.site = site;
+	event.dreadlock_id = this_dreadlock;
+	event.owner_name = highest->id;
+	event.owner_site = highest->site;
+	event.owner_id = highest->dreadlock_id;
+	event.owner_stack = highest->stack;
+	event.value = level;
+	event.count = static_cast<uint32_t>(highest->level);
+	post(event);
+}
+
+void Dreadlock::check_lock_order(const DreadlockSite* site)
+{
+	auto& state{thread_state()};
+	auto target{static_cast<uint32_t>(slot - tracking)};
+	auto depth{std::min<uint32_t>(state.held_count, DREADLOCK_MAX_HELD)};
+
+	for (uint32_t i = 0; i < depth; ++i)
+	{
+		auto& held{state.held[i]};
+		auto source{static_cast<uint32_t>(held.slot - tracking)};
+		if (source == target)
+			continue;
+
+		auto edge{LockOrderGraph::key(source, target)};
+		if (!lock_order_full.load(std::memory_order_relaxed) && !lock_order_known(edge))
+			add_lock_order(held, HeldLock{slot, id, site, this_dreadlock}, edge);
+	}
+}
+
+Dreadlock::LockStats* Dreadlock::stats_for(ThreadState& state, const DreadlockSite* site)
+{
+	auto index{static_cast<uint32_t>(slot - tracking)};
+
+	if (state.stats_index_size)
+	{
+		auto mask{state.stats_index_size - 1};
+		for (auto i = stats_hash(index, site) & mask; state.stats_index[i]; i = (i + 1) & mask)
+		{
+			auto stats{state.stats_index[i]};
+			if (stats->slot == index && stats->site == site)
+				return stats;
+		}
+	}
+
+	// the first lock of this mutex from this site on this thread
+	auto block{state.stats_blocks.load(std::memory_order_relaxed)};
+	if (!block || block->used.load(std::memory_order_relaxed) == block->capacity)
+	{
+		auto added{new StatsBlock(block ? block->capacity * 2 : 16)};
+		added->next = block;
+		state.stats_blocks.store(added, std::memory_order_release);
+		block = added;
+	}
+
+	auto used{block->used.load(std::memory_order_relaxed)};
+	auto stats{&block->entries[used]};
+	stats->slot = index;
+	stats->id = id;
+	stats->site = site;
+	block->used.store(used + 1, std::memory_order_release);
+
+	if (++state.stats_count * 2 <= state.stats_index_size)
+		state.index_stats(stats);
+	else
+	{
+		// doubles the index, and indexes every entry again
+		state.stats_index_size = std::max<uint32_t>(64, state.stats_index_size * 2);
+		state.stats_index.reset(new LockStats*[state.stats_index_size]());
+		for (auto indexed = block; indexed; indexed = indexed->next)
+		{
+			auto count{indexed->used.load(std::memory_order_relaxed)};
+			for (uint32_t i = 0; i < count; ++i)
+				state.index_stats(&indexed->entries[i]);
+		}
+	}
+
+	return stats;
+}
+
+void Dreadlock::acquired(const DreadlockSite* site, int64_t wait_start, const LockInfo* waited_on, uint32_t readers, const WaitPhases* phases)
+{
+	bool traced{tracing.load(std::memory_order_relaxed)};
+
+	uint32_t stack{live_settings.capture_stacks.load(std::memory_order_relaxed) ? capture_stack() : 0};
+
+	slot->acquisitions.fetch_add(1, std::memory_order_relaxed);
+	if (shared)
+	{
+		std::unique_lock<std::mutex> info_lock(slot->info_mutex);
+		slot->readers.fetch_add(1, std::memory_order_relaxed);
+		for (auto& reader : slot->reader_info)
+		{
+			if (!reader.dreadlock_id)
+			{
+				reader = LockInfo(this_dreadlock, site, stack);
+				break;
+			}
+		}
+	}
+	else if (!ops->recursive || slot->owner.load(std::memory_order_relaxed) == 0)
+	{
+		// holding the mutex is what entitles us to write its owner, so
+		// no lock is needed: the site goes in first, and storing the id
+		// publishes it.  a recursive mutex re-locked by its owning
+		// thread keeps the outermost instance as its owner.
+		slot->owner_site.store(site, std::memory_order_relaxed);
+		slot->owner_stack.store(stack, std::memory_order_relaxed);
+		slot->owner.store(this_dreadlock, std::memory_order_release);
+	}
+
+	owns = true;
+
+	auto& state{thread_state()};
+
+	if (shared_table.load(std::memory_order_relaxed))
+		shared_acquired(site);
+
+	int64_t acquired_at{0};
+	LockStats* stats{nullptr};
+
+	bool collect{live_settings.collect_statistics.load(std::memory_order_relaxed)};
+	if (collect || traced || budget)
+		acquired_at = now_ns();
+
+	if (event_log.load(std::memory_order_relaxed))
+		log_event(DreadlockEvent::Acquired, site, 0, acquired_at);
+
+	if (traced && wait_start)
+	{
+		TraceEvent wait;
+		wait.kind = TraceEvent::Wait;
+		wait.shared = shared;
+		wait.dreadlock_id = this_dreadlock;
+		wait.start = wait_start;
+		wait.end = acquired_at;
+		wait.id = id;
+		wait.site = site;
+		if (waited_on)
+		{
+			wait.other_id = waited_on->dreadlock_id;
+			wait.other_site = waited_on->site;
+		}
+		wait.readers = readers;
+		record(wait);
+
+		// the other end of the arrow from the release that let us in
+		auto handoff{slot->handoffs.load(std::memory_order_relaxed)};
+		if (handoff)
+		{
+			TraceEvent in;
+			in.kind = TraceEvent::HandoffIn;
+			in.start = acquired_at;
+			in.flow = (static_cast<uint64_t>(slot - tracking) << 32) | handoff;
+			record(in);
+		}
+	}
+
+	if (collect)
+	{
+		stats = stats_for(state, site);
+
+		auto waited{wait_start ? acquired_at - wait_start : 0};
+
+		bump(stats->acquisitions, 1);
+		if (wait_start)
+		{
+			bump(stats->contended, 1);
+			bump(stats->wait_total, waited);
+			if (static_cast<uint64_t>(waited) > stats->wait_max.load(std::memory_order_relaxed))
+				stats->wait_max.store(waited, std::memory_order_relaxed);
+			stats->blocked_by(waited_on ? waited_on->site : nullptr, waited);
+
+			if (phases)
+			{
+				auto spun{phases->spun ? phases->spun : acquired_at};
+				auto backed_off{phases->backed_off ? phases->backed_off : acquired_at};
+				bump(stats->phase_total[Spinning], spun - wait_start);
+				bump(stats->phase_total[BackingOff], backed_off - spun);
+				bump(stats->phase_total[Parked], acquired_at - backed_off);
+				bump(stats->phase_acquired[!phases->spun ? Spinning : !phases->backed_off ? BackingOff : Parked], 1);
+			}
+		}
+		bump(stats->wait_histogram[stats_bucket(waited)], 1);
+	}
+
+	if (state.held_count < DREADLOCK_MAX_HELD)
+		state.held[state.held_count] = HeldLock{slot, id, site, this_dreadlock, acquired_at, stats, stack, shared, level};
+	++state.held_count;
+	state.level = std::max(state.level, level);
+	state.view_held(state.held_count - 1);
+}
+
+bool Dreadlock::released(const DreadlockSite* site)
+{
+	// locks are usually released in the reverse of the order they were
+	// acquired, so search from the top of the stack.  if this instance
+	// isn't on it, the lock was taken by some other thread.
+
+	auto& state{thread_state()};
+	auto depth{std::min<uint32_t>(state.held_count, DREADLOCK_MAX_HELD)};
+
+	for (auto i = depth; i-- > 0;)
+	{
+		auto& held{state.held[i]};
+		if (held.slot == slot && held.dreadlock_id == this_dreadlock)
+		{
+			auto released_at{held.acquired_at ? now_ns() : 0};
+
+			if (event_log.load(std::memory_order_relaxed))
+				log_event(DreadlockEvent::Released, held.site, 0, released_at); // where it was locked says more than the destructor's site
+
+			if (held.acquired_at && tracing.load(std::memory_order_relaxed))
+			{
+				TraceEvent hold;
+				hold.kind = TraceEvent::Hold;
+				hold.shared = held.shared;
+				hold.dreadlock_id = this_dreadlock;
+				hold.start = held.acquired_at;
+				hold.end = released_at;
+				hold.id = id;
+				hold.site = held.site;
+				hold.other_site = site;
+				record(hold);
+
+				// a blocked waiter gets an arrow from the end of this hold
+				if (slot->waiters.load(std::memory_order_relaxed))
+				{
+					TraceEvent out;
+					out.kind = TraceEvent::HandoffOut;
+					out.start = released_at - 1;
+					out.flow = (static_cast<uint64_t>(slot - tracking) << 32) | (slot->handoffs.fetch_add(1, std::memory_order_relaxed) + 1);
+					record(out);
+				}
+			}
+
+			if (budget && released_at - held.acquired_at > budget)
+			{
+				LogEvent event;
+				event.timestamp = released_at;
+				event.kind = LogKind::OverBudget;
+				event.id = id;
+				event.site = site;
+				event.owner_site = held.site;
+				event.dreadlock_id = this_dreadlock;
+				event.owner_id = this_dreadlock;
+				event.owner_stack = held.stack;
+				event.duration = released_at - held.acquired_at;
+				event.limit = budget;
+				post(event);
+
+				if (held.stats)
+					bump(held.stats->over_budget, 1);
+			}
+
+			if (held.stats)
+			{
+				auto stats{held.stats};
+				auto hold{released_at - held.acquired_at};
+
+				bump(stats->hold_total, hold);
+				bump(stats->hold_histogram[stats_bucket(hold)], 1);
+				if (static_cast<uint64_t>(hold) > stats->hold_max.load(std::memory_order_relaxed))
+				{
+					stats->hold_max.store(hold, std::memory_order_relaxed);
+					stats->hold_max_release.store(site, std::memory_order_relaxed);
+				}
+			}
+
+			for (auto j = i; j + 1 < depth; ++j)
+				state.held[j] = state.held[j + 1];
+			--state.held_count;
+			state.view_held(i);
+
+			if (level)
+			{
+				state.level = 0;
+				for (uint32_t j = 0; j + 1 < depth; ++j)
+					state.level = std::max(state.level, state.held[j].level);
+			}
+			return true;
+		}
+	}
+
+	if (state.held_count <= DREADLOCK_MAX_HELD)
+		return false;
+
+	--state.held_count; // one of the untracked deep ones
+	return true;
+}
+
+unsigned Dreadlock::lock_depth()
+{
+	return thread_state().held_count;
+}
+
+bool Dreadlock::current_owner(LockInfo& info, uint32_t& readers)
+{
+	// the exclusive owner, or else the first remembered shared owner
+	// (if any) along with the count of them
+
+	readers = 0;
+
+	// the exclusive owner is read without a lock, so make sure it
+	// didn't change hands while we were reading its site
+	for (;;)
+	{
+		auto owner{slot->owner.load(std::memory_order_acquire)};
+		if (!owner)
+			break;
+
+		auto owner_site{slot->owner_site.load(std::memory_order_relaxed)};
+		auto owner_stack{slot->owner_stack.load(std::memory_order_acquire)};
+		if (slot->owner.load(std::memory_order_relaxed) == owner)
+		{
+			info = LockInfo(owner, owner_site, owner_stack);
+			return true;
+		}
+	}
+
+	std::unique_lock<std::mutex> info_lock(slot->info_mutex);
+	readers = slot->readers.load(std::memory_order_relaxed);
+	if (!readers)
+		return false;
+
+	info = LockInfo();
+	for (const auto& reader : slot->reader_info)
+	{
+		if (reader.dreadlock_id)
+		{
+			info = reader;
+			break;
+		}
+	}
+	return true;
+}
+
+const Dreadlock::HeldLock* Dreadlock::held_by_this_thread(bool this_instance)
+{
+	// the most recent entry for this mutex in the calling thread's held
+	// stack, made by either this instance, or by another one
+
+	auto& state{thread_state()};
+	auto depth{std::min<uint32_t>(state.held_count, DREADLOCK_MAX_HELD)};
+
+	for (auto i = depth; i-- > 0;)
+	{
+		auto& held{state.held[i]};
+		if (held.slot == slot && (held.dreadlock_id == this_dreadlock) == this_instance)
+			return &held;
+	}
+
+	return nullptr;
+}
+
+bool Dreadlock::skip_sample()
+{
+	auto one_in{sample_one_in.load(std::memory_order_relaxed)};
+	if (one_in == 1)
+		return false;
+
+	auto hot_threshold{sample_hot_threshold.load(std::memory_order_relaxed)};
+	if (hot_threshold && slot->contentions.load(std::memory_order_relaxed) >= hot_threshold)
+		return false;
+
+	if (!one_in)
+		return true;
+
+	static thread_local uint32_t countdown{0};
+	if (++countdown < one_in)
+		return true;
+
+	countdown = 0;
+	return false;
+}
+
+void Dreadlock::perturb()
+{
+	auto max_us{perturb_us.load(std::memory_order_relaxed)};
+	if (!max_us)
+		return;
+
+	static std::atomic<uint32_t> next_thread{0};
+	static thread_local uint32_t random{0};
+	if (!random)
+	{
+		auto seed{perturb_seed.load(std::memory_order_relaxed)};
+		auto thread{next_thread.fetch_add(1, std::memory_order_relaxed) + 1};
+		random = static_cast<uint32_t>(((seed ? seed : static_cast<uint64_t>(now_ns())) * 0x9E3779B97F4A7C15ull + thread * 0xBF58476D1CE4E5B9ull) >> 32) | 1;
+	}
+
+	random ^= random << 13;
+	random ^= random >> 17;
+	random ^= random << 5;
+
+	// half the calls go straight through, so uncontended runs of
+	// locks still happen
+	switch (random & 3)
+	{
+		case 0:
+		case 1:
+			break;
+
+		case 2:
+			std::this_thread::yield();
+			break;
+
+		default:
+			std::this_thread::sleep_for(std::chrono::microseconds((random >> 2) % max_us + 1));
+			break;
+	}
+}
+
+bool Dreadlock::resolve_slot(const DreadlockSite& site)
+{
+	// finds the mutex's slot on first use, returning false if the
+	// table is full, and it can't be tracked
+
+	if (!slot && !untracked)
+	{
+		slot = find_slot(reinterpret_cast<size_t>(mtx));
+		if (!slot)
+		{
+			log(LogKind::TableFull, &site);
+			flush();
+
+			assert(false);
+
+			untracked = true;
+		}
+	}
+
+	return !untracked;
+}
+
+void Dreadlock::lock(const DreadlockSite& site)
+{
+	if (perturb_us.load(std::memory_order_relaxed))
+		perturb();
+
+	if (!this_dreadlock)
+		this_dreadlock = allocate_id();
+
+#if defined(DREADLOCK_VERBOSE)
+	log(LogKind::Locking, &site);
+#endif
+
+	if (owns)
+	{
+		// we already hold this lock!
+
+		auto held{untracked ? nullptr : held_by_this_thread(true)};
+		LockInfo info(this_dreadlock, held ? held->site : nullptr);
+		log(LogKind::IllegalLock, &site, &info);
+		flush();
+
+		assert(false);
+		return;
+	}
+
+	if (!resolve_slot(site))
+	{
+		if (shared)
+			ops->lock_shared(mtx);
+		else
+			ops->lock(mtx);
+		owns = true;
+		return;
+	}
+
+	// an acquisition outside the sample is tracked only if it has to
+	// wait for the mutex.  levelled locks are always tracked, as the
+	// thread's level comes from its held stack, and an outer lock
+	// missing from it would let an inversion through.
+
+	if (!level && skip_sample() && try_acquire())
+	{
+		sampled_out = true;
+		owns = true;
+		return;
+	}
+
+	// this thread may already hold the mutex through another instance.
+	// re-locking a recursive mutex exclusively is fine, but re-locking
+	// any other, or changing modes, can never succeed, and a second
+	// shared lock blocks behind any writer that queued up in between.
+	// the thread's own held stack answers this without shared state.
+
+	if (auto held = held_by_this_thread(false))
+	{
+		LockInfo info(held->dreadlock_id, held->site);
+
+		if (!shared && !held->shared && !ops->recursive)
+		{
+			// a non-recursive mutex will never be released to its owner
+
+			log(LogKind::IllegalLock, &site, &info);
+			flush();
+
+			assert(false);
+			return;
+		}
+
+		if (held->shared != shared)
+		{
+			log(shared ? LogKind::SharedWhileExclusive : LogKind::SharedUpgrade, &site, &info);
+			flush();
+
+			assert(false);
+			return;
+		}
+
+		if (shared)
+			log(LogKind::SharedRelock, &site, &info);
+	}
+
+	// the lock hierarchy costs one comparison; a recursive mutex may be
+	// re-locked at its own level
+	if (level && level <= thread_state().level && !held_by_this_thread(false))
+		report_level_inversion(&site);
+
+	if (live_settings.detect_lock_order.load(std::memory_order_relaxed))
+		check_lock_order(&site);
+
+	// is the mutex currently locked?
+	if (try_acquire())
+	{
+		acquired(&site);
+		return;
+	}
+
+	slot->contentions.fetch_add(1, std::memory_order_relaxed);
+
+	// who this thread is about to wait on, for the verbose log, the trace and the statistics
+	LockInfo waited_on;
+	uint32_t waited_readers{0};
+	bool describe{tracing.load(std::memory_order_relaxed) || live_settings.collect_statistics.load(std::memory_order_relaxed)};
+#if defined(DREADLOCK_VERBOSE)
+	describe = true;
+#endif
+	bool waited_known{describe && current_owner(waited_on, waited_readers)};
+
+#if defined(DREADLOCK_VERBOSE)
+	if (waited_known)
+		log(LogKind::Attempting, &site, &waited_on, 0, waited_readers);
+#endif
+
+	// this mutex is already locked ... wait for it a reasonable
+	// amount of time before we consider it deadlocked.  if other
+	// threads keep acquiring it in the meantime, this one is being
+	// starved rather than deadlocked, so that is reported once, and
+	// the wait starts over.  with the watchdog running, it keeps the
+	// time on every waiter's behalf, and this thread just blocks.
+
+	bool blocking_wait{live_settings.blocking_wait.load(std::memory_order_relaxed)};
+	bool watched{live_settings.watch_waits.load(std::memory_order_relaxed)};
+
+	auto& state{thread_state()};
+	WaitRecord local_wait;
+	auto& wait{watched ? state.wait : local_wait};
+
+	auto wait_start{now_ns()};
+	state.view_waiting(this, &site, wait_start);
+
+	// most holds are over long before a parked waiter could wake up
+	WaitPhases phases;
+	if (spin_then_back_off(phases))
+	{
+		state.view_waiting(nullptr, nullptr, 0);
+		acquired(&site, wait_start, waited_known ? &waited_on : nullptr, waited_readers, &phases);
+		return;
+	}
+
+	bool mirrored{shared_table.load(std::memory_order_relaxed) != nullptr};
+	if (mirrored)
+		shared_waiting(state, &site, wait_start);
+
+	if (event_log.load(std::memory_order_relaxed))
+		log_event(DreadlockEvent::Waiting, &site, waited_known ? waited_on.dreadlock_id : 0, wait_start);
+
+	std::unique_lock<std::mutex> record_lock(wait.mutex, std::defer_lock);
+	if (watched)
+		record_lock.lock();
+	wait.waiter = this;
+	wait.site = &site;
+	wait.start = wait_start;
+	wait.progress = progress();
+	wait.shared_thread = mirrored ? state.shared_thread : 0;
+	timeouts_for(site, wait.performance_timeout, wait.deadlock_timeout);
+	wait.stack = live_settings.capture_stacks.load(std::memory_order_relaxed) ? capture_stack() : 0;
+	wait.reported_performance = false;
+	wait.reported_starvation = false;
+	wait.deadlocked.store(false, std::memory_order_relaxed);
+	if (watched)
+	{
+		wait.active.store(true, std::memory_order_release);
+		record_lock.unlock();
+		watchdog();
+	}
+
+	auto wait_poll_interval{std::chrono::milliseconds(live_settings.wait_poll_interval.load(std::memory_order_relaxed))};
+
+	// in blocking mode, the slot's info_mutex is held whenever we test
+	// the mutex (or the watchdog's verdict), and unlock() (or the
+	// watchdog) takes it before signalling, so the signal can't slip
+	// in between a failed try_lock and the wait
+	std::unique_lock<std::mutex> wait_lock(slot->info_mutex, std::defer_lock);
+	if (blocking_wait)
+		wait_lock.lock();
+
+	// the holder may have released the mutex just before it could see
+	// us here, so it's tried once more before the first wait (see
+	// release_to_waiters())
+	auto queued{slot->waiters.fetch_add(1, std::memory_order_relaxed) + 1};
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (queued > slot->peak_waiters.load(std::memory_order_relaxed))
+		slot->peak_waiters.store(queued, std::memory_order_relaxed);
+
+	for (;;)
+	{
+		if (try_acquire())
+		{
+			slot->waiters.fetch_sub(1, std::memory_order_relaxed);
+			if (blocking_wait)
+				wait_lock.unlock();
+
+			if (watched)
+			{
+				record_lock.lock();
+				wait.active.store(false, std::memory_order_relaxed);
+				record_lock.unlock();
+			}
+
+			state.view_waiting(nullptr, nullptr, 0);
+			if (mirrored)
+				shared_waiting(state, nullptr, 0);
+			acquired(&site, wait_start, waited_known ? &waited_on : nullptr, waited_readers, &phases);
+			return;
+		}
+
+		if (watched)
+		{
+			if (wait.deadlocked.load(std::memory_order_acquire))
+				break; // this is a fail!
+		}
+		else
+		{
+			auto now{now_ns()};
+			auto elapsed{(now - wait.start) / 1000000};
+			if (elapsed >= wait.deadlock_timeout || (wait.performance_timeout && !wait.reported_performance && elapsed >= wait.performance_timeout))
+			{
+				if (blocking_wait)
+					wait_lock.unlock();
+
+				bool deadlocked{check_wait(wait, now)};
+
+				if (blocking_wait)
+					wait_lock.lock();
+
+				if (deadlocked)
+					break; // this is a fail!
+			}
+		}
+
+		if (blocking_wait && watched)
+			slot->released.wait(wait_lock); // the watchdog also nudges us on every tick
+		else if (blocking_wait)
+		{
+			auto timeout{(wait.performance_timeout && !wait.reported_performance) ? wait.performance_timeout : wait.deadlock_timeout};
+			auto deadline{std::chrono::steady_clock::time_point(std::chrono::nanoseconds(wait.start)) + std::chrono::milliseconds(timeout)};
+			slot->released.wait_until(wait_lock, std::min(deadline, std::chrono::steady_clock::now() + wait_poll_interval));
+		}
+		else
+			std::this_thread::sleep_for(500000ns);
+	}
+
+	slot->waiters.fetch_sub(1, std::memory_order_relaxed);
+	if (blocking_wait)
+		wait_lock.unlock();
+
+	if (watched)
+	{
+		record_lock.lock();
+		wait.active.store(false, std::memory_order_relaxed);
+		record_lock.unlock();
+	}
+
+	state.view_waiting(nullptr, nullptr, 0);
+	if (mirrored)
+		shared_waiting(state, nullptr, 0);
+	if (event_log.load(std::memory_order_relaxed))
+		log_event(DreadlockEvent::Deadlocked, &site);
+	assert(!live_settings.assert_on_deadlock.load(std::memory_order_relaxed));
+}
+
+bool Dreadlock::try_lock(const DreadlockSite& site)
+{
+	if (perturb_us.load(std::memory_order_relaxed))
+		perturb();
+
+	if (!this_dreadlock)
+		this_dreadlock = allocate_id();
+
+	if (owns)
+	{
+		auto held{untracked ? nullptr : held_by_this_thread(true)};
+		LockInfo info(this_dreadlock, held ? held->site : nullptr);
+		log(LogKind::IllegalLock, &site, &info);
+		flush();
+
+		assert(false);
+		return false;
+	}
+
+	if (!resolve_slot(site))
+	{
+		owns = try_acquire();
+		return owns;
+	}
+
+	if (!level && skip_sample())
+	{
+		sampled_out = owns = try_acquire();
+		return owns;
+	}
+
+	// trying a mutex this thread already holds is only defined for an
+	// exclusive lock of a recursive one
+	if (auto held = held_by_this_thread(false); held && (shared || held->shared || !ops->recursive))
+	{
+		LockInfo info(held->dreadlock_id, held->site);
+		log(LogKind::IllegalLock, &site, &info);
+		flush();
+
+		assert(false);
+		return false;
+	}
+
+	if (!try_acquire())
+		return false;
+
+	acquired(&site);
+	return true;
+}
+
+void Dreadlock::adopt(const DreadlockSite& site)
+{
+	if (!this_dreadlock)
+		this_dreadlock = allocate_id();
+
+	if (owns)
+	{
+		auto held{untracked ? nullptr : held_by_this_thread(true)};
+		LockInfo info(this_dreadlock, held ? held->site : nullptr);
+		log(LogKind::IllegalLock, &site, &info);
+		flush();
+
+		assert(false);
+		return;
+	}
+
+	if (resolve_slot(site))
+		acquired(&site);
+	else
+		owns = true;
+}
+
+void Dreadlock::forget(const DreadlockSite& site)
+{
+	if (!owns)
+		return;
+
+	owns = false;
+
+	if (untracked || sampled_out)
+	{
+		sampled_out = false;
+		return;
+	}
+
+	if (released(&site))
+		disown();
+	else
+	{
+		// still held, by the thread that locked it
+
+		owns = true;
+		log(LogKind::ForeignUnlock, &site);
+		flush();
+
+		assert(false);
+	}
+}
+
+bool Dreadlock::spin_then_back_off(WaitPhases& phases)
+{
+	// the first two phases of a contended acquisition, returning true
+	// if the mutex was acquired in either, and noting when each ended
+
+	auto spins{live_settings.wait_spins.load(std::memory_order_relaxed)};
+	for (int i = 0; i < spins; ++i)
+	{
+		cpu_relax();
+		if (try_acquire())
+			return true;
+	}
+	phases.spun = now_ns();
+
+	// intervals too short to sleep for (a sleep usually lasts much
+	// longer than asked) are yielded away instead
+	auto backoff_end{phases.spun + static_cast<int64_t>(live_settings.wait_backoff.load(std::memory_order_relaxed)) * 1000};
+	for (int64_t interval = 1000;; interval *= 2)
+	{
+		auto now{now_ns()};
+		if (now >= backoff_end)
+			break;
+
+		auto pause{std::min(interval, backoff_end - now)};
+		if (pause < 20000)
+		{
+			do
+				std::this_thread::yield();
+			while (now_ns() < now + pause);
+		}
+		else
+			std::this_thread::sleep_for(std::chrono::nanoseconds(pause));
+
+		if (try_acquire())
+			return true;
+	}
+	phases.backed_off = now_ns();
+
+	return false;
+}
+
+bool Dreadlock::check_wait(WaitRecord& wait, int64_t now)
+{
+	// raises the reports that are due for a wait, returning true once
+	// it is considered deadlocked.  the caller can't hold the slot's
+	// info_mutex.
+
+	LockInfo info;
+	uint32_t readers{0};
+	bool is_locked{false};
+
+	auto elapsed{(now - wait.start) / 1000000};
+	if (elapsed >= wait.deadlock_timeout)
+	{
+		auto acquisitions{progress()};
+		if (acquisitions == wait.progress)
+		{
+			is_locked = current_owner(info, readers);
+			log(LogKind::Deadlock, wait.site, is_locked ? &info : nullptr, 0, readers, 0, wait.stack);
+			flush();
+			if (wait.shared_thread)
+				report_shared_chain(wait.shared_thread, slot->shared_record.load(std::memory_order_relaxed));
+			return true;
+		}
+
+		if (!wait.reported_starvation)
+		{
+			is_locked = current_owner(info, readers);
+			log(LogKind::Starvation, wait.site, is_locked ? &info : nullptr, wait.deadlock_timeout, readers, acquisitions - wait.progress);
+			wait.reported_starvation = true;
+		}
+
+		wait.progress = acquisitions;
+		wait.start = now;
+		wait.reported_performance = true;
+	}
+	else if (wait.performance_timeout && !wait.reported_performance && elapsed >= wait.performance_timeout)
+	{
+		is_locked = current_owner(info, readers);
+		log(LogKind::PerformanceWait, wait.site, is_locked ? &info : nullptr, wait.performance_timeout, readers);
+		wait.reported_performance = true;
+	}
+
+	return false;
+}
+
+void Dreadlock::watch_waits()
+{
+	// a tick of the watchdog: each thread can only be waiting on one
+	// lock at a time, so the wait records live in the thread states
+
+	auto now{now_ns()};
+
+	for (auto state = thread_states.load(std::memory_order_acquire); state; state = state->next)
+	{
+		auto& wait{state->wait};
+		if (!wait.active.load(std::memory_order_acquire))
+			continue;
+
+		// the record lock keeps the waiting instance alive until we're done with it
+		std::unique_lock<std::mutex> record_lock(wait.mutex);
+		if (!wait.active.load(std::memory_order_relaxed) || wait.deadlocked.load(std::memory_order_relaxed))
+			continue;
+
+		auto waiter{wait.waiter};
+		bool deadlocked{waiter->check_wait(wait, now)};
+
+		std::unique_lock<std::mutex> info_lock(waiter->slot->info_mutex);
+		if (deadlocked)
+			wait.deadlocked.store(true, std::memory_order_release);
+		info_lock.unlock();
+
+		// wakes the waiter to hear the verdict, or else one of this slot's
+		// waiters to retry the mutex, in case it was released by code
+		// Dreadlock doesn't see
+		if (deadlocked)
+			waiter->slot->released.notify_all();
+		else
+			waiter->slot->released.notify_one();
+	}
+}
+
+void Dreadlock::unlock(const DreadlockSite& site)
+{
+	if (perturb_us.load(std::memory_order_relaxed))
+		perturb();
+
+	if (!owns)
+	{
+		if (!this_dreadlock)
+			this_dreadlock = allocate_id();
+
+		LockInfo info;
+		uint32_t readers{0};
+		bool is_locked{slot && current_owner(info, readers)};
+
+		if (!is_locked)
+			log(LogKind::UnlockUnowned, &site);
+		else
+			log(LogKind::IllegalUnlock, &site, &info, 0, readers); // we don't hold this lock!
+		flush();
+
+		assert(false);
+		return;
+	}
+
+	owns = false;
+
+	if (untracked)
+	{
+		release();
+		return;
+	}
+
+	if (sampled_out)
+	{
+		sampled_out = false;
+		release_to_waiters(); // a tracked waiter may still be blocked on the slot
+		return;
+	}
+
+#if defined(DREADLOCK_VERBOSE)
+	auto held{held_by_this_thread(true)};
+	LockInfo info(this_dreadlock, held ? held->site : nullptr);
+	log(LogKind::Unlocking, &site, &info);
+#endif
+
+	// ownership is released before the mutex so that the next
+	// owner's entry can't be clobbered by ours
+
+	if (!released(&site))
+	{
+		// still held, by the thread that locked it
+
+		owns = true;
+		log(LogKind::ForeignUnlock, &site);
+		flush();
+
+		assert(false);
+		return;
+	}
+
+	disown();
+	release_to_waiters();
+}
+
+void Dreadlock::disown()
+{
+	// takes this instance out of the slot's owners, once it has been
+	// taken off the thread's held stack
+
+	if (shared_table.load(std::memory_order_relaxed))
+		shared_released();
+
+	if (shared)
+	{
+		std::unique_lock<std::mutex> info_lock(slot->info_mutex);
+		for (auto& reader : slot->reader_info)
+		{
+			if (reader.dreadlock_id == this_dreadlock)
+			{
+				reader = LockInfo();
+				break;
+			}
+		}
+		slot->readers.fetch_sub(1, std::memory_order_relaxed);
+	}
+	else if (slot->owner.load(std::memory_order_relaxed) == this_dreadlock)
+	{
+		// an inner instance on this thread may still hold a recursive
+		// mutex, and becomes its owner
+		auto successor{ops->recursive ? held_by_this_thread(false) : nullptr};
+		if (successor)
+		{
+			slot->owner_site.store(successor->site, std::memory_order_relaxed);
+			slot->owner_stack.store(successor->stack, std::memory_order_relaxed);
+			slot->owner.store(successor->dreadlock_id, std::memory_order_release);
+		}
+		else
+			slot->owner.store(0, std::memory_order_release);
+	}
+}
+
+void Dreadlock::release_to_waiters()
+{
+	// a waiter counts itself in 'waiters' before its last try of the
+	// mutex, and we release the mutex before looking at 'waiters', so
+	// (across the fences) either it gets the mutex, or we see it and
+	// signal.  taking the slot lock first holds the signal back until
+	// the waiter is actually waiting for it.
+
+	release();
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (slot->waiters.load(std::memory_order_relaxed) == 0)
+		return;
+
+	std::unique_lock<std::mutex> info_lock(slot->info_mutex);
+	info_lock.unlock();
+
+	// readers and writers may be queued up together on a shared mutex
+	if (ops->shared_lockable)
+		slot->released.notify_all();
+	else
+		slot->released.notify_one();
+}
+
+int64_t Dreadlock::cv_block(const DreadlockSite& site, bool release)
+{
+	// an instance that doesn't hold its mutex can't wait with it, and
+	// unlock() says so
+	if (release || !owns)
+	{
+		unlock(site);
+		return now_ns();
+	}
+
+	// the condition variable releases the mutex whatever we make of it
+	owns = false;
+
+	if (!untracked && !sampled_out)
+	{
+		if (released(&site))
+			disown();
+		else
+		{
+			log(LogKind::ForeignUnlock, &site);
+			flush();
+
+			assert(false);
+		}
+	}
+
+	return now_ns();
+}
+
+int64_t Dreadlock::cv_wake(const DreadlockSite& site, bool acquire)
+{
+	auto woken_at{now_ns()};
+
+	if (acquire)
+		lock(site);
+	else if (!untracked && !sampled_out)
+		acquired(&site);
+	else
+		owns = true;
+
+	return woken_at;
+}
+
+void Dreadlock::cv_woken(const DreadlockSite& site, int64_t blocked_at, int64_t woken_at, bool notified, bool satisfied)
+{
+	if (untracked || sampled_out || !slot)
+		return;
+
+	if (tracing.load(std::memory_order_relaxed))
+	{
+		TraceEvent wait;
+		wait.kind = TraceEvent::CvWait;
+		wait.dreadlock_id = this_dreadlock;
+		wait.start = blocked_at;
+		wait.end = woken_at;
+		wait.id = id;
+		wait.site = &site;
+		wait.wakeup = !notified ? TraceEvent::TimedOut : satisfied ? TraceEvent::Satisfied : TraceEvent::Unsatisfied;
+		record(wait);
+	}
+
+	if (!live_settings.collect_statistics.load(std::memory_order_relaxed))
+		return;
+
+	auto stats{stats_for(thread_state(), &site)};
+	auto blocked{woken_at - blocked_at};
+
+	bump(stats->cv_blocks, 1);
+	if (!notified)
+		bump(stats->cv_timeouts, 1);
+	else if (!satisfied)
+		bump(stats->cv_unsatisfied, 1);
+	bump(stats->cv_blocked_total, blocked);
+	if (static_cast<uint64_t>(blocked) > stats->cv_blocked_max.load(std::memory_order_relaxed))
+		stats->cv_blocked_max.store(blocked, std::memory_order_relaxed);
+	bump(stats->cv_histogram[stats_bucket(blocked)], 1);
+}
+
+void Dreadlock::dump_stats(size_t top, const char* csv_path)
+{
+	struct Summary
+	{
+		const char* id{nullptr};
+		const DreadlockSite* site{nullptr};
+		uint64_t acquisitions{0};
+		uint64_t contended{0};
+		uint64_t wait_total{0};
+		uint64_t wait_max{0};
+		uint64_t hold_total{0};
+		uint64_t hold_max{0};
+		const DreadlockSite* hold_max_site{nullptr};
+		const DreadlockSite* hold_max_release{nullptr};
+		uint64_t wait_histogram[StatsBuckets]{};
+		uint64_t hold_histogram[StatsBuckets]{};
+		uint64_t over_budget{0};
+		uint64_t cv_blocks{0};
+		uint64_t cv_unsatisfied{0};
+		uint64_t cv_timeouts{0};
+		uint64_t cv_blocked_total{0};
+		uint64_t cv_blocked_max{0};
+		uint64_t cv_histogram[StatsBuckets]{};
+		uint64_t phase_acquired[WaitPhaseCount]{};
+		uint64_t phase_total[WaitPhaseCount]{};
+
+		void merge(const Summary& other)
+		{
+			acquisitions += other.acquisitions;
+			contended += other.contended;
+			wait_total += other.wait_total;
+			wait_max = std::max(wait_max, other.wait_max);
+			hold_total += other.hold_total;
+			if (other.hold_max >= hold_max)
+			{
+				hold_max = other.hold_max;
+				hold_max_site = other.hold_max_site;
+				hold_max_release = other.hold_max_release;
+			}
+			over_budget += other.over_budget;
+			cv_blocks += other.cv_blocks;
+			cv_unsatisfied += other.cv_unsatisfied;
+			cv_timeouts += other.cv_timeouts;
+			cv_blocked_total += other.cv_blocked_total;
+			cv_blocked_max = std::max(cv_blocked_max, other.cv_blocked_max);
+			for (int i = 0; i < WaitPhaseCount; ++i)
+			{
+				phase_acquired[i] += other.phase_acquired[i];
+				phase_total[i] += other.phase_total[i];
+			}
+			for (int i = 0; i < StatsBuckets; ++i)
+			{
+				wait_histogram[i] += other.wait_histogram[i];
+				hold_histogram[i] += other.hold_histogram[i];
+				cv_histogram[i] += other.cv_histogram[i];
+			}
+		}
+
+		// the upper bound of the bucket holding the requested fraction,
+		// but never more than the largest value actually recorded
+		static int64_t percentile(const uint64_t* histogram, double fraction, uint64_t max)
+		{
+			uint64_t total{0};
+			for (int i = 0; i < StatsBuckets; ++i)
+				total += histogram[i];
+
+			if (!total)
+				return 0;
+
+			auto target{static_cast<uint64_t>(fraction * total)};
+			uint64_t seen{0};
+			int bucket{0};
+			for (; bucket < StatsBuckets - 1; ++bucket)
+			{
+				seen += histogram[bucket];
+				if (seen > target)
+					break;
+			}
+
+			if (bucket == 0)
+				return 0;
+			return std::min<int64_t>(stats_bucket_limit(bucket) - 1, max);
+		}
+	};
+
+	std::map<std::pair<uint32_t, const DreadlockSite*>, Summary> sites;
+
+	for (auto state = thread_states.load(std::memory_order_acquire); state; state = state->next)
+	{
+		for (auto block = state->stats_blocks.load(std::memory_order_acquire); block; block = block->next)
+		{
+			auto count{block->used.load(std::memory_order_acquire)};
+			for (uint32_t entry = 0; entry < count; ++entry)
+			{
+				const auto& stats{block->entries[entry]};
+
+				Summary summary;
+				summary.id = stats.id;
+				summary.site = stats.site;
+				summary.acquisitions = stats.acquisitions.load(std::memory_order_relaxed);
+				summary.contended = stats.contended.load(std::memory_order_relaxed);
+				summary.wait_total = stats.wait_total.load(std::memory_order_relaxed);
+				summary.wait_max = stats.wait_max.load(std::memory_order_relaxed);
+				summary.hold_total = stats.hold_total.load(std::memory_order_relaxed);
+				summary.hold_max = stats.hold_max.load(std::memory_order_relaxed);
+				summary.hold_max_site = stats.site;
+				summary.hold_max_release = stats.hold_max_release.load(std::memory_order_relaxed);
+				summary.over_budget = stats.over_budget.load(std::memory_order_relaxed);
+				summary.cv_blocks = stats.cv_blocks.load(std::memory_order_relaxed);
+				summary.cv_unsatisfied = stats.cv_unsatisfied.load(std::memory_order_relaxed);
+				summary.cv_timeouts = stats.cv_timeouts.load(std::memory_order_relaxed);
+				summary.cv_blocked_total = stats.cv_blocked_total.load(std::memory_order_relaxed);
+				summary.cv_blocked_max = stats.cv_blocked_max.load(std::memory_order_relaxed);
+				for (int i = 0; i < StatsBuckets; ++i)
+				{
+					summary.wait_histogram[i] = stats.wait_histogram[i].load(std::memory_order_relaxed);
+					summary.hold_histogram[i] = stats.hold_histogram[i].load(std::memory_order_relaxed);
+					summary.cv_histogram[i] = stats.cv_histogram[i].load(std::memory_order_relaxed);
+				}
+				for (int i = 0; i < WaitPhaseCount; ++i)
+				{
+					summary.phase_acquired[i] = stats.phase_acquired[i].load(std::memory_order_relaxed);
+					summary.phase_total[i] = stats.phase_total[i].load(std::memory_order_relaxed);
+				}
+
+				auto& merged{sites[std::make_pair(stats.slot, stats.site)]};
+				if (!merged.id)
+				{
+					merged.id = stats.id;
+					merged.site = stats.site;
+				}
+				merged.merge(summary);
+			}
+		}
+	}
+
+	std::map<uint32_t, Summary> mutexes;
+	for (const auto& entry : sites)
+	{
+		auto& merged{mutexes[entry.first.first]};
+		if (!merged.id)
+			merged.id = entry.second.id;
+		merged.merge(entry.second);
+	}
+
+	std::vector<std::pair<uint32_t, const Summary*>> ranked;
+	for (const auto& entry : mutexes)
+		ranked.emplace_back(entry.first, &entry.second);
+	std::sort(ranked.begin(), ranked.end(), [](const auto& a, const auto& b) {
+		if (a.second->contended != b.second->contended)
+			return a.second->contended > b.second->contended;
+		return a.second->wait_total > b.second->wait_total;
+	});
+
+	flush(); // anything already raised comes first
+
+	std::unique_lock<std::mutex> printing_lock(printing_mutex);
+
+	auto current_outputs{outputs.load(std::memory_order_relaxed)};
+	char buffer[1024];
+	char wait_p50[16], wait_p99[16], wait_max[16], hold_p50[16], hold_p99[16], hold_max[16];
+
+	auto describe = [&](const char* prefix, const Summary& summary, bool show_holder) {
+		format_duration(wait_p50, sizeof(wait_p50), Summary::percentile(summary.wait_histogram, 0.50, summary.wait_max));
+		format_duration(wait_p99, sizeof(wait_p99), Summary::percentile(summary.wait_histogram, 0.99, summary.wait_max));
+		format_duration(wait_max, sizeof(wait_max), summary.wait_max);
+		format_duration(hold_p50, sizeof(hold_p50), Summary::percentile(summary.hold_histogram, 0.50, summary.hold_max));
+		format_duration(hold_p99, sizeof(hold_p99), Summary::percentile(summary.hold_histogram, 0.99, summary.hold_max));
+		format_duration(hold_max, sizeof(hold_max), summary.hold_max);
+
+		auto length{snprintf(buffer,
+							 sizeof(buffer),
+							 "%s%llu acquisitions, %llu contended (%.1f%%); wait p50 %s, p99 %s, max %s; hold p50 %s, p99 %s, max %s",
+							 prefix,
+							 static_cast<unsigned long long>(summary.acquisitions),
+							 static_cast<unsigned long long>(summary.contended),
+							 summary.acquisitions ? 100.0 * summary.contended / summary.acquisitions : 0.0,
+							 wait_p50,
+							 wait_p99,
+							 wait_max,
+							 hold_p50,
+							 hold_p99,
+							 hold_max)};
+
+		if (show_holder && summary.hold_max_site && length > 0 && static_cast<size_t>(length) < sizeof(buffer))
+			length += snprintf(buffer + length,
+							   sizeof(buffer) - length,
+							   " (locked in module %s:%d, unlocked in module %s:%d)",
+							   module_name(summary.hold_max_site),
+							   summary.hold_max_site->line,
+							   summary.hold_max_release ? module_name(summary.hold_max_release) : "?",
+							   summary.hold_max_release ? summary.hold_max_release->line : 0);
+
+		if (summary.over_budget && length > 0 && static_cast<size_t>(length) < sizeof(buffer))
+			length += snprintf(buffer + length, sizeof(buffer) - length, "; %llu holds over budget", static_cast<unsigned long long>(summary.over_budget));
+
+		if (summary.contended && length > 0 && static_cast<size_t>(length) < sizeof(buffer))
+		{
+			format_duration(wait_p50, sizeof(wait_p50), summary.phase_total[Spinning]);
+			format_duration(wait_p99, sizeof(wait_p99), summary.phase_total[BackingOff]);
+			format_duration(wait_max, sizeof(wait_max), summary.phase_total[Parked]);
+			length += snprintf(buffer + length,
+							   sizeof(buffer) - length,
+							   "; acquired %llu spinning, %llu backing off, %llu parked (%s, %s and %s spent in each)",
+							   static_cast<unsigned long long>(summary.phase_acquired[Spinning]),
+							   static_cast<unsigned long long>(summary.phase_acquired[BackingOff]),
+							   static_cast<unsigned long long>(summary.phase_acquired[Parked]),
+							   wait_p50,
+							   wait_p99,
+							   wait_max);
+		}
+
+		if (summary.cv_blocks && length > 0 && static_cast<size_t>(length) < sizeof(buffer))
+		{
+			format_duration(wait_p50, sizeof(wait_p50), Summary::percentile(summary.cv_histogram, 0.50, summary.cv_blocked_max));
+			format_duration(wait_p99, sizeof(wait_p99), Summary::percentile(summary.cv_histogram, 0.99, summary.cv_blocked_max));
+			format_duration(wait_max, sizeof(wait_max), summary.cv_blocked_max);
+			snprintf(buffer + length,
+					 sizeof(buffer) - length,
+					 "; %llu condition variable waits (%llu woken unsatisfied, %llu timed out), blocked p50 %s, p99 %s, max %s",
+					 static_cast<unsigned long long>(summary.cv_blocks),
+					 static_cast<unsigned long long>(summary.cv_unsatisfied),
+					 static_cast<unsigned long long>(summary.cv_timeouts),
+					 wait_p50,
+					 wait_p99,
+					 wait_max);
+		}
+
+		write_output(buffer, current_outputs);
+	};
+
+	snprintf(buffer,
+			 sizeof(buffer),
+			 "[[ Dreadlock ]] Lock statistics for %u of %u mutexes, most contended first:",
+			 static_cast<unsigned>(std::min(top, ranked.size())),
+			 static_cast<unsigned>(ranked.size()));
+	write_output(buffer, current_outputs);
+
+	for (size_t i = 0; i < ranked.size() && i < top; ++i)
+	{
+		auto slot_index{ranked[i].first};
+		auto& summary{*ranked[i].second};
+
+		char prefix[256];
+		snprintf(prefix, sizeof(prefix), "   %s (%p): ", summary.id, reinterpret_cast<void*>(tracking[slot_index].key.load(std::memory_order_relaxed)));
+		describe(prefix, summary, true);
+
+		for (auto site = sites.lower_bound(std::make_pair(slot_index, static_cast<const DreadlockSite*>(nullptr)));
+			 site != sites.end() && site->first.first == slot_index;
+			 ++site)
+		{
+			snprintf(prefix, sizeof(prefix), "      ... module %s:%d: ", module_name(site->second.site), site->second.site->line);
+			describe(prefix, site->second, false);
+		}
+	}
+
+	if (current_outputs & OutputConsole)
+		std::cout.flush();
+	if ((current_outputs & OutputFile) && output_file)
+		fflush(output_file);
+
+	printing_lock.unlock();
+
+	if (!csv_path)
+		return;
+
+	auto csv{fopen(csv_path, "w")};
+	if (!csv)
+		return;
+
+	fprintf(csv,
+			"mutex,address,file,line,acquisitions,contended,wait_total_ns,wait_p50_ns,wait_p99_ns,wait_max_ns,hold_total_ns,hold_p50_ns,hold_p99_ns,hold_max_ns,"
+			"cv_waits,cv_unsatisfied,cv_timeouts,cv_blocked_total_ns,cv_blocked_p50_ns,cv_blocked_p99_ns,cv_blocked_max_ns,"
+			"acquired_spinning,acquired_backing_off,acquired_parked,spin_total_ns,backoff_total_ns,park_total_ns,over_budget\n");
+	for (const auto& entry : sites)
+	{
+		const auto& summary{entry.second};
+		fprintf(csv,
+				"\"%s\",%p,\"%s\",%d,%llu,%llu,%llu,%lld,%lld,%llu,%llu,%lld,%lld,%llu,%llu,%llu,%llu,%llu,%lld,%lld,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu\n",
+				summary.id,
+				reinterpret_cast<void*>(tracking[entry.first.first].key.load(std::memory_order_relaxed)),
+				summary.site->file,
+				summary.site->line,
+				static_cast<unsigned long long>(summary.acquisitions),
+				static_cast<unsigned long long>(summary.contended),
+				static_cast<unsigned long long>(summary.wait_total),
+				static_cast<long long>(Summary::percentile(summary.wait_histogram, 0.50, summary.wait_max)),
+				static_cast<long long>(Summary::percentile(summary.wait_histogram, 0.99, summary.wait_max)),
+				static_cast<unsigned long long>(summary.wait_max),
+				static_cast<unsigned long long>(summary.hold_total),
+				static_cast<long long>(Summary::percentile(summary.hold_histogram, 0.50, summary.hold_max)),
+				static_cast<long long>(Summary::percentile(summary.hold_histogram, 0.99, summary.hold_max)),
+				static_cast<unsigned long long>(summary.hold_max),
+				static_cast<unsigned long long>(summary.cv_blocks),
+				static_cast<unsigned long long>(summary.cv_unsatisfied),
+				static_cast<unsigned long long>(summary.cv_timeouts),
+				static_cast<unsigned long long>(summary.cv_blocked_total),
+				static_cast<long long>(Summary::percentile(summary.cv_histogram, 0.50, summary.cv_blocked_max)),
+				static_cast<long long>(Summary::percentile(summary.cv_histogram, 0.99, summary.cv_blocked_max)),
+				static_cast<unsigned long long>(summary.cv_blocked_max),
+				static_cast<unsigned long long>(summary.phase_acquired[Spinning]),
+				static_cast<unsigned long long>(summary.phase_acquired[BackingOff]),
+				static_cast<unsigned long long>(summary.phase_acquired[Parked]),
+				static_cast<unsigned long long>(summary.phase_total[Spinning]),
+				static_cast<unsigned long long>(summary.phase_total[BackingOff]),
+				static_cast<unsigned long long>(summary.phase_total[Parked]),
+				static_cast<unsigned long long>(summary.over_budget));
+	}
+	fclose(csv);
+}
+
+void Dreadlock::dump_contention(size_t top, double min_waiters, double min_held)
+{
+	// by Little's law, the average number of threads waiting for a
+	// mutex is the total time spent waiting for it over the elapsed
+	// time, and the fraction of the time it's held is the same for the
+	// total hold time.  the waiting time is also what it has cost.
+
+	struct SiteSummary
+	{
+		uint64_t hold_total{0};
+		uint64_t hold_max{0};
+	};
+
+	struct Pair
+	{
+		uint64_t waits{0};
+		uint64_t wait_total{0};
+	};
+
+	struct MutexSummary
+	{
+		const char* id{nullptr};
+		uint64_t acquisitions{0};
+		uint64_t contended{0};
+		uint64_t wait_total{0};
+		uint64_t hold_total{0};
+		uint64_t other_wait_total{0}; // behind holders that didn't fit in a site's blockers
+		std::map<const DreadlockSite*, SiteSummary> sites;
+		std::map<std::pair<const DreadlockSite*, const DreadlockSite*>, Pair> pairs; // (waiter, holder)
+	};
+
+	auto elapsed{std::max<int64_t>(now_ns() - stats_start, 1)};
+
+	std::map<uint32_t, MutexSummary> mutexes;
+	for (auto state = thread_states.load(std::memory_order_acquire); state; state = state->next)
+	{
+		for (auto block = state->stats_blocks.load(std::memory_order_acquire); block; block = block->next)
+		{
+			auto used{block->used.load(std::memory_order_acquire)};
+			for (uint32_t entry = 0; entry < used; ++entry)
+			{
+				const auto& stats{block->entries[entry]};
+				auto& summary{mutexes[stats.slot]};
+				summary.id = stats.id;
+				summary.acquisitions += stats.acquisitions.load(std::memory_order_relaxed);
+				summary.contended += stats.contended.load(std::memory_order_relaxed);
+				summary.wait_total += stats.wait_total.load(std::memory_order_relaxed);
+
+				auto hold_total{stats.hold_total.load(std::memory_order_relaxed)};
+				auto& site{summary.sites[stats.site]};
+				summary.hold_total += hold_total;
+				site.hold_total += hold_total;
+				site.hold_max = std::max(site.hold_max, stats.hold_max.load(std::memory_order_relaxed));
+
+				auto blockers{stats.blocker_count.load(std::memory_order_acquire)};
+				for (uint32_t i = 0; i < blockers; ++i)
+				{
+					auto& pair{summary.pairs[std::make_pair(stats.site, stats.blockers[i].site.load(std::memory_order_relaxed))]};
+					pair.waits += stats.blockers[i].waits.load(std::memory_order_relaxed);
+					pair.wait_total += stats.blockers[i].wait_total.load(std::memory_order_relaxed);
+				}
+				summary.other_wait_total += stats.other_wait_total.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// the hot ones, most time lost first
+	std::vector<std::pair<uint32_t, const MutexSummary*>> hot;
+	for (const auto& entry : mutexes)
+	{
+		const auto& summary{entry.second};
+		if (static_cast<double>(summary.wait_total) / elapsed >= min_waiters || static_cast<double>(summary.hold_total) / elapsed >= min_held)
+			hot.emplace_back(entry.first, &summary);
+	}
+	std::sort(hot.begin(), hot.end(), [](const auto& a, const auto& b) { return a.second->wait_total > b.second->wait_total; });
+
+	flush(); // anything already raised comes first
+
+	std::unique_lock<std::mutex> printing_lock(printing_mutex);
+
+	auto current_outputs{outputs.load(std::memory_order_relaxed)};
+	char buffer[1024];
+	char elapsed_text[16], lost[16], longest[16];
+
+	format_duration(elapsed_text, sizeof(elapsed_text), elapsed);
+	if (hot.empty())
+	{
+		snprintf(buffer, sizeof(buffer), "[[ Dreadlock ]] Contention over %s: none of %u mutexes is hot", elapsed_text, static_cast<unsigned>(mutexes.size()));
+		write_output(buffer, current_outputs);
+		return;
+	}
+
+	snprintf(buffer,
+			 sizeof(buffer),
+			 "[[ Dreadlock ]] Contention over %s: %u of %u mutexes are hot, most time lost first:",
+			 elapsed_text,
+			 static_cast<unsigned>(hot.size()),
+			 static_cast<unsigned>(mutexes.size()));
+	write_output(buffer, current_outputs);
+
+	for (size_t i = 0; i < hot.size() && i < top; ++i)
+	{
+		auto& slot{tracking[hot[i].first]};
+		const auto& summary{*hot[i].second};
+		auto held{static_cast<double>(summary.hold_total) / elapsed};
+
+		format_duration(lost, sizeof(lost), summary.wait_total);
+		snprintf(buffer,
+				 sizeof(buffer),
+				 "   %s (%p): %s lost waiting; %.2f threads waiting on average (at most %u); held %.0f%% of the time; %llu of %llu acquisitions contended",
+				 summary.id,
+				 reinterpret_cast<void*>(slot.key.load(std::memory_order_relaxed)),
+				 lost,
+				 static_cast<double>(summary.wait_total) / elapsed,
+				 slot.peak_waiters.load(std::memory_order_relaxed),
+				 100.0 * held,
+				 static_cast<unsigned long long>(summary.contended),
+				 static_cast<unsigned long long>(summary.acquisitions));
+		write_output(buffer, current_outputs);
+
+		// the sites that contend, longest waits first
+		std::vector<std::pair<const std::pair<const DreadlockSite*, const DreadlockSite*>*, const Pair*>> pairs;
+		uint64_t pair_total{0}, self_total{0};
+		for (const auto& pair : summary.pairs)
+		{
+			pairs.emplace_back(&pair.first, &pair.second);
+			pair_total += pair.second.wait_total;
+			if (pair.first.first == pair.first.second)
+				self_total += pair.second.wait_total;
+		}
+		std::sort(pairs.begin(), pairs.end(), [](const auto& a, const auto& b) { return a.second->wait_total > b.second->wait_total; });
+
+		for (size_t j = 0; j < pairs.size() && j < 5; ++j)
+		{
+			auto waiter{pairs[j].first->first};
+			auto holder{pairs[j].first->second};
+			format_duration(lost, sizeof(lost), pairs[j].second->wait_total);
+			auto length{snprintf(buffer,
+								 sizeof(buffer),
+								 "      module %s:%d waited %s (%llu times) behind ",
+								 module_name(waiter),
+								 waiter->line,
+								 lost,
+								 static_cast<unsigned long long>(pairs[j].second->waits))};
+			if (length > 0 && static_cast<size_t>(length) < sizeof(buffer))
+			{
+				if (holder)
+					snprintf(buffer + length, sizeof(buffer) - length, "module %s:%d", module_name(holder), holder->line);
+				else
+					snprintf(buffer + length, sizeof(buffer) - length, "an unknown holder");
+			}
+			write_output(buffer, current_outputs);
+		}
+		if (summary.other_wait_total)
+		{
+			format_duration(lost, sizeof(lost), summary.other_wait_total);
+			snprintf(buffer, sizeof(buffer), "      (and %s behind other holders)", lost);
+			write_output(buffer, current_outputs);
+		}
+
+		// what to do about it
+		if (summary.hold_total && held >= min_held)
+		{
+			const DreadlockSite* longest_site{nullptr};
+			uint64_t longest_total{0}, longest_max{0};
+			for (const auto& site : summary.sites)
+			{
+				if (site.second.hold_total >= longest_total)
+				{
+					longest_site = site.first;
+					longest_total = site.second.hold_total;
+					longest_max = site.second.hold_max;
+				}
+			}
+
+			format_duration(longest, sizeof(longest), longest_max);
+			snprintf(buffer,
+					 sizeof(buffer),
+					 "      suggestion: it's held so much of the time that its holders run one at a time; move work out from under it, starting with module %s:%d (%.0f%% of the hold time, up to %s at once)",
+					 module_name(longest_site),
+					 longest_site->line,
+					 summary.hold_total ? 100.0 * longest_total / summary.hold_total : 0.0,
+					 longest);
+			write_output(buffer, current_outputs);
+		}
+
+		if (pair_total && self_total * 2 >= pair_total)
+			write_output("      suggestion: it's mostly the same code waiting behind itself; shard the mutex (by key, or per thread) so its callers spread out", current_outputs);
+		else if (pair_total)
+			write_output("      suggestion: it's mostly different sites waiting behind each other; if they guard different data, give them mutexes of their own, and if the waiting sites only read, a shared mutex would let them overlap", current_outputs);
+	}
+}
+
+size_t Dreadlock::snapshot(SnapshotEntry* entries, size_t capacity)
+{
+	// may be running in a signal handler, so nothing here locks, waits
+	// or allocates.  a thread's view is re-read a bounded number of
+	// times, which also keeps a handler from spinning on a view that
+	// the thread it interrupted was half way through changing.
+
+	const int Attempts = 16;
+
+	auto now{now_ns()};
+	size_t count{0};
+
+	for (auto state = thread_states.load(std::memory_order_acquire); state; state = state->next)
+	{
+		if (!state->in_use.load(std::memory_order_acquire))
+			continue;
+
+		SnapshotEntry found[DREADLOCK_MAX_HELD + 1];
+		uint32_t slots[DREADLOCK_MAX_HELD + 1];
+		uint32_t found_count{0};
+		bool consistent{false};
+
+		for (int attempt = 0; attempt < Attempts && !consistent; ++attempt)
+		{
+			auto before{state->view_sequence.load(std::memory_order_acquire)};
+			if (before & 1)
+				continue;
+
+			auto thread{state->view_thread.load(std::memory_order_relaxed)};
+			auto held_count{std::min<uint32_t>(state->view_count.load(std::memory_order_relaxed), DREADLOCK_MAX_HELD)};
+
+			found_count = 0;
+			auto read = [&](const ViewLock& view, bool waiting) {
+				slots[found_count] = view.slot.load(std::memory_order_relaxed);
+				if (!slots[found_count])
+					return;
+
+				auto& entry{found[found_count++]};
+				entry = SnapshotEntry();
+				entry.thread = thread;
+				entry.waiting = waiting;
+				entry.shared = view.shared.load(std::memory_order_relaxed);
+				entry.id = view.id.load(std::memory_order_relaxed);
+				entry.site = view.site.load(std::memory_order_relaxed);
+				entry.dreadlock_id = view.dreadlock_id.load(std::memory_order_relaxed);
+				auto since{view.since.load(std::memory_order_relaxed)};
+				entry.duration = since ? std::max<int64_t>(now - since, 0) : -1;
+			};
+
+			for (uint32_t i = 0; i < held_count; ++i)
+				read(state->view[i], false);
+			read(state->view_wait, true);
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+			consistent = state->view_sequence.load(std::memory_order_relaxed) == before;
+		}
+
+		if (!consistent)
+			continue; // it's locking faster than we can read it
+
+		for (uint32_t i = 0; i < found_count; ++i)
+		{
+			auto& entry{found[i]};
+			auto& slot{tracking[slots[i] - 1]};
+			entry.mutex = reinterpret_cast<const void*>(slot.key.load(std::memory_order_relaxed));
+
+			if (entry.waiting)
+			{
+				// the same reading as current_owner(), minus the shared
+				// owners' details, which are kept under a lock
+				for (int attempt = 0; attempt < Attempts; ++attempt)
+				{
+					auto owner{slot.owner.load(std::memory_order_acquire)};
+					auto owner_site{slot.owner_site.load(std::memory_order_relaxed)};
+					if (slot.owner.load(std::memory_order_acquire) == owner)
+					{
+						entry.owner = owner;
+						entry.owner_site = owner ? owner_site : nullptr;
+						break;
+					}
+				}
+				entry.readers = slot.readers.load(std::memory_order_relaxed);
+			}
+
+			if (count < capacity)
+				entries[count] = entry;
+			++count;
+		}
+	}
+
+	return count;
+}
+
+void Dreadlock::dump_snapshot()
+{
+	std::vector<SnapshotEntry> entries(64);
+	for (;;)
+	{
+		auto count{snapshot(entries.data(), entries.size())};
+		if (count <= entries.size())
+		{
+			entries.resize(count);
+			break;
+		}
+		entries.resize(count * 2); // more may have appeared by the time we look again
+	}
+
+	size_t held{0};
+	for (const auto& entry : entries)
+		held += entry.waiting ? 0 : 1;
+
+	flush(); // anything already raised comes first
+
+	std::unique_lock<std::mutex> printing_lock(printing_mutex);
+
+	auto current_outputs{outputs.load(std::memory_order_relaxed)};
+	char buffer[1024];
+	char duration[16];
+
+	snprintf(buffer,
+			 sizeof(buffer),
+			 "[[ Dreadlock ]] Snapshot: %u locks held, %u waits in progress",
+			 static_cast<unsigned>(held),
+			 static_cast<unsigned>(entries.size() - held));
+	write_output(buffer, current_outputs);
+
+	for (const auto& entry : entries)
+	{
+		if (entry.duration >= 0)
+			format_duration(duration, sizeof(duration), entry.duration);
+		else
+			snprintf(duration, sizeof(duration), "?");
+
+		auto length{snprintf(buffer,
+							 sizeof(buffer),
+							 "   thread %u %s %s (%p)%s for %s, %s module %s:%d",
+							 entry.thread,
+							 entry.waiting ? "waiting on" : "holds",
+							 entry.id,
+							 entry.mutex,
+							 entry.shared ? " shared" : "",
+							 duration,
+							 entry.waiting ? "in" : "locked in",
+							 module_name(entry.site),
+							 entry.site->line)};
+
+		if (entry.waiting && length > 0 && static_cast<size_t>(length) < sizeof(buffer))
+		{
+			// the holder's thread, if it's in this snapshot
+			const SnapshotEntry* holder{nullptr};
+			for (const auto& other : entries)
+			{
+				if (!other.waiting && entry.owner && other.dreadlock_id == entry.owner)
+				{
+					holder = &other;
+					break;
+				}
+			}
+
+			if (holder)
+				snprintf(buffer + length, sizeof(buffer) - length, "; held by thread %u since module %s:%d", holder->thread, module_name(holder->site), holder->site->line);
+			else if (entry.owner && entry.owner_site)
+				snprintf(buffer + length, sizeof(buffer) - length, "; held since module %s:%d", module_name(entry.owner_site), entry.owner_site->line);
+			else if (entry.readers)
+				snprintf(buffer + length, sizeof(buffer) - length, "; held shared by %u threads", entry.readers);
+		}
+
+		write_output(buffer, current_outputs);
+	}
+}
+
+bool Dreadlock::set_shared_table(const char* path)
+{
+	auto fail = [](const char* why, const char* path) {
+		flush();
+
+		std::unique_lock<std::mutex> printing_lock(printing_mutex);
+		char buffer[512];
+		snprintf(buffer, sizeof(buffer), "[[ Dreadlock ]] Can't use the shared table %s: %s", path, why);
+		write_output(buffer, outputs.load(std::memory_order_relaxed));
+		return false;
+	};
+
+	if (shared_table.load(std::memory_order_acquire))
+		return fail("a shared table is already in use", path);
+
+#if defined(_WIN32)
+	return fail("not supported on Windows", path);
+#else
+	auto size{DreadlockSharedHeader::size_for(DREADLOCK_SHARED_THREADS, DREADLOCK_SHARED_MUTEXES)};
+
+	auto fd{open(path, O_RDWR | O_CREAT, 0666)};
+	if (fd < 0)
+		return fail(strerror(errno), path);
+
+	// a new file reads as zeros, which is an empty table waiting to be
+	// set up by whichever process gets to it first
+	struct stat info;
+	if (fstat(fd, &info) || (info.st_size < static_cast<off_t>(size) && ftruncate(fd, static_cast<off_t>(size))))
+	{
+		close(fd);
+		return fail(strerror(errno), path);
+	}
+
+	auto memory{mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)};
+	close(fd);
+	if (memory == MAP_FAILED)
+		return fail(strerror(errno), path);
+
+	auto table{static_cast<DreadlockSharedHeader*>(memory)};
+
+	uint32_t state{0};
+	if (table->state.compare_exchange_strong(state, 1, std::memory_order_acquire))
+	{
+		memcpy(table->magic, "DREADLK", sizeof(table->magic));
+		table->version = DreadlockSharedHeader::CurrentVersion;
+		table->thread_capacity = DREADLOCK_SHARED_THREADS;
+		table->mutex_capacity = DREADLOCK_SHARED_MUTEXES;
+		table->thread_size = sizeof(DreadlockSharedThread);
+		table->mutex_size = sizeof(DreadlockSharedMutex);
+		table->state.store(2, std::memory_order_release);
+	}
+	else
+	{
+		// another process is setting it up (or died doing so)
+		auto give_up{now_ns() + 1000000000};
+		while (table->state.load(std::memory_order_acquire) != 2 && now_ns() < give_up)
+			std::this_thread::yield();
+	}
+
+	if (table->state.load(std::memory_order_acquire) != 2 ||
+		memcmp(table->magic, "DREADLK", sizeof(table->magic)) ||
+		table->version != DreadlockSharedHeader::CurrentVersion ||
+		table->thread_capacity != DREADLOCK_SHARED_THREADS ||
+		table->mutex_capacity != DREADLOCK_SHARED_MUTEXES ||
+		table->thread_size != sizeof(DreadlockSharedThread) ||
+		table->mutex_size != sizeof(DreadlockSharedMutex))
+	{
+		munmap(memory, size);
+		return fail("the file holds a different kind of table (delete it, or build every process with the same DREADLOCK_SHARED_* settings)", path);
+	}
+
+	// processes that died without cleaning up leave records behind
+	auto alive = [](uint32_t pid) { return kill(static_cast<pid_t>(pid), 0) == 0 || errno != ESRCH; };
+
+	auto threads{table->threads()};
+	for (uint32_t i = 0; i < table->thread_capacity; ++i)
+	{
+		auto pid{threads[i].pid.load(std::memory_order_relaxed)};
+		if (pid && !alive(pid))
+			release_process(table, pid);
+	}
+
+	auto mutexes{table->mutexes()};
+	uint64_t checked{0};
+	for (uint32_t i = 0; i < table->mutex_capacity; ++i)
+	{
+		auto region{mutexes[i].region};
+		if (mutexes[i].claimed.load(std::memory_order_acquire) == DreadlockSharedMutex::InUse && region != checked && !(region >> 63))
+		{
+			checked = region;
+			if (!alive(static_cast<uint32_t>(region)))
+				release_process(table, static_cast<uint32_t>(region));
+		}
+	}
+
+	shared_pid.store(current_pid(), std::memory_order_relaxed);
+	shared_table.store(table, std::memory_order_release);
+
+	// a forked child inherits its parent's records, which its threads
+	// and own mutexes can't go on using
+	pthread_atfork(nullptr, nullptr, [] {
+		shared_pid.store(current_pid(), std::memory_order_relaxed);
+		for (auto& slot : tracking)
+			slot.shared_record.store(0, std::memory_order_relaxed);
+	});
+
+	// the mapping outlives the table's use, as threads may still be
+	// mirroring into it when this runs
+	std::atexit([] {
+		if (auto table = shared_table.exchange(nullptr, std::memory_order_acq_rel))
+			release_process(table, shared_pid.load(std::memory_order_relaxed));
+	});
+
+	return true;
+#endif
+}
+
+void Dreadlock::share_region(const void* base, size_t size, const char* name)
+{
+	auto index{shared_region_count.fetch_add(1, std::memory_order_relaxed)};
+	if (index >= DREADLOCK_SHARED_REGIONS)
+	{
+		flush();
+
+		std::unique_lock<std::mutex> printing_lock(printing_mutex);
+		char buffer[256];
+		snprintf(buffer, sizeof(buffer), "[[ Dreadlock ]] No room to name the shared region %s (see DREADLOCK_SHARED_REGIONS)", name);
+		write_output(buffer, outputs.load(std::memory_order_relaxed));
+		return;
+	}
+
+	auto& region{shared_regions[index]};
+	region.size = size;
+	region.id = shared_region_id(name);
+	region.base.store(reinterpret_cast<uintptr_t>(base), std::memory_order_release);
+}
+
+uint32_t Dreadlock::shared_thread(ThreadState& state)
+{
+	// a thread claims a record the first time it locks or waits with
+	// the table in use, and gives it back when it exits (see
+	// thread_state()).  zero if the table is full.
+
+	auto table{shared_table.load(std::memory_order_acquire)};
+	if (!table)
+		return 0;
+
+	auto pid{shared_pid.load(std::memory_order_relaxed)};
+	auto threads{table->threads()};
+	if (state.shared_thread && threads[state.shared_thread - 1].pid.load(std::memory_order_relaxed) == pid)
+		return state.shared_thread;
+
+	for (uint32_t i = 0; i < table->thread_capacity; ++i)
+	{
+		uint32_t expected{0};
+		if (!threads[i].pid.load(std::memory_order_relaxed) && threads[i].pid.compare_exchange_strong(expected, pid, std::memory_order_acquire))
+		{
+			threads[i].thread.store(state.thread_number, std::memory_order_relaxed);
+			threads[i].waiting_on.store(0, std::memory_order_relaxed);
+			state.shared_thread = i + 1;
+			return state.shared_thread;
+		}
+	}
+
+	return 0;
+}
+
+uint32_t Dreadlock::shared_record()
+{
+	// finds (or claims) the mutex's record, which is the same for every
+	// process when the mutex is in a named region, and for this process
+	// alone otherwise.  the slot remembers it, so this is done once per
+	// mutex, under the slot's info_mutex so the slot's threads agree.
+
+	auto record{slot->shared_record.load(std::memory_order_acquire)};
+	if (record)
+		return record;
+
+	auto table{shared_table.load(std::memory_order_acquire)};
+	if (!table)
+		return 0;
+
+	std::unique_lock<std::mutex> info_lock(slot->info_mutex);
+	record = slot->shared_record.load(std::memory_order_relaxed);
+	if (record)
+		return record;
+
+	auto address{reinterpret_cast<uintptr_t>(mtx)};
+	uint64_t region{shared_pid.load(std::memory_order_relaxed)};
+	uint64_t offset{address};
+	auto regions{std::min<uint32_t>(shared_region_count.load(std::memory_order_relaxed), DREADLOCK_SHARED_REGIONS)};
+	for (uint32_t i = 0; i < regions; ++i)
+	{
+		auto base{shared_regions[i].base.load(std::memory_order_acquire)};
+		if (base && address >= base && address - base < shared_regions[i].size)
+		{
+			region = shared_regions[i].id;
+			offset = address - base;
+			break;
+		}
+	}
+
+	auto mutexes{table->mutexes()};
+	auto capacity{table->mutex_capacity};
+	auto start{static_cast<uint32_t>(((region ^ offset) * 0x9E3779B97F4A7C15ull) >> 32) % capacity};
+
+	// the first probe for the key that finds neither it nor a free
+	// record has the table full; claiming a retired record on the way
+	// means a retry if another process claims it first
+	for (;;)
+	{
+		uint32_t claimable{capacity};
+		uint32_t found{capacity};
+
+		for (uint32_t probe = 0; probe < capacity; ++probe)
+		{
+			auto index{(start + probe) % capacity};
+			auto& entry{mutexes[index]};
+
+			auto claimed{entry.claimed.load(std::memory_order_acquire)};
+			while (claimed == DreadlockSharedMutex::Claiming)
+			{
+				std::this_thread::yield();
+				claimed = entry.claimed.load(std::memory_order_acquire);
+			}
+
+			if (claimed == DreadlockSharedMutex::InUse && entry.region == region && entry.offset == offset)
+			{
+				found = index;
+				break;
+			}
+
+			if (claimed == DreadlockSharedMutex::Retired && claimable == capacity)
+				claimable = index;
+
+			if (claimed == DreadlockSharedMutex::Free)
+			{
+				if (claimable == capacity)
+					claimable = index;
+				break;
+			}
+		}
+
+		if (found == capacity && claimable != capacity)
+		{
+			auto& entry{mutexes[claimable]};
+			auto current{entry.claimed.load(std::memory_order_relaxed)};
+			if ((current != DreadlockSharedMutex::Free && current != DreadlockSharedMutex::Retired) ||
+				!entry.claimed.compare_exchange_strong(current, DreadlockSharedMutex::Claiming, std::memory_order_acquire))
+				continue;
+
+			entry.region = region;
+			entry.offset = offset;
+			entry.owner.store(0, std::memory_order_relaxed);
+			entry.readers.store(0, std::memory_order_relaxed);
+			entry.since.store(0, std::memory_order_relaxed);
+			copy_text(entry.name, sizeof(entry.name), id);
+			copy_text(entry.site.module, sizeof(entry.site.module), "");
+			entry.site.line = 0;
+			entry.claimed.store(DreadlockSharedMutex::InUse, std::memory_order_release);
+			found = claimable;
+		}
+
+		if (found == capacity)
+		{
+			static std::atomic<bool> reported{false};
+			if (!reported.exchange(true, std::memory_order_relaxed))
+			{
+				info_lock.unlock();
+				flush();
+
+				std::unique_lock<std::mutex> printing_lock(printing_mutex);
+				write_output("[[ Dreadlock ]] The shared table has no room for more mutexes (see DREADLOCK_SHARED_MUTEXES)", outputs.load(std::memory_order_relaxed));
+			}
+			return 0;
+		}
+
+		slot->shared_record.store(found + 1, std::memory_order_release);
+		return found + 1;
+	}
+}
+
+uint32_t Dreadlock::progress()
+{
+	// the mutex's acquisitions, by every process when it's in the
+	// shared table
+
+	auto record{slot->shared_record.load(std::memory_order_relaxed)};
+	auto table{shared_table.load(std::memory_order_relaxed)};
+	if (table && record)
+		return table->mutexes()[record - 1].acquisitions.load(std::memory_order_relaxed);
+	return slot->acquisitions.load(std::memory_order_relaxed);
+}
+
+// the shared records' sequence locks, as in ThreadState's view
+template <typename Record>
+static void begin_record(Record& record)
+{
+	record.sequence.store(record.sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+}
+
+template <typename Record>
+static void end_record(Record& record)
+{
+	record.sequence.store(record.sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+// copies what 'read' reads from the record once it's seen unchanged
+// (the dreadlock_table tool does the same), giving up if the record
+// is too busy to catch still
+template <typename Record, typename Read>
+static bool read_record(const Record& record, Read read)
+{
+	for (int attempt = 0; attempt < 16; ++attempt)
+	{
+		auto before{record.sequence.load(std::memory_order_acquire)};
+		if (before & 1)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+
+		read();
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (record.sequence.load(std::memory_order_relaxed) == before)
+			return true;
+	}
+
+	return false;
+}
+
+static void share_site(DreadlockSharedSite& to, const char* module, int line)
+{
+	copy_text(to.module, sizeof(to.module), module);
+	to.line = line;
+}
+
+void Dreadlock::shared_acquired(const DreadlockSite* site)
+{
+	auto thread{shared_thread(thread_state())};
+	auto record{shared_record()};
+	auto table{shared_table.load(std::memory_order_relaxed)};
+	if (!thread || !record || !table)
+		return;
+
+	auto& entry{table->mutexes()[record - 1]};
+	entry.acquisitions.fetch_add(1, std::memory_order_relaxed);
+
+	if (shared)
+		entry.readers.fetch_add(1, std::memory_order_relaxed);
+	else if (!ops->recursive || !entry.owner.load(std::memory_order_relaxed))
+	{
+		// holding the mutex entitles us to the record, as with the slot
+		begin_record(entry);
+		share_site(entry.site, module_name(site), site->line);
+		entry.since.store(now_ns(), std::memory_order_relaxed);
+		entry.owner.store(thread, std::memory_order_relaxed);
+		end_record(entry);
+	}
+}
+
+void Dreadlock::shared_released()
+{
+	auto record{slot->shared_record.load(std::memory_order_relaxed)};
+	auto table{shared_table.load(std::memory_order_relaxed)};
+	auto thread{thread_state().shared_thread};
+	if (!record || !table || !thread)
+		return;
+
+	auto& entry{table->mutexes()[record - 1]};
+
+	if (shared)
+	{
+		// the table may have appeared after this was locked
+		auto readers{entry.readers.load(std::memory_order_relaxed)};
+		while (readers && !entry.readers.compare_exchange_weak(readers, readers - 1, std::memory_order_relaxed))
+			;
+	}
+	else if (entry.owner.load(std::memory_order_relaxed) == thread && slot->owner.load(std::memory_order_relaxed) == this_dreadlock)
+	{
+		auto successor{ops->recursive ? held_by_this_thread(false) : nullptr};
+		begin_record(entry);
+		if (successor)
+			share_site(entry.site, module_name(successor->site), successor->site->line);
+		else
+			entry.owner.store(0, std::memory_order_relaxed);
+		end_record(entry);
+	}
+}
+
+void Dreadlock::shared_waiting(ThreadState& state, const DreadlockSite* site, int64_t since)
+{
+	auto thread{shared_thread(state)};
+	auto table{shared_table.load(std::memory_order_relaxed)};
+	if (!thread || !table)
+		return;
+
+	auto record{site ? shared_record() : 0};
+
+	auto& entry{table->threads()[thread - 1]};
+	begin_record(entry);
+	share_site(entry.site, site ? module_name(site) : "", site ? site->line : 0);
+	entry.since.store(since, std::memory_order_relaxed);
+	entry.waiting_on.store(record, std::memory_order_relaxed);
+	end_record(entry);
+}
+
+void Dreadlock::report_shared_chain(uint32_t thread_record, uint32_t mutex_record)
+{
+	// follows a deadlocked wait through the shared table, from owner to
+	// the owner's own wait, until the chain ends or comes back around
+
+	auto table{shared_table.load(std::memory_order_acquire)};
+	if (!table || !thread_record || !mutex_record)
+		return;
+
+	auto threads{table->threads()};
+	auto mutexes{table->mutexes()};
+
+	std::unique_lock<std::mutex> printing_lock(printing_mutex);
+
+	auto current_outputs{outputs.load(std::memory_order_relaxed)};
+	char buffer[512];
+	char duration[16];
+	auto now{now_ns()};
+
+	write_output("[[ Dreadlock ]] The wait, followed through the shared table:", current_outputs);
+
+	const size_t MaxSteps{16};
+	uint32_t visited[MaxSteps];
+	size_t steps{0};
+
+	auto thread{thread_record};
+	auto mutex{mutex_record};
+	for (;;)
+	{
+		if (steps == MaxSteps)
+		{
+			write_output("   ...and on, further than is followed", current_outputs);
+			break;
+		}
+		visited[steps++] = thread;
+
+		auto& waiter{threads[thread - 1]};
+		auto& entry{mutexes[mutex - 1]};
+
+		DreadlockSharedSite waiting_at{};
+		read_record(waiter, [&] { waiting_at = waiter.site; });
+		waiting_at.module[sizeof(waiting_at.module) - 1] = 0;
+
+		uint32_t owner{0};
+		int64_t since{0};
+		DreadlockSharedSite locked_at{};
+		read_record(entry, [&] {
+			owner = entry.owner.load(std::memory_order_relaxed);
+			since = entry.since.load(std::memory_order_relaxed);
+			locked_at = entry.site;
+		});
+		locked_at.module[sizeof(locked_at.module) - 1] = 0;
+
+		auto length{snprintf(buffer,
+							 sizeof(buffer),
+							 "   thread %u of process %u waits for %s in module %s:%d",
+							 waiter.thread.load(std::memory_order_relaxed),
+							 waiter.pid.load(std::memory_order_relaxed),
+							 entry.name,
+							 waiting_at.module,
+							 waiting_at.line)};
+		if (length < 0 || static_cast<size_t>(length) >= sizeof(buffer))
+			length = 0;
+
+		if (!owner || owner > table->thread_capacity)
+		{
+			auto readers{entry.readers.load(std::memory_order_relaxed)};
+			if (readers)
+				snprintf(buffer + length, sizeof(buffer) - length, ", held shared by %u threads", readers);
+			else
+				snprintf(buffer + length, sizeof(buffer) - length, ", which no tracked thread holds");
+			write_output(buffer, current_outputs);
+			break;
+		}
+
+		auto& holder{threads[owner - 1]};
+		format_duration(duration, sizeof(duration), now - since);
+		snprintf(buffer + length,
+				 sizeof(buffer) - length,
+				 ", held by thread %u of process %u since module %s:%d (%s)",
+				 holder.thread.load(std::memory_order_relaxed),
+				 holder.pid.load(std::memory_order_relaxed),
+				 locked_at.module,
+				 locked_at.line,
+				 duration);
+		write_output(buffer, current_outputs);
+
+		if (std::find(visited, visited + steps, owner) != visited + steps)
+		{
+			uint32_t pids[MaxSteps];
+			size_t processes{0};
+			for (size_t i = 0; i < steps; ++i)
+			{
+				auto pid{threads[visited[i] - 1].pid.load(std::memory_order_relaxed)};
+				if (std::find(pids, pids + processes, pid) == pids + processes)
+					pids[processes++] = pid;
+			}
+
+			snprintf(buffer, sizeof(buffer), "   ...which closes a cycle of %u threads in %u processes", static_cast<unsigned>(steps), static_cast<unsigned>(processes));
+			write_output(buffer, current_outputs);
+			break;
+		}
+
+		mutex = holder.waiting_on.load(std::memory_order_relaxed);
+		if (!mutex || mutex > table->mutex_capacity)
+		{
+			write_output("   ...which isn't waiting for a lock", current_outputs);
+			break;
+		}
+
+		thread = owner;
+	}
+
+	if (current_outputs & OutputConsole)
+		std::cout.flush();
+	if ((current_outputs & OutputFile) && output_file)
+		fflush(output_file);
+}
+
+const DreadlockSite& Dreadlock::site_at(const char* file, int line)
+{
+	auto record{runtime_record(
+		runtime_sites,
+		(reinterpret_cast<uintptr_t>(file) >> 3) ^ (static_cast<uint64_t>(line) << 40),
+		[&](const RuntimeSite& record) { return record.site.file == file && record.site.line == line; },
+		[&](RuntimeSite& record) { record.site = DreadlockSite{file, dreadlock_module_name(file), line}; })};
+
+	return record ? record->site : unknown_runtime_site;
+}
+
+const char* Dreadlock::name_at(const void* mutex)
+{
+	auto record{runtime_record(
+		runtime_names,
+		reinterpret_cast<uintptr_t>(mutex) >> 3,
+		[&](const RuntimeName& record) { return record.mutex == mutex; },
+		[&](RuntimeName& record) {
+			record.mutex = mutex;
+			snprintf(record.name, sizeof(record.name), "%p", mutex);
+		})};
+
+	return record ? record->name : "(unknown)";
+}
+
+bool Dreadlock::set_event_log(const char* path)
+{
+	auto fail = [](const char* why, const char* path) {
+		flush();
+
+		std::unique_lock<std::mutex> printing_lock(printing_mutex);
+		char buffer[512];
+		snprintf(buffer, sizeof(buffer), "[[ Dreadlock ]] Can't write the event log %s: %s", path, why);
+		write_output(buffer, outputs.load(std::memory_order_relaxed));
+		return false;
+	};
+
+	if (event_log.load(std::memory_order_acquire))
+		return fail("an event log is already in use", path);
+
+#if defined(_WIN32)
+	return fail("not supported on Windows", path);
+#else
+	std::string name;
+	for (auto p = path; *p; ++p)
+	{
+		if (p[0] == '%' && p[1] == 'p')
+		{
+			name += std::to_string(current_pid());
+			++p;
+		}
+		else
+			name += *p;
+	}
+
+	auto size{DreadlockEventLogHeader::size_for(DREADLOCK_EVENT_LOG_STRINGS, DREADLOCK_EVENT_LOG_THREADS, DREADLOCK_EVENT_LOG_CAPACITY)};
+
+	// the file is sparse: only the rings of threads that lock anything,
+	// and as much of them as they fill, take up space
+	auto fd{open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666)};
+	if (fd < 0)
+		return fail(strerror(errno), name.c_str());
+
+	if (ftruncate(fd, static_cast<off_t>(size)))
+	{
+		close(fd);
+		return fail(strerror(errno), name.c_str());
+	}
+
+	auto memory{mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)};
+	close(fd);
+	if (memory == MAP_FAILED)
+		return fail(strerror(errno), name.c_str());
+
+	auto log{static_cast<DreadlockEventLogHeader*>(memory)};
+	log->version = DreadlockEventLogHeader::CurrentVersion;
+	log->pid = current_pid();
+	log->ring_capacity = DREADLOCK_EVENT_LOG_THREADS;
+	log->event_capacity = DREADLOCK_EVENT_LOG_CAPACITY;
+	log->event_size = sizeof(DreadlockEvent);
+	log->string_capacity = DREADLOCK_EVENT_LOG_STRINGS;
+	log->clock_start = now_ns();
+	log->system_start = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy(log->magic, "DREADEV", sizeof(log->magic));
+
+	// a forked child would go on writing into its parent's rings; it
+	// starts afresh if it sets a log of its own
+	static bool fork_handler{[] {
+		pthread_atfork(nullptr, nullptr, [] {
+			event_log.store(nullptr, std::memory_order_relaxed);
+			for (auto& entry : event_strings)
+			{
+				entry.key.store(nullptr, std::memory_order_relaxed);
+				entry.offset.store(0, std::memory_order_relaxed);
+			}
+			for (auto state = thread_states.load(std::memory_order_acquire); state; state = state->next)
+			{
+				state->event_ring = nullptr;
+				state->event_thread = 0;
+			}
+		});
+		return true;
+	}()};
+	(void)fork_handler;
+
+	// like the shared table, the mapping is never unmapped, as threads
+	// may still be writing into it during static destruction
+	event_log.store(log, std::memory_order_release);
+	return true;
+#endif
+}
+
+void Dreadlock::log_event(uint8_t kind, const DreadlockSite* site, uint32_t other, int64_t time)
+{
+	auto log{event_log.load(std::memory_order_acquire)};
+	if (!log)
+		return;
+
+	DreadlockEvent event{};
+	event.time = time ? time : now_ns();
+	event.mutex = reinterpret_cast<uintptr_t>(mtx);
+	event.dreadlock_id = this_dreadlock;
+	event.other = other;
+	event.name = event_string(log, id, id, -1);
+	event.site = site ? event_string(log, site, module_name(site), site->line) : 0;
+	event.kind = kind;
+	event.shared = shared;
+	append_event(thread_state(), event);
+}
+
+void Dreadlock::append_event(ThreadState& state, DreadlockEvent& event)
+{
+	// only the state's current thread writes into its ring, so the
+	// event goes in with plain stores, and bumping the head publishes it
+
+	auto log{event_log.load(std::memory_order_acquire)};
+	if (!log)
+		return;
+
+	if (!state.event_ring)
+	{
+		auto used{log->rings_used.load(std::memory_order_relaxed)};
+		do
+		{
+			if (used >= log->ring_capacity)
+				return; // more threads than rings; the log covers the first of them
+		} while (!log->rings_used.compare_exchange_weak(used, used + 1, std::memory_order_relaxed));
+
+		state.event_ring = log->ring(used);
+		state.event_ring->in_use.store(1, std::memory_order_relaxed);
+	}
+
+	auto ring{state.event_ring};
+	auto events{log->events(ring)};
+	auto mask{log->event_capacity - 1};
+	auto head{ring->head.load(std::memory_order_relaxed)};
+
+	if (!event.time)
+		event.time = now_ns();
+	event.thread = state.thread_number;
+
+	// a pooled state's ring passes from thread to thread
+	if (state.event_thread != state.thread_number)
+	{
+		state.event_thread = state.thread_number;
+
+		DreadlockEvent started{};
+		started.time = event.time;
+		started.thread = state.thread_number;
+		started.kind = DreadlockEvent::ThreadStarted;
+		events[head++ & mask] = started;
 	}
 
-	tracking_lock.unlock();
+	events[head++ & mask] = event;
+	ring->head.store(head, std::memory_order_release);
 }
 
 #endif // ENABLE_DREADLOCK
\ No newline at end of file
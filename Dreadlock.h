@@ -31,11 +31,18 @@
 /// @date 10/03/2021
 
 #include <mutex>
+#include <shared_mutex>
 
 #ifdef ENABLE_DREADLOCK
 
-#include <string>
-#include <map>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
 
 #if defined(_WIN32) && defined(ENABLE_WIN32_CONSOLE)
 #define WIN32_LEAN_AND_MEAN
@@ -46,6 +53,11 @@
 
 using namespace std::chrono_literals;
 
+// the constants below are Dreadlock's defaults.  each can also be set
+// from the environment (DREADLOCK_ASSERT_ON_DEADLOCK, ...; see the
+// README), or at run time with Dreadlock::configure(), and the
+// timeouts can be overridden per mutex or per lock site.
+
 const bool AssertOnDeadlock = true;
 
 // this value will trigger a console message letting you know that
@@ -65,6 +77,354 @@ const int DeadlockTimeout = 5000;
 // you can do away with the full path
 const bool ShortModuleNames = true;
 
+// when enabled, a thread waiting on a held mutex blocks until the
+// holder's Dreadlock unlock signals it (or the next timeout report is
+// due) instead of sleep-polling the mutex every 500us.
+const bool BlockingWait = true;
+
+// before it waits as above (parks), a thread that finds the mutex held
+// first retries it this many times, with a CPU pause in between, and
+// then backs off, yielding and then sleeping for intervals that double
+// each time, for up to 'WaitBackoff' microseconds.  most critical
+// sections are much shorter than a park and wake-up, so most waiters
+// get the lock sooner.  zero skips either phase.
+const int WaitSpins = 100;
+const int WaitBackoff = 100;
+
+// mutexes that are also locked by uninstrumented code can be released
+// without Dreadlock signalling the waiters, so a blocking waiter will
+// still re-check the mutex at least this often (in milliseconds).
+const int WaitPollInterval = 10;
+
+// when enabled, Dreadlock records the order in which each thread
+// nests its locks into a global lock-order graph, and reports a
+// potential deadlock the first time a thread acquires two mutexes in
+// the reverse of an order already seen (A then B on one thread, B
+// then A on another), whether or not the threads actually collide.
+const bool DetectLockOrder = false;
+
+// when enabled, every acquisition is counted, and its wait and hold
+// times are recorded per mutex and per lock site, for reporting with
+// Dreadlock::dump_stats().  costs two clock reads per lock.
+const bool CollectStatistics = true;
+
+// when enabled, a single watchdog thread keeps the time for every
+// waiting thread, raising the performance and deadlock reports on
+// its behalf every 'WatchdogInterval' milliseconds, and the waiters
+// block until the mutex is released (or the watchdog gives up on
+// them).  the cost of detection then doesn't grow with the number of
+// waiting threads.
+const bool WatchWaits = false;
+const int WatchdogInterval = 50;
+
+// when enabled, the call stack of every tracked acquisition (and of
+// every wait) is captured, and a deadlock report prints the stacks of
+// the waiter and of the owner.  where locks are taken through shared
+// helper functions, the location of the lock alone says very little.
+// stacks are only symbolized when a report is printed.
+const bool CaptureStacks = false;
+
+// when non-zero, the background writer prints a contention report
+// (see Dreadlock::dump_contention()) every this many seconds, and
+// again at exit.  -1 prints it only at exit.
+const int ContentionReport = 0;
+
+// the number of distinct mutexes Dreadlock can track.  every mutex
+// address that is ever locked claims a slot in the ownership table
+// for the life of the process.  must be a power of two.
+#ifndef DREADLOCK_TRACKING_CAPACITY
+#define DREADLOCK_TRACKING_CAPACITY 16384
+#endif
+
+// the number of diagnostic events each thread can buffer before the
+// writer thread drains them.  verbose events that arrive while the
+// buffer is full are dropped (and counted); reports are never dropped.
+#ifndef DREADLOCK_LOG_CAPACITY
+#define DREADLOCK_LOG_CAPACITY 512
+#endif
+
+// the deepest lock nesting tracked per thread; locks acquired deeper
+// than this are still tracked for ownership, but not for lock order
+#ifndef DREADLOCK_MAX_HELD
+#define DREADLOCK_MAX_HELD 32
+#endif
+
+// twice the number of distinct lock-order edges (ordered mutex pairs)
+// that can be checked without taking the lock-order graph's mutex.
+// once it's half full, new edges are no longer added (and so lock
+// order is only checked against the edges already in it).  must be a
+// power of two.
+#ifndef DREADLOCK_LOCK_ORDER_CAPACITY
+#define DREADLOCK_LOCK_ORDER_CAPACITY 65536
+#endif
+
+// the number of concurrent shared owners of a mutex whose locations
+// are remembered for reports (all of them are counted)
+#ifndef DREADLOCK_MAX_READERS
+#define DREADLOCK_MAX_READERS 4
+#endif
+
+// the number of lock timeline events each thread can buffer while
+// tracing (see Dreadlock::set_trace()) before the writer thread drains
+// them; events that arrive while the buffer is full are dropped (and
+// counted).  must be a power of two.
+#ifndef DREADLOCK_TRACE_CAPACITY
+#define DREADLOCK_TRACE_CAPACITY 4096
+#endif
+
+// the number of distinct call stacks that can be remembered while
+// capturing stacks (see CaptureStacks), and the number of frames kept
+// of each.  identical stacks are stored once; a new stack that arrives
+// once the table is full isn't recorded.  the capacity must be a
+// power of two.
+#ifndef DREADLOCK_STACK_CAPACITY
+#define DREADLOCK_STACK_CAPACITY 4096
+#endif
+
+#ifndef DREADLOCK_STACK_DEPTH
+#define DREADLOCK_STACK_DEPTH 16
+#endif
+
+// the number of threads, and of distinct mutexes, that the shared
+// ownership table (see Dreadlock::set_shared_table()) has room for,
+// across all the processes using it, and the number of shared memory
+// regions each process can name (see Dreadlock::share_region())
+#ifndef DREADLOCK_SHARED_THREADS
+#define DREADLOCK_SHARED_THREADS 1024
+#endif
+#ifndef DREADLOCK_SHARED_MUTEXES
+#define DREADLOCK_SHARED_MUTEXES 16384
+#endif
+#ifndef DREADLOCK_SHARED_REGIONS
+#define DREADLOCK_SHARED_REGIONS 16
+#endif
+
+// the binary event log (see Dreadlock::set_event_log()): the number of
+// threads it has a ring for, the events each ring keeps (a power of
+// two), the bytes set aside for mutex names and sites, and the number
+// of distinct names and sites a process can put there
+#ifndef DREADLOCK_EVENT_LOG_THREADS
+#define DREADLOCK_EVENT_LOG_THREADS 128
+#endif
+#ifndef DREADLOCK_EVENT_LOG_CAPACITY
+#define DREADLOCK_EVENT_LOG_CAPACITY 4096
+#endif
+#ifndef DREADLOCK_EVENT_LOG_STRINGS
+#define DREADLOCK_EVENT_LOG_STRINGS (1 << 20)
+#endif
+#ifndef DREADLOCK_EVENT_LOG_STRING_CAPACITY
+#define DREADLOCK_EVENT_LOG_STRING_CAPACITY 8192
+#endif
+
+// the number of distinct locations the drop-in lock types of
+// DreadlockStd.h can lock from, and of mutexes they can name (powers
+// of two)
+#ifndef DREADLOCK_RUNTIME_SITES
+#define DREADLOCK_RUNTIME_SITES 8192
+#endif
+#ifndef DREADLOCK_RUNTIME_NAMES
+#define DREADLOCK_RUNTIME_NAMES 8192
+#endif
+
+/// @struct DreadlockSite
+/// @brief A source location captured at compile time
+///
+/// Each DREADLOCK* macro expansion owns one static, constexpr
+/// instance of this structure, so a site's address is unique and
+/// stable for the life of the process, and passing it around costs
+/// no more than a pointer.  'module' is the basename of 'file',
+/// computed by the compiler.
+
+struct DreadlockSite
+{
+	const char* file;
+	const char* module;
+	int line;
+};
+
+constexpr const char* dreadlock_module_name(const char* path)
+{
+	const char* module{path};
+	for (const char* p = path; *p; ++p)
+	{
+		if (*p == '/' || *p == '\\')
+			module = p + 1;
+	}
+	return module;
+}
+
+/// @struct DreadlockTraits
+/// @brief Properties of a lockable type that Dreadlock can't deduce
+///
+/// Dreadlock works with any type meeting the Lockable requirements
+/// (std::mutex, std::timed_mutex, std::recursive_mutex, ...), and
+/// detects SharedLockable types (std::shared_mutex, ...) by their
+/// try_lock_shared() member.  Whether a type may be re-locked by the
+/// thread that owns it can't be detected, so specialize this for your
+/// own recursive lockables.
+
+template <typename Mutex>
+struct DreadlockTraits
+{
+	static constexpr bool recursive{std::is_same<Mutex, std::recursive_mutex>::value || std::is_same<Mutex, std::recursive_timed_mutex>::value};
+};
+
+/// @struct DreadlockSharedHeader
+/// @brief The layout of the ownership table shared between processes
+///
+/// With Dreadlock::set_shared_table(), each process also records its
+/// locks, and its threads' waits, in a file that every process using
+/// it maps.  The file starts with this header, followed by the thread
+/// records and then the mutex records.  Records are fixed in size and
+/// hold no pointers, so they mean the same thing in every process, and
+/// in the dreadlock_table tool, which reads them without attaching to
+/// anything.  Times are steady clock nanoseconds, which are comparable
+/// across processes on the same machine.
+
+struct DreadlockSharedSite
+{
+	char module[44]; // truncated if need be, and always terminated
+	int32_t line;
+};
+
+struct DreadlockSharedThread;
+struct DreadlockSharedMutex;
+
+struct alignas(64) DreadlockSharedHeader
+{
+	static constexpr uint32_t CurrentVersion{1};
+
+	char magic[8]; // "DREADLK"
+	std::atomic<uint32_t> state; // 0 when new, 1 while the first process sets it up, 2 once ready
+	uint32_t version;
+	uint32_t thread_capacity;
+	uint32_t mutex_capacity;
+	uint32_t thread_size; // sizeof(DreadlockSharedThread), as a check on the layout
+	uint32_t mutex_size; // sizeof(DreadlockSharedMutex)
+
+	inline DreadlockSharedThread* threads();
+	inline DreadlockSharedMutex* mutexes();
+	inline static size_t size_for(uint32_t thread_capacity, uint32_t mutex_capacity);
+};
+
+struct DreadlockSharedThread
+{
+	std::atomic<uint32_t> sequence; // odd while the thread is changing the record
+	std::atomic<uint32_t> pid; // zero for a free record
+	std::atomic<uint32_t> thread; // numbered within its process, as in the lock timeline
+	std::atomic<uint32_t> waiting_on; // the index of the mutex record it's waiting for, plus one
+	std::atomic<int64_t> since; // when the wait began
+	DreadlockSharedSite site; // ...and where
+};
+
+struct DreadlockSharedMutex
+{
+	enum : uint32_t
+	{
+		Free,
+		Claiming,
+		InUse,
+		Retired, // a mutex of a process that has exited; the record can be claimed again
+	};
+
+	std::atomic<uint32_t> sequence; // odd while the owner is changing the record
+	std::atomic<uint32_t> claimed;
+	uint64_t region; // the id of a named region (see Dreadlock::share_region()), or the pid of the only process that can lock it
+	uint64_t offset; // the mutex's offset in its region (or its address)
+	std::atomic<uint32_t> owner; // the index of the exclusive owner's thread record, plus one
+	std::atomic<uint32_t> readers; // the number of shared owners
+	std::atomic<uint32_t> acquisitions; // by every process, so a waiter can tell a busy holder from a stuck one
+	std::atomic<int64_t> since; // when the owner locked it
+	char name[48];
+	DreadlockSharedSite site; // where the owner locked it
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free && std::atomic<int64_t>::is_always_lock_free, "the shared table needs lock-free atomics");
+
+DreadlockSharedThread* DreadlockSharedHeader::threads() { return reinterpret_cast<DreadlockSharedThread*>(this + 1); }
+
+DreadlockSharedMutex* DreadlockSharedHeader::mutexes() { return reinterpret_cast<DreadlockSharedMutex*>(threads() + thread_capacity); }
+
+size_t DreadlockSharedHeader::size_for(uint32_t thread_capacity, uint32_t mutex_capacity)
+{
+	return sizeof(DreadlockSharedHeader) + thread_capacity * sizeof(DreadlockSharedThread) + mutex_capacity * sizeof(DreadlockSharedMutex);
+}
+
+/// @struct DreadlockEventLogHeader
+/// @brief The layout of the binary event log
+///
+/// With Dreadlock::set_event_log(), each thread also keeps its last
+/// DREADLOCK_EVENT_LOG_CAPACITY lock events in a ring of its own, in a
+/// file mapped into memory, so the history leading up to a crash (or
+/// an assert on a deadlock) is still there afterwards, in the file or
+/// in a core dump.  The file is this header, then the string area
+/// (the mutex names and sites that events refer to by offset), then
+/// the rings, each a DreadlockEventRing followed by its events.  Only
+/// fixed-size, pointer-free records are written, with plain stores;
+/// dreadlock_events reads them back.
+
+struct DreadlockEvent
+{
+	enum : uint8_t
+	{
+		Waiting = 1, // started waiting for the mutex
+		Acquired,
+		Released,
+		Deadlocked, // gave up waiting, with the mutex declared deadlocked
+		ThreadStarted, // a thread took over the ring
+		ThreadExited,
+	};
+
+	int64_t time; // the clock's nanoseconds (see DreadlockEventLogHeader::clock_start)
+	uint64_t mutex; // the mutex's address
+	uint32_t thread; // numbered as in the lock timeline
+	uint32_t dreadlock_id; // the instance
+	uint32_t other; // for Waiting, the owner's instance, if it's known
+	uint32_t name; // the mutex's name, as an offset in the string area plus one (zero if unknown)
+	uint32_t site; // ...and the site, as "file:line" (for Released, the site that locked it)
+	uint8_t kind;
+	uint8_t shared;
+	uint16_t reserved;
+};
+
+struct alignas(64) DreadlockEventRing
+{
+	std::atomic<uint32_t> in_use;
+	std::atomic<uint64_t> head; // the number of events ever written; the last of them (up to the capacity) are in the ring
+};
+
+struct alignas(64) DreadlockEventLogHeader
+{
+	static constexpr uint32_t CurrentVersion{1};
+
+	char magic[8]; // "DREADEV", written last
+	uint32_t version;
+	uint32_t pid;
+	uint32_t ring_capacity;
+	uint32_t event_capacity; // events per ring
+	uint32_t event_size; // sizeof(DreadlockEvent)
+	uint32_t string_capacity; // bytes, a multiple of 64
+	int64_t clock_start; // the clock when the log was created...
+	int64_t system_start; // ...and the system clock at the same moment, in nanoseconds since 1970
+	std::atomic<uint32_t> rings_used;
+	std::atomic<uint32_t> strings_used;
+
+	char* strings() { return reinterpret_cast<char*>(this + 1); }
+	DreadlockEventRing* ring(uint32_t index)
+	{
+		return reinterpret_cast<DreadlockEventRing*>(strings() + string_capacity + static_cast<size_t>(index) * ring_size(event_capacity));
+	}
+	DreadlockEvent* events(DreadlockEventRing* ring) { return reinterpret_cast<DreadlockEvent*>(ring + 1); }
+
+	static size_t ring_size(uint32_t event_capacity) { return sizeof(DreadlockEventRing) + event_capacity * sizeof(DreadlockEvent); }
+	static size_t size_for(uint32_t string_capacity, uint32_t ring_capacity, uint32_t event_capacity)
+	{
+		return sizeof(DreadlockEventLogHeader) + string_capacity + ring_capacity * ring_size(event_capacity);
+	}
+};
+
+static_assert(sizeof(DreadlockEvent) == 40 && sizeof(DreadlockEventRing) == 64 && sizeof(DreadlockEventLogHeader) == 64, "dreadlock_events reads this layout");
+
 /// @class Dreadlock
 /// @brief Detection of mutex deadlocks
 ///
@@ -81,8 +441,14 @@ const bool ShortModuleNames = true;
 /// locks, and report when an attempt is made to unlock an mutex
 /// whose lock does not belong to the instance making the attempt.
 ///
+/// Dreadlock is not itself a template: its constructor captures
+/// the lockable type, and the operations for that type are reached
+/// through a static table, so all the tracking logic lives (and is
+/// compiled) once, in Dreadlock.cpp.  Instances created with the
+/// 'Shared' tag take the lock in shared mode.
+///
 /// When disabled, Dreadlock is replaced by std::unique_lock<>
-/// semantics in the code.
+/// (or std::shared_lock<>) semantics in the code.
 
 class Dreadlock
 {
@@ -90,55 +456,516 @@ private: // aliases and enums
 	struct LockInfo
 	{
 		uint32_t dreadlock_id{0};
-		std::string lock_file;
-		int lock_line{0};
+		const DreadlockSite* site{nullptr};
+		uint32_t stack{0}; // see CaptureStacks (zero if none)
 
 		LockInfo() {}
-		LockInfo(uint32_t did, const std::string& f, int l) : dreadlock_id(did), lock_file(f), lock_line(l) {}
+		LockInfo(uint32_t did, const DreadlockSite* s, uint32_t st = 0) : dreadlock_id(did), site(s), stack(st) {}
+	};
+
+	// an entry in the ownership table.  a slot is claimed by the key of
+	// the first mutex that hashes to it, and is never given back, so
+	// lookups are a lock-free linear probe.  'owner' is the dreadlock_id
+	// of the instance currently holding the mutex exclusively (zero when
+	// unowned), and 'owner_site' (and 'owner_stack') where it was
+	// locked.  only the thread holding the mutex ever changes them, so
+	// an uncontended lock and unlock take no lock of their own.
+	// 'info_mutex' is per-slot, and is only taken for shared owners,
+	// and by threads that are blocked waiting for the mutex ('waiters'
+	// of them) on 'released'.
+	//
+	// shared owners are counted in 'readers', and the first few of them
+	// are remembered in 'reader_info'.  'acquisitions' counts every
+	// tracked acquisition in either mode, so a waiter can tell a mutex
+	// that is busy (starvation) from one that isn't moving at all
+	// (deadlock).  'contentions' picks out the hot mutexes for sampling.
+	struct TrackingSlot
+	{
+		std::atomic<size_t> key{0};
+		std::atomic<uint32_t> owner{0};
+		std::atomic<const DreadlockSite*> owner_site{nullptr};
+		std::atomic<uint32_t> owner_stack{0};
+		std::atomic<uint32_t> waiters{0};
+		std::atomic<uint32_t> peak_waiters{0};
+		std::atomic<uint32_t> readers{0};
+		std::atomic<uint32_t> acquisitions{0};
+		std::atomic<uint32_t> contentions{0}; // acquisitions that had to wait
+		std::atomic<uint32_t> handoffs{0}; // releases to a waiter, numbering the trace's flow arrows
+		std::atomic<uint32_t> shared_record{0}; // the index of its record in the shared table, plus one
+		std::atomic<int> performance_timeout{-1}; // per-mutex overrides (-1 when not set)
+		std::atomic<int> deadlock_timeout{-1};
+
+		std::mutex info_mutex;
+		std::condition_variable released;
+		LockInfo reader_info[DREADLOCK_MAX_READERS];
+	};
+
+	// the operations Dreadlock needs from a lockable type, bound once
+	// per type by the constructor
+	struct LockableOps
+	{
+		void (*lock)(void*);
+		bool (*try_lock)(void*);
+		void (*unlock)(void*);
+		void (*lock_shared)(void*);
+		bool (*try_lock_shared)(void*);
+		void (*unlock_shared)(void*);
+		bool recursive;
+		bool shared_lockable;
+	};
+
+	template <typename Mutex, typename = void>
+	struct is_shared_lockable : std::false_type
+	{
+	};
+
+	template <typename Mutex>
+	struct is_shared_lockable<Mutex, std::void_t<decltype(std::declval<Mutex&>().try_lock_shared())>> : std::true_type
+	{
+	};
+
+	// the shared operations are only ever called for SharedLockable
+	// types (the 'Shared' constructor checks), but must exist for all
+	template <typename Mutex>
+	static const LockableOps* lockable_ops()
+	{
+		constexpr bool shared_lockable{is_shared_lockable<Mutex>::value};
+
+		static const LockableOps ops{
+			[](void* m) { static_cast<Mutex*>(m)->lock(); },
+			[](void* m) -> bool { return static_cast<Mutex*>(m)->try_lock(); },
+			[](void* m) { static_cast<Mutex*>(m)->unlock(); },
+			[]([[maybe_unused]] void* m) {
+				if constexpr (shared_lockable)
+					static_cast<Mutex*>(m)->lock_shared();
+			},
+			[]([[maybe_unused]] void* m) -> bool {
+				if constexpr (shared_lockable)
+					return static_cast<Mutex*>(m)->try_lock_shared();
+				return false;
+			},
+			[]([[maybe_unused]] void* m) {
+				if constexpr (shared_lockable)
+					static_cast<Mutex*>(m)->unlock_shared();
+			},
+			DreadlockTraits<Mutex>::recursive,
+			shared_lockable,
+		};
+		return &ops;
+	}
+
+	enum class LogKind : uint8_t
+	{
+		Locking,
+		Attempting,
+		Unlocking,
+		TableFull,
+		IllegalLock,
+		PerformanceWait,
+		Deadlock,
+		UnlockUnowned,
+		IllegalUnlock,
+		ForeignUnlock,
+		LockOrder,
+		LockOrderEdge,
+		Starvation,
+		SharedUpgrade,
+		SharedWhileExclusive,
+		SharedRelock,
+		OverBudget,
+		LevelInversion,
+		LockOrderFull,
+	};
+
+	// a diagnostic, recorded by the thread that raised it into its own
+	// ring buffer, and formatted later by the writer thread.  every
+	// pointer refers to static data (mutex names and sites), so the
+	// record is safe to format long after the instance is gone.
+	struct LogEvent
+	{
+		int64_t timestamp{0};
+		LogKind kind{LogKind::Locking};
+		const char* id{nullptr};
+		const DreadlockSite* site{nullptr};
+		const DreadlockSite* owner_site{nullptr}; // null if the owner isn't known
+		const char* owner_name{nullptr};
+		uint32_t dreadlock_id{0};
+		uint32_t owner_id{0};
+		uint32_t readers{0}; // non-zero if the owner is one of this many shared owners
+		uint32_t count{0};
+		int value{0};
+		uint32_t stack{0}; // captured call stacks (see CaptureStacks)
+		uint32_t owner_stack{0};
+		int64_t duration{0}; // nanoseconds, for the reports that time something...
+		int64_t limit{0}; // ...against a limit
 	};
 
-	using tracking_map_t = std::map<size_t, LockInfo>;
+	struct LockStats;
+	struct StatsBlock;
+
+	// an entry in a thread's stack of currently held locks
+	struct HeldLock
+	{
+		TrackingSlot* slot{nullptr};
+		const char* id{nullptr};
+		const DreadlockSite* site{nullptr};
+		uint32_t dreadlock_id{0};
+		int64_t acquired_at{0};
+		LockStats* stats{nullptr};
+		uint32_t stack{0};
+		bool shared{false};
+		int level{0};
+	};
+
+	// per-thread state, pooled and never freed (see Dreadlock.cpp)
+	struct ThreadState;
+	struct TraceEvent;
+	struct WaitRecord;
+	struct LogWriter;
+	struct Watchdog;
+	struct LockOrderGraph;
 
 #if defined(_WIN32) && defined(ENABLE_WIN32_CONSOLE)
-	int output_win32_console(const char* format, ...);
+	static int output_win32_console(const char* format, ...);
 #endif
 
 private: // data members
-	static uint32_t next_id;
+	static std::atomic<uint32_t> next_id; // the next block of instance ids (see allocate_id())
+
+	static TrackingSlot tracking[DREADLOCK_TRACKING_CAPACITY];
+
+	static std::atomic<uint64_t> lock_order_edges[DREADLOCK_LOCK_ORDER_CAPACITY]; // edges already in the graph
+	static std::atomic<bool> lock_order_full; // no new edges are added once it's set
+	static std::mutex lock_order_mutex;
 
-	static std::mutex tracking_mutex;
-	static tracking_map_t tracking;
+	static std::atomic<ThreadState*> thread_states;
+	static std::atomic<unsigned> outputs;
 
-	static std::mutex printing_mutex;
+	static std::mutex printing_mutex; // serializes draining the event rings into the outputs
 
-	uint32_t this_dreadlock{0}; // unique key for this Dreadlock instance in the tracking database
+	static std::atomic<uint32_t> sample_one_in; // see set_sampling()
+	static std::atomic<uint32_t> sample_hot_threshold;
+	static std::atomic<uint32_t> perturb_us; // see set_perturbation()
+	static std::atomic<uint32_t> perturb_seed;
 
-	std::string id;
-	std::mutex& mtx;
-	size_t mtx_key{0};
+	uint32_t this_dreadlock{0}; // unique key for this Dreadlock instance in the tracking database; assigned on first lock
 
-	std::string destruct_file;
-	int destruct_line{0};
+	const char* id;
+	void* mtx;
+	const LockableOps* ops;
+	int64_t budget{0}; // the nanoseconds a hold may last before it's reported (see DREADLOCK_BUDGET), or zero
+	int level{0}; // the mutex's place in the lock hierarchy (see DREADLOCK_LEVEL), or zero
+	TrackingSlot* slot{nullptr}; // resolved on first lock
+	bool shared{false};
+	bool owns{false};
+	bool untracked{false}; // the ownership table was full when this mutex was first locked
+	bool sampled_out{false}; // the current acquisition was left out of the sample, and isn't tracked
+
+	const DreadlockSite* destruct_site{nullptr};
 
 private: // methods
-	std::string get_module_name(const std::string& path);
+	static const char* module_name(const DreadlockSite* site);
+
+	static TrackingSlot* find_slot(size_t key);
+	static void set_mutex_timeouts(void* mtx, int performance_ms, int deadlock_ms);
+	void timeouts_for(const DreadlockSite& site, int& performance_ms, int& deadlock_ms);
+	static uint32_t allocate_id();
+
+	static ThreadState& thread_state();
+	static LogWriter& log_writer();
+	static int format_event(const LogEvent& event, char* buffer, size_t size);
+	static void drain_log();
+	static void post(const LogEvent& event);
+	static void write_output(const char* text, unsigned outputs);
+	static void write_stack(const char* heading, uint32_t stack, unsigned outputs);
+	static void record(TraceEvent& event);
+	static void drain_trace();
+	static Watchdog& watchdog();
+	static void watch_waits();
+
+	static bool lock_order_known(uint64_t edge);
+	static void add_lock_order(const HeldLock& from, const HeldLock& to, uint64_t edge);
+	static void lock_order_filled(const HeldLock& to);
+
+	void log(LogKind kind, const DreadlockSite* site, const LockInfo* owner = nullptr, int value = 0, uint32_t readers = 0, uint32_t count = 0, uint32_t stack = 0);
+	void check_lock_order(const DreadlockSite* site);
+	void report_level_inversion(const DreadlockSite* site);
+
+	// when a contended acquisition stopped spinning, and stopped backing
+	// off (zero if it got the lock before then)
+	struct WaitPhases
+	{
+		int64_t spun{0};
+		int64_t backed_off{0};
+	};
+
+	void acquired(const DreadlockSite* site, int64_t wait_start = 0, const LockInfo* waited_on = nullptr, uint32_t readers = 0, const WaitPhases* phases = nullptr);
+	bool spin_then_back_off(WaitPhases& phases);
+
+	// mirroring into the shared ownership table, when there is one
+	static uint32_t shared_thread(ThreadState& state);
+	uint32_t shared_record();
+	uint32_t progress();
+	void shared_acquired(const DreadlockSite* site);
+	void shared_released();
+	void shared_waiting(ThreadState& state, const DreadlockSite* site, int64_t since);
+	static void report_shared_chain(uint32_t thread_record, uint32_t mutex_record);
+
+	// recording into the binary event log, when there is one
+	void log_event(uint8_t kind, const DreadlockSite* site, uint32_t other = 0, int64_t time = 0); // 'time' if the caller has just read the clock
+	static void append_event(ThreadState& state, DreadlockEvent& event);
+
+	bool released(const DreadlockSite* site);
+	LockStats* stats_for(ThreadState& state, const DreadlockSite* site);
+	bool current_owner(LockInfo& info, uint32_t& readers);
+	bool check_wait(WaitRecord& wait, int64_t now);
+	const HeldLock* held_by_this_thread(bool this_instance);
+	bool skip_sample();
+	bool resolve_slot(const DreadlockSite& site);
+	static void perturb();
+
+	bool try_acquire() { return shared ? ops->try_lock_shared(mtx) : ops->try_lock(mtx); }
+	void release() { shared ? ops->unlock_shared(mtx) : ops->unlock(mtx); }
+	void release_to_waiters();
+	void disown();
+
+	// the parts of a condition variable wait that don't depend on its
+	// type: 'release' is false when the condition variable releases
+	// and re-acquires the (std::)mutex itself, and only the tracking
+	// is handed back and taken up again
+	int64_t cv_block(const DreadlockSite& site, bool release);
+	int64_t cv_wake(const DreadlockSite& site, bool acquire);
+	void cv_woken(const DreadlockSite& site, int64_t blocked_at, int64_t woken_at, bool notified, bool satisfied);
+
+	// lets std::condition_variable_any release and re-acquire the
+	// mutex through this instance, as a tracked unlock() and lock()
+	struct Relock
+	{
+		Dreadlock& dreadlock;
+		const DreadlockSite& site;
+		int64_t blocked_at{0};
+		int64_t woken_at{0};
+
+		void lock() { woken_at = dreadlock.cv_wake(site, true); }
+		void unlock() { blocked_at = dreadlock.cv_block(site, true); }
+	};
+
+	// the mutex, lent to a std::condition_variable.  if the wait throws,
+	// the condition variable has locked it again, so it's tracked again
+	// rather than unlocked behind Dreadlock's back.
+	struct Adopted
+	{
+		Dreadlock& dreadlock;
+		const DreadlockSite& site;
+		std::unique_lock<std::mutex> lock;
+
+		~Adopted()
+		{
+			if (lock.release())
+				dreadlock.cv_wake(site, false);
+		}
+	};
+
+	// 'block' waits on the condition variable once, returning false if
+	// it timed out
+	template <typename CV, typename Predicate, typename Block>
+	bool cv_wait(CV& cv, Predicate& pred, const DreadlockSite& site, Block block)
+	{
+		if (pred())
+			return true;
+
+		for (;;)
+		{
+			bool notified;
+			int64_t blocked_at, woken_at;
+
+			if constexpr (std::is_same<CV, std::condition_variable>::value)
+			{
+				// only an exclusive instance over a std::mutex can hand
+				// its mutex to a std::condition_variable (production
+				// builds won't compile anything else)
+				assert(ops == lockable_ops<std::mutex>() && !shared);
+
+				blocked_at = cv_block(site, false);
+				Adopted adopted{*this, site, std::unique_lock<std::mutex>(*static_cast<std::mutex*>(mtx), std::adopt_lock)};
+				notified = block(cv, adopted.lock);
+				adopted.lock.release();
+				woken_at = cv_wake(site, false);
+			}
+			else
+			{
+				Relock lock{*this, site};
+				notified = block(cv, lock);
+				blocked_at = lock.blocked_at;
+				woken_at = lock.woken_at;
+			}
+
+			bool satisfied{pred()};
+			cv_woken(site, blocked_at, woken_at, notified, satisfied);
+
+			if (satisfied)
+				return true;
+			if (!notified)
+				return false;
+		}
+	}
+
+	void destruct_unlock();
 
 public:
-	Dreadlock(std::mutex& mtx, const std::string& name, const std::string& file, int line, bool defer = false);
-	~Dreadlock();
+	enum Output : unsigned
+	{
+		OutputConsole = 1,	// std::cout
+		OutputDebugger = 2, // OutputDebugStringA() (Win32 only)
+		OutputFile = 4,		// see set_output()
+	};
+
+	// Dreadlock's run-time settings (see configure()).  each member
+	// defaults to the constant of the same name at the top of this
+	// file, as modified by the environment.
+	struct Settings
+	{
+		bool assert_on_deadlock{AssertOnDeadlock};
+		int performance_timeout{PerformanceTimeout};
+		int deadlock_timeout{DeadlockTimeout};
+		bool short_module_names{ShortModuleNames};
+		bool blocking_wait{BlockingWait};
+		int wait_spins{WaitSpins};
+		int wait_backoff{WaitBackoff};
+		int wait_poll_interval{WaitPollInterval};
+		bool detect_lock_order{DetectLockOrder};
+		bool collect_statistics{CollectStatistics};
+		bool watch_waits{WatchWaits};
+		int watchdog_interval{WatchdogInterval};
+		bool capture_stacks{CaptureStacks};
+		int contention_report{ContentionReport};
+	};
+
+	// a lock that some thread holds, or is waiting for, as seen by
+	// snapshot()
+	struct SnapshotEntry
+	{
+		uint32_t thread{0}; // numbered as in the lock timeline (see set_trace())
+		bool waiting{false}; // waiting for the lock, rather than holding it
+		bool shared{false}; // shared ownership
+		const char* id{nullptr}; // the mutex's name
+		const void* mutex{nullptr}; // ...and address
+		const DreadlockSite* site{nullptr}; // where it was locked, or is being waited for
+		uint32_t dreadlock_id{0}; // the instance holding or waiting
+		int64_t duration{-1}; // nanoseconds held or waited so far, or -1 if the lock wasn't timed
+		uint32_t owner{0}; // for a wait: the dreadlock_id of the exclusive owner, if there is one
+		const DreadlockSite* owner_site{nullptr};
+		uint32_t readers{0}; // for a wait: the number of shared owners
+	};
+
+	// tag selecting shared ownership (see DREADLOCK_SHARED)
+	struct Shared
+	{
+	};
+
+	// the longest each hold should last (see DREADLOCK_BUDGET)
+	struct Budget
+	{
+		template <typename Rep, typename Period>
+		Budget(std::chrono::duration<Rep, Period> limit) : ns(std::chrono::duration_cast<std::chrono::nanoseconds>(limit).count())
+		{
+		}
+
+		int64_t ns;
+	};
+
+	// a mutex's place in a lock hierarchy (see DREADLOCK_LEVEL)
+	struct Level
+	{
+		int value;
+	};
+
+	template <typename Mutex>
+	Dreadlock(Mutex& mtx, const char* name, const DreadlockSite& site, bool defer = false) : id(name), mtx(&mtx), ops(lockable_ops<Mutex>())
+	{
+		if (!defer)
+			lock(site);
+	}
+
+	template <typename Mutex>
+	Dreadlock(Mutex& mtx, const char* name, const DreadlockSite& site, bool defer, Shared)
+		: id(name), mtx(&mtx), ops(lockable_ops<Mutex>()), shared(true)
+	{
+		static_assert(is_shared_lockable<Mutex>::value, "shared Dreadlock instances need a SharedLockable mutex");
+		if (!defer)
+			lock(site);
+	}
+
+	// a hold that outlasts 'limit' is reported when it's released
+	template <typename Mutex>
+	Dreadlock(Mutex& mtx, const char* name, const DreadlockSite& site, Budget limit, bool defer = false)
+		: id(name), mtx(&mtx), ops(lockable_ops<Mutex>()), budget(limit.ns)
+	{
+		if (!defer)
+			lock(site);
+	}
+
+	template <typename Mutex>
+	Dreadlock(Mutex& mtx, const char* name, const DreadlockSite& site, Budget limit, bool defer, Shared)
+		: id(name), mtx(&mtx), ops(lockable_ops<Mutex>()), budget(limit.ns), shared(true)
+	{
+		static_assert(is_shared_lockable<Mutex>::value, "shared Dreadlock instances need a SharedLockable mutex");
+		if (!defer)
+			lock(site);
+	}
+
+	// a mutex may only be locked by a thread holding nothing at its
+	// level or above
+	template <typename Mutex>
+	Dreadlock(Mutex& mtx, const char* name, const DreadlockSite& site, Level level, bool defer = false)
+		: id(name), mtx(&mtx), ops(lockable_ops<Mutex>()), level(level.value)
+	{
+		if (!defer)
+			lock(site);
+	}
+
+	template <typename Mutex>
+	Dreadlock(Mutex& mtx, const char* name, const DreadlockSite& site, Level level, bool defer, Shared)
+		: id(name), mtx(&mtx), ops(lockable_ops<Mutex>()), level(level.value), shared(true)
+	{
+		static_assert(is_shared_lockable<Mutex>::value, "shared Dreadlock instances need a SharedLockable mutex");
+		if (!defer)
+			lock(site);
+	}
+
+	// an instance that doesn't hold its mutex is destroyed without
+	// touching any shared state
+	~Dreadlock()
+	{
+		if (owns)
+			destruct_unlock();
+	}
+
+	// takes over the other instance's mutex, and its ownership, leaving
+	// it holding nothing, as std::unique_lock's move does
+	Dreadlock(Dreadlock&& other) noexcept
+		: this_dreadlock(other.this_dreadlock), id(other.id), mtx(other.mtx), ops(other.ops), budget(other.budget), level(other.level), slot(other.slot),
+		  shared(other.shared), owns(other.owns), untracked(other.untracked), sampled_out(other.sampled_out), destruct_site(other.destruct_site)
+	{
+		other.this_dreadlock = 0;
+		other.owns = false;
+	}
+
+	Dreadlock(const Dreadlock&) = delete;
+	Dreadlock& operator=(const Dreadlock&) = delete;
 
 	/*!
 	Locks the referenced mutex, tracking the location where ownership
 	was acquired.
 
 	If the mutex is already locked, Dreadlock will wait for
-	acquisition of the lock.  If the wait exceeds 'DeadlockTimeout'
-	then the mutex is considered deadlocked.
+	acquisition of the lock.  If the wait exceeds the deadlock timeout
+	(see configure() and set_timeouts()) then the mutex is considered
+	deadlocked.
 
-	\param file String value of the full path to the module attempting the lock (usually "__FILE__")
-	\param line Line number within the module attempting the lock (usually "__LINE__")
+	\param site Location of the lock attempt (usually "DREADLOCK_SITE")
 	*/
-	void lock(const std::string& file, int line);
+	void lock(const DreadlockSite& site);
 
 	/*!
 	Unlocks the referenced mutex, tracking the location where the
@@ -147,10 +974,39 @@ public:
 	If the mutex isn't locked by this instance, a message is printed
 	and an assert is triggered.
 
-	\param file String value of the full path to the module attempting the unlock (usually "__FILE__")
-	\param line Line number within the module attempting the unlock (usually "__LINE__")
+	\param site Location of the unlock (usually "DREADLOCK_SITE")
+	*/
+	void unlock(const DreadlockSite& site);
+
+	/*!
+	Tries to lock the referenced mutex without waiting, as its
+	try_lock() does, and tracks it if it succeeds.  A try can't wait,
+	so it can't deadlock: the lock order and the lock hierarchy aren't
+	checked (std::lock() takes mutexes out of order with try_lock()).
+
+	\param site Location of the lock attempt (usually "DREADLOCK_SITE")
+	\returns true if the mutex was locked
+	*/
+	bool try_lock(const DreadlockSite& site);
+
+	/*!
+	Tracks a mutex that the caller has already locked (in this
+	instance's mode), as if this instance had locked it, like
+	std::adopt_lock does.
+
+	\param site Location where the lock is taken over (usually "DREADLOCK_SITE")
+	*/
+	void adopt(const DreadlockSite& site);
+
+	/*!
+	Stops tracking the lock this instance holds, without unlocking the
+	mutex, like std::unique_lock::release().  Whoever takes the mutex
+	over has to unlock it.  Dreadlock's waiters on the mutex aren't
+	signalled when it's released (see 'WaitPollInterval').
+
+	\param site Location where the lock is given up (usually "DREADLOCK_SITE")
 	*/
-	void unlock(const std::string& file = std::string(), int line = -1);
+	void forget(const DreadlockSite& site);
 
 	/*!
 	This is a tracking function.  It takes the file/line where the
@@ -158,56 +1014,586 @@ public:
 	the destructor.  The information provided may be used in printing
 	diagnostic messages.  It's use is optional, but can be helpful.
 
-	\param file String value of the full path to the module where the instance is going out of scope (usually "__FILE__")
-	\param line Line number within the module where the instance is going out of scope (usually "__LINE__")
+	\param site Location where the instance is going out of scope (usually "DREADLOCK_SITE")
+	*/
+	void destruct(const DreadlockSite& site) { destruct_site = &site; }
+
+	// whether this instance holds its mutex
+	bool owns_lock() const { return owns; }
+
+	/*!
+	Waits on a condition variable until 'pred' is satisfied, like
+	cv.wait(lock, pred) with a std::unique_lock.  While the condition
+	variable has released the mutex, so has Dreadlock's tracking, so
+	the ownership table stays truthful.  The time spent blocked on the
+	condition variable, and the wakeups that found 'pred' still
+	unsatisfied (spurious or stolen), are recorded apart from the time
+	spent re-acquiring the mutex (see dump_stats()).
+
+	With std::condition_variable_any (or any condition variable that
+	waits on a Lockable), the mutex is released and re-acquired by a
+	tracked unlock() and lock().  std::condition_variable re-acquires
+	its std::mutex itself, so that time counts as blocked, and other
+	Dreadlock waiters on the mutex aren't signalled when it's released
+	(see 'WaitPollInterval').
+
+	\param cv The condition variable
+	\param pred The condition to wait for, evaluated with the mutex held
+	\param site Location of the wait (usually "DREADLOCK_SITE")
+	*/
+	template <typename CV, typename Predicate>
+	void wait(CV& cv, Predicate pred, const DreadlockSite& site)
+	{
+		cv_wait(cv, pred, site, [](CV& c, auto& lock) {
+			c.wait(lock);
+			return true;
+		});
+	}
+
+	/*!
+	Waits on a condition variable like wait(), but gives up at
+	'deadline', like cv.wait_until(lock, deadline, pred).
+
+	\returns The final value of 'pred'
+	*/
+	template <typename CV, typename Clock, typename Duration, typename Predicate>
+	bool wait_until(CV& cv, const std::chrono::time_point<Clock, Duration>& deadline, Predicate pred, const DreadlockSite& site)
+	{
+		return cv_wait(cv, pred, site, [&deadline](CV& c, auto& lock) { return c.wait_until(lock, deadline) == std::cv_status::no_timeout; });
+	}
+
+	/*!
+	Waits on a condition variable like wait(), but gives up after
+	'timeout', like cv.wait_for(lock, timeout, pred).
+
+	\returns The final value of 'pred'
+	*/
+	template <typename CV, typename Rep, typename Period, typename Predicate>
+	bool wait_for(CV& cv, const std::chrono::duration<Rep, Period>& timeout, Predicate pred, const DreadlockSite& site)
+	{
+		return wait_until(cv, std::chrono::steady_clock::now() + timeout, std::move(pred), site);
+	}
+
+	/*!
+	Selects where diagnostic messages are written.  Messages are
+	recorded into a per-thread buffer by the thread that raises them,
+	and are formatted and written by a background thread, so
+	instrumented threads never block on output.
+
+	The default is 'OutputConsole', plus 'OutputDebugger' when
+	ENABLE_WIN32_CONSOLE is defined.
+
+	\param outputs A combination of 'Output' flags
+	\param path The file to append messages to when 'OutputFile' is included
+	*/
+	static void set_output(unsigned outputs, const char* path = nullptr);
+
+	/*!
+	Replaces Dreadlock's settings for every mutex, taking effect with
+	the next lock.  Start from settings() to change just a few:
+
+	auto settings{Dreadlock::settings()};
+	settings.deadlock_timeout = 500;
+	Dreadlock::configure(settings);
+
+	\param settings The new settings
+	*/
+	static void configure(const Settings& settings);
+
+	/*!
+	Returns Dreadlock's current settings.
+	*/
+	static Settings settings();
+
+	/*!
+	Overrides the performance and deadlock timeouts for one mutex,
+	wherever it is locked.  A site override (below) takes precedence.
+
+	\param mtx The mutex
+	\param performance_ms The performance timeout in milliseconds (zero disables it), or -1 to use the global setting
+	\param deadlock_ms The deadlock timeout in milliseconds, or -1 to use the global setting
+	*/
+	template <typename Mutex>
+	static void set_timeouts(Mutex& mtx, int performance_ms, int deadlock_ms)
+	{
+		set_mutex_timeouts(&mtx, performance_ms, deadlock_ms);
+	}
+
+	/*!
+	Overrides the performance and deadlock timeouts for the locks
+	taken at one source location.  These are only looked up once a lock
+	has to wait.
+
+	\param module The module name (or full path) of the lock site
+	\param line The line of the lock site, or zero for every lock in the module
+	\param performance_ms The performance timeout in milliseconds (zero disables it), or -1 to use the mutex's setting
+	\param deadlock_ms The deadlock timeout in milliseconds, or -1 to use the mutex's setting
+	*/
+	static void set_site_timeouts(const char* module, int line, int performance_ms, int deadlock_ms);
+
+	/*!
+	Limits full tracking to a sample of acquisitions, so instrumented
+	code can be left running in production.  An acquisition left out
+	of the sample just tries the mutex, and if it doesn't have to wait,
+	it isn't tracked at all (its ownership, lock order and statistics
+	go unrecorded).  Acquisitions that do have to wait, and any
+	acquisition of a mutex that has been contended at least
+	'hot_threshold' times, are always tracked, so deadlocks are still
+	reported.  May be changed at any time.
+
+	\param one_in Fully track one in this many acquisitions, per thread (1, the default, tracks all of them; 0 tracks only the contended ones)
+	\param hot_threshold If non-zero, fully track every acquisition of a mutex that has had to be waited for this many times
+	*/
+	static void set_sampling(uint32_t one_in, uint32_t hot_threshold = 0);
+
+	/*!
+	Shakes up the scheduling around every lock() and unlock(), to
+	bring out orderings a test would otherwise rarely see.  Each call
+	is randomly let through, yielded, or delayed by up to 'max_us'
+	microseconds.  With a non-zero 'seed', each thread (numbered in the
+	order it's first delayed) draws the same delays from run to run.
+	May be changed at any time.
+
+	\param max_us The longest delay, or 0 (the default) to turn it off
+	\param seed Seeds each thread's delays, or 0 for different ones every run
+	*/
+	static void set_perturbation(uint32_t max_us, uint32_t seed = 0);
+
+	/*!
+	Starts recording a timeline of every tracked lock to a file in
+	Chrome's Trace Event format, which chrome://tracing and the
+	Perfetto UI (ui.perfetto.dev) can open.  Each thread's holds and
+	waits appear as slices on its own track, with the holder's details
+	attached to each wait, and an arrow from each release to the waiter
+	it let in.  Events are buffered per thread and written in batches
+	by the background writer.  Any previous trace file is completed and
+	closed first.
+
+	\param path The file to write, or nullptr to stop tracing
+	\returns false if the file couldn't be created
+	*/
+	static bool set_trace(const char* path);
+
+	/*!
+	Writes out every diagnostic message buffered so far, from all
+	threads, before returning.  Dreadlock does this itself before it
+	asserts.
+	*/
+	static void flush();
+
+	/*!
+	Returns the number of locks the calling thread currently holds
+	through Dreadlock instances.  Acquisitions left out of the sample
+	(see set_sampling()) aren't counted.
+	*/
+	static unsigned lock_depth();
+
+	/*!
+	Prints lock statistics gathered so far (see 'CollectStatistics')
+	for the most contended mutexes: acquisition and contention counts,
+	wait and hold time percentiles, and the longest hold, each broken
+	down by the sites the mutex was locked from.  Counters are kept per
+	thread and merged here, so calling this doesn't disturb the locks
+	being measured.
+
+	\param top The number of mutexes to print, most contended first
+	\param csv_path If provided, every mutex and site is also exported to this file as CSV
+	*/
+	static void dump_stats(size_t top = 10, const char* csv_path = nullptr);
+
+	/*!
+	Prints the mutexes that limit throughput, from the statistics
+	gathered since the program started (see 'CollectStatistics'): those
+	with a queue of waiting threads, on average, or that are held for
+	most of the time.  They're ranked by the time threads have spent
+	waiting for them, which is the time those threads couldn't do
+	anything else.  For each, the pairs of locking sites that contend (a
+	site waiting, and the site holding the mutex when it started to
+	wait) are listed, with a suggestion of what to do about them:
+	shorten the holds, shard the mutex, or split it between sites.
+
+	\param top The number of mutexes to print, most time lost first
+	\param min_waiters Report a mutex with at least this many threads waiting for it on average
+	\param min_held Report a mutex that is held at least this fraction of the time
+	*/
+	static void dump_contention(size_t top = 10, double min_waiters = 0.5, double min_held = 0.5);
+
+	/*!
+	Takes a snapshot of every lock currently held through Dreadlock,
+	and every wait for one in progress, with how long each has lasted
+	so far.  Each thread publishes its locks through a sequence lock
+	that only it writes, so reading them never blocks or slows down the
+	threads being read: each thread's entries are consistent with each
+	other, and a thread that changes them faster than they can be read
+	is left out.  Nothing here locks or allocates, so it can be called
+	from a signal handler.  Hold times are only known when the lock was
+	timed (see 'CollectStatistics').
+
+	\param entries Where to store the entries, held locks before waits for each thread
+	\param capacity The number of entries there is room for
+	\returns The number of entries found, which may be more than 'capacity'
+	*/
+	static size_t snapshot(SnapshotEntry* entries, size_t capacity);
+
+	/*!
+	Prints a snapshot (see snapshot()) of who holds what, and who is
+	waiting on whom, right now.  Unlike snapshot(), this allocates and
+	writes output, so it isn't safe to call from a signal handler.
+	*/
+	static void dump_snapshot();
+
+	/*!
+	Keeps a copy of the ownership table, and of every thread's wait,
+	in a file mapped by every process that calls this with the same
+	path (e.g., under /dev/shm), so waits that cross processes can be
+	followed.  When a wait is declared deadlocked, the chain of
+	owners and their own waits is followed through the table, and
+	printed along with the deadlock, naming a cycle when it finds one.
+	The dreadlock_table tool prints the same table, and any cycles in
+	it, from outside.  Call this before the first lock, or set
+	DREADLOCK_SHARED_TABLE.  Not available on Windows.
+
+	\param path The file to share; created if it doesn't exist
+	\returns false if the file couldn't be mapped, or doesn't hold a compatible table
+	*/
+	static bool set_shared_table(const char* path);
+
+	/*!
+	Names a region of memory shared between processes, so that the
+	mutexes in it are recognized as the same mutex by every process
+	that names it the same, wherever they map it.  Mutexes outside
+	any named region are recorded as belonging to this process alone.
+	Call it before any of the region's mutexes are first locked.
+
+	\param base The start of this process's mapping of the region
+	\param size The size of the region
+	\param name A name for the region, the same in every process
+	*/
+	static void share_region(const void* base, size_t size, const char* name);
+
+	/*!
+	Returns the site record for a location known only at run time, as
+	the drop-in lock types of DreadlockStd.h learn theirs from the
+	compiler rather than from DREADLOCK_SITE.  The record is created
+	the first time, and lives as long as the process, like the ones
+	DREADLOCK_SITE makes.  Locations past DREADLOCK_RUNTIME_SITES share
+	a record for an unknown location.
+
+	\param file The file, as __FILE__ or __builtin_FILE() gives it (the pointer is kept)
+	\param line The line
+	*/
+	static const DreadlockSite& site_at(const char* file, int line);
+
+	/*!
+	Returns a name for a mutex that has none in the source, after its
+	address ("mutex 0x..."), for the drop-in lock types.  Mutexes past
+	DREADLOCK_RUNTIME_NAMES are all called "mutex".
+
+	\param mutex The mutex
+	*/
+	static const char* name_at(const void* mutex);
+
+	/*!
+	Keeps each thread's last DREADLOCK_EVENT_LOG_CAPACITY lock events
+	(waits, acquisitions, releases and deadlock verdicts) in a binary
+	log mapped from a file, which outlives a crash, for
+	dreadlock_events to rebuild the ownership timeline and the
+	wait-for graph from afterwards.  Recording an event is a few
+	stores into the mapping, with no system calls.  Call this before
+	the threads of interest start, or set DREADLOCK_EVENT_LOG.  A
+	forked child stops logging until it calls this itself.  Not
+	available on Windows.
+
+	\param path The file to write, replaced if it exists; "%p" in it becomes the process id
+	\returns false if the file couldn't be created
+	*/
+	static bool set_event_log(const char* path);
+};
+
+/// @struct DreadlockNames
+/// @brief The names of the mutexes handed to DREADLOCK_MULTI
+///
+/// Splits the stringized argument list ("a, b, c") into one name per
+/// mutex.  Each macro expansion owns a static instance, so this is
+/// only done once per site.
+
+template <size_t Length>
+struct DreadlockNames
+{
+	char text[Length];
+	const char* names[Length / 2 + 1]{};
+
+	explicit DreadlockNames(const char* list)
+	{
+		// a mutex expression may have commas of its own, inside brackets
+		size_t count{0};
+		int depth{0};
+		char* name{text};
+
+		for (size_t i = 0; i < Length; ++i)
+		{
+			text[i] = list[i];
+			if (list[i] == '(' || list[i] == '[' || list[i] == '{')
+				++depth;
+			else if (list[i] == ')' || list[i] == ']' || list[i] == '}')
+				--depth;
+			else if ((list[i] == ',' && depth == 0) || list[i] == '\0')
+			{
+				for (auto end = text + i; end > name && end[-1] == ' ';)
+					*--end = '\0';
+				text[i] = '\0';
+				while (*name == ' ')
+					++name;
+				names[count++] = name;
+				name = text + i + 1;
+			}
+		}
+	}
+};
+
+/// @class DreadlockMulti
+/// @brief Tracked locking of several mutexes at once
+///
+/// The debugging counterpart of std::scoped_lock: every mutex is
+/// locked (and tracked) by a Dreadlock instance of its own.  They are
+/// acquired in order of their addresses, so any two DreadlockMulti
+/// instances can lock the same mutexes, in any order of arguments,
+/// without deadlocking each other--and without the unlock-and-retry
+/// rounds of std::lock().  They're released in the reverse order when
+/// the instance goes out of scope.
+
+template <typename... Mutexes>
+class DreadlockMulti
+{
+private: // aliases and enums
+	static constexpr size_t Count{sizeof...(Mutexes)};
+	static_assert(Count > 0, "DREADLOCK_MULTI needs at least one mutex");
+
+	// constructed in place, since Dreadlock has no default constructor
+	union Lock
+	{
+		Lock() {}
+		~Lock() {}
+		Dreadlock dreadlock;
+	};
+
+private: // data members
+	Lock locks[Count];
+	size_t order[Count];
+
+public:
+	DreadlockMulti(const DreadlockSite& site, const char* const* names, Mutexes&... mtxs)
+	{
+		const void* addresses[Count]{&mtxs...};
+
+		size_t i{0};
+		((new (&locks[i].dreadlock) Dreadlock(mtxs, names[i], site, true), ++i), ...);
+
+		// there are only ever a few of them
+		for (i = 0; i < Count; ++i)
+		{
+			auto j{i};
+			for (; j > 0 && reinterpret_cast<uintptr_t>(addresses[order[j - 1]]) > reinterpret_cast<uintptr_t>(addresses[i]); --j)
+				order[j] = order[j - 1];
+			order[j] = i;
+		}
+
+		for (i = 0; i < Count; ++i)
+			locks[order[i]].dreadlock.lock(site);
+	}
+
+	~DreadlockMulti()
+	{
+		for (auto i = Count; i-- > 0;)
+			locks[order[i]].dreadlock.~Dreadlock();
+	}
+
+	DreadlockMulti(const DreadlockMulti&) = delete;
+	DreadlockMulti& operator=(const DreadlockMulti&) = delete;
+
+	/*!
+	This is a tracking function, as Dreadlock::destruct(), for every
+	mutex held by the instance.
+
+	\param site Location where the instance is going out of scope (usually "DREADLOCK_SITE")
 	*/
-	void destruct(const std::string& file, int line)
+	void destruct(const DreadlockSite& site)
 	{
-		destruct_file = file;
-		destruct_line = line;
+		for (auto& lock : locks)
+			lock.dreadlock.destruct(site);
 	}
 };
 
 #define STRINGIFY(x) #x
 #define TOSTRING(x) STRINGIFY(x)
+#define DREADLOCK_CONCAT_(x, y) x##y
+#define DREADLOCK_CONCAT(x, y) DREADLOCK_CONCAT_(x, y)
+
+// evaluates to a reference to the static site record for the code
+// location where it is expanded; nothing is computed at run time
+#define DREADLOCK_SITE                                                                                                                               \
+	([]() -> const DreadlockSite& {                                                                                                                  \
+		static constexpr DreadlockSite site{__FILE__, dreadlock_module_name(__FILE__), __LINE__};                                                   \
+		return site;                                                                                                                                 \
+	}())
 
-#define DREADLOCK(mtx) Dreadlock dreadlock_##mtx(mtx, TOSTRING(mtx), __FILE__, __LINE__)
-#define DREADLOCK_DEFER(mtx) Dreadlock dreadlock_##mtx(mtx, TOSTRING(mtx), __FILE__, __LINE__, true)
-#define DREADLOCK_LOCK(mtx) dreadlock_##mtx.lock(__FILE__, __LINE__)
-#define DREADLOCK_UNLOCK(mtx) dreadlock_##mtx.unlock(__FILE__, __LINE__)
+#define DREADLOCK(mtx) Dreadlock dreadlock_##mtx(mtx, TOSTRING(mtx), DREADLOCK_SITE)
+#define DREADLOCK_DEFER(mtx) Dreadlock dreadlock_##mtx(mtx, TOSTRING(mtx), DREADLOCK_SITE, true)
+#define DREADLOCK_LOCK(mtx) dreadlock_##mtx.lock(DREADLOCK_SITE)
+#define DREADLOCK_UNLOCK(mtx) dreadlock_##mtx.unlock(DREADLOCK_SITE)
 #define DREADLOCK_UNLOCK_AND_DESTRUCT(mtx)                                                                                                           \
-	dreadlock_##mtx.unlock(__FILE__, __LINE__);                                                                                                      \
-	dreadlock_##mtx.destruct(__FILE__, __LINE__)
-#define DREADLOCK_DESTRUCT(mtx) dreadlock_##mtx.destruct(__FILE__, __LINE__)
+	dreadlock_##mtx.unlock(DREADLOCK_SITE);                                                                                                          \
+	dreadlock_##mtx.destruct(DREADLOCK_SITE)
+#define DREADLOCK_DESTRUCT(mtx) dreadlock_##mtx.destruct(DREADLOCK_SITE)
 
 // in cases where the mutex name contains characters that are invalid
 // for a C variable, these macros allow you to specify the tag
 
-#define DREADLOCK_ID(mtx, id) Dreadlock dreadlock_##id(mtx, TOSTRING(mtx), __FILE__, __LINE__)
-#define DREADLOCK_DEFER_ID(mtx, id) Dreadlock dreadlock_##id(mtx, TOSTRING(mtx), __FILE__, __LINE__, true)
-#define DREADLOCK_LOCK_ID(mtx, id) dreadlock_##id.lock(__FILE__, __LINE__)
-#define DREADLOCK_UNLOCK_ID(mtx, id) dreadlock_##id.unlock(__FILE__, __LINE__)
+#define DREADLOCK_ID(mtx, id) Dreadlock dreadlock_##id(mtx, TOSTRING(mtx), DREADLOCK_SITE)
+#define DREADLOCK_DEFER_ID(mtx, id) Dreadlock dreadlock_##id(mtx, TOSTRING(mtx), DREADLOCK_SITE, true)
+#define DREADLOCK_LOCK_ID(mtx, id) dreadlock_##id.lock(DREADLOCK_SITE)
+#define DREADLOCK_UNLOCK_ID(mtx, id) dreadlock_##id.unlock(DREADLOCK_SITE)
 #define DREADLOCK_UNLOCK_AND_DESTRUCT_ID(mtx, id)                                                                                                    \
-	dreadlock_##id.unlock(__FILE__, __LINE__);                                                                                                       \
-	dreadlock_##id.destruct(__FILE__, __LINE__)
-#define DREADLOCK_DESTRUCT_ID(mtx, id) dreadlock_##id.destruct(__FILE__, __LINE__)
+	dreadlock_##id.unlock(DREADLOCK_SITE);                                                                                                           \
+	dreadlock_##id.destruct(DREADLOCK_SITE)
+#define DREADLOCK_DESTRUCT_ID(mtx, id) dreadlock_##id.destruct(DREADLOCK_SITE)
+
+// shared (reader) ownership of a SharedLockable mutex; the instance is
+// locked, unlocked and destructed with the regular macros above
+
+#define DREADLOCK_SHARED(mtx) Dreadlock dreadlock_##mtx(mtx, TOSTRING(mtx), DREADLOCK_SITE, false, Dreadlock::Shared{})
+#define DREADLOCK_SHARED_DEFER(mtx) Dreadlock dreadlock_##mtx(mtx, TOSTRING(mtx), DREADLOCK_SITE, true, Dreadlock::Shared{})
+#define DREADLOCK_SHARED_ID(mtx, id) Dreadlock dreadlock_##id(mtx, TOSTRING(mtx), DREADLOCK_SITE, false, Dreadlock::Shared{})
+#define DREADLOCK_SHARED_DEFER_ID(mtx, id) Dreadlock dreadlock_##id(mtx, TOSTRING(mtx), DREADLOCK_SITE, true, Dreadlock::Shared{})
+
+// a lock with a hold budget, any std::chrono duration (e.g. 50us): a
+// hold that lasts longer is reported when it's released
+
+#define DREADLOCK_BUDGET_OF(budget)                                                                                                                  \
+	Dreadlock::Budget([&] {                                                                                                                          \
+		using namespace std::chrono_literals;                                                                                                        \
+		return budget;                                                                                                                               \
+	}())
+#define DREADLOCK_BUDGET(mtx, budget) Dreadlock dreadlock_##mtx(mtx, TOSTRING(mtx), DREADLOCK_SITE, DREADLOCK_BUDGET_OF(budget))
+#define DREADLOCK_BUDGET_ID(mtx, id, budget) Dreadlock dreadlock_##id(mtx, TOSTRING(mtx), DREADLOCK_SITE, DREADLOCK_BUDGET_OF(budget))
+#define DREADLOCK_SHARED_BUDGET(mtx, budget) Dreadlock dreadlock_##mtx(mtx, TOSTRING(mtx), DREADLOCK_SITE, DREADLOCK_BUDGET_OF(budget), false, Dreadlock::Shared{})
+#define DREADLOCK_SHARED_BUDGET_ID(mtx, id, budget) Dreadlock dreadlock_##id(mtx, TOSTRING(mtx), DREADLOCK_SITE, DREADLOCK_BUDGET_OF(budget), false, Dreadlock::Shared{})
+
+// a lock with a place in a lock hierarchy, a positive integer: a
+// thread may only lock it while holding nothing at its level or above,
+// so locks are taken in increasing level (e.g. config 1 < cache 2 <
+// connection 3).  checking that costs one comparison per acquisition;
+// an inversion is reported when it happens, without having to wait
+// for the lock-order graph to see both orders.  DREADLOCK_NESTED_LEVEL
+// also checks, at compile time, that the level is above that of an
+// enclosing levelled lock (named by its tag), and costs nothing at
+// run time in either kind of build.
+
+#define DREADLOCK_LEVEL(mtx, level)                                                                                                                  \
+	[[maybe_unused]] constexpr int dreadlock_level_##mtx{level};                                                                                     \
+	Dreadlock dreadlock_##mtx(mtx, TOSTRING(mtx), DREADLOCK_SITE, Dreadlock::Level{level})
+#define DREADLOCK_LEVEL_ID(mtx, id, level)                                                                                                           \
+	[[maybe_unused]] constexpr int dreadlock_level_##id{level};                                                                                      \
+	Dreadlock dreadlock_##id(mtx, TOSTRING(mtx), DREADLOCK_SITE, Dreadlock::Level{level})
+#define DREADLOCK_SHARED_LEVEL(mtx, level)                                                                                                           \
+	[[maybe_unused]] constexpr int dreadlock_level_##mtx{level};                                                                                     \
+	Dreadlock dreadlock_##mtx(mtx, TOSTRING(mtx), DREADLOCK_SITE, Dreadlock::Level{level}, false, Dreadlock::Shared{})
+#define DREADLOCK_SHARED_LEVEL_ID(mtx, id, level)                                                                                                    \
+	[[maybe_unused]] constexpr int dreadlock_level_##id{level};                                                                                      \
+	Dreadlock dreadlock_##id(mtx, TOSTRING(mtx), DREADLOCK_SITE, Dreadlock::Level{level}, false, Dreadlock::Shared{})
+
+#define DREADLOCK_NESTED_LEVEL(outer, mtx, level)                                                                                                    \
+	static_assert((level) > dreadlock_level_##outer, "lock hierarchy inverted: " #mtx " is nested in " #outer " at a lower level");                  \
+	DREADLOCK_LEVEL(mtx, level)
+#define DREADLOCK_NESTED_LEVEL_ID(outer, mtx, id, level)                                                                                             \
+	static_assert((level) > dreadlock_level_##outer, "lock hierarchy inverted: " #id " is nested in " #outer " at a lower level");                   \
+	DREADLOCK_LEVEL_ID(mtx, id, level)
+
+// several mutexes locked together until the end of the scope (see
+// DreadlockMulti); the _ID variant can be passed to DREADLOCK_DESTRUCT_ID
+
+#define DREADLOCK_NAMES(...)                                                                                                                         \
+	([]() -> const char* const* {                                                                                                                    \
+		static const DreadlockNames<sizeof(#__VA_ARGS__)> names(#__VA_ARGS__);                                                                       \
+		return names.names;                                                                                                                          \
+	}())
+
+#define DREADLOCK_MULTI(...) DreadlockMulti DREADLOCK_CONCAT(dreadlock_multi_, __LINE__)(DREADLOCK_SITE, DREADLOCK_NAMES(__VA_ARGS__), __VA_ARGS__)
+#define DREADLOCK_MULTI_ID(id, ...) DreadlockMulti dreadlock_##id(DREADLOCK_SITE, DREADLOCK_NAMES(__VA_ARGS__), __VA_ARGS__)
+
+// waits on a condition variable for a predicate (the last argument),
+// with the mutex held by the instance for 'mtx' (or 'id'); the _FOR
+// and _UNTIL variants return the final value of the predicate
+
+#define DREADLOCK_WAIT(cv, mtx, ...) dreadlock_##mtx.wait(cv, __VA_ARGS__, DREADLOCK_SITE)
+#define DREADLOCK_WAIT_FOR(cv, mtx, timeout, ...) dreadlock_##mtx.wait_for(cv, timeout, __VA_ARGS__, DREADLOCK_SITE)
+#define DREADLOCK_WAIT_UNTIL(cv, mtx, deadline, ...) dreadlock_##mtx.wait_until(cv, deadline, __VA_ARGS__, DREADLOCK_SITE)
+#define DREADLOCK_WAIT_ID(cv, id, ...) dreadlock_##id.wait(cv, __VA_ARGS__, DREADLOCK_SITE)
+#define DREADLOCK_WAIT_FOR_ID(cv, id, timeout, ...) dreadlock_##id.wait_for(cv, timeout, __VA_ARGS__, DREADLOCK_SITE)
+#define DREADLOCK_WAIT_UNTIL_ID(cv, id, deadline, ...) dreadlock_##id.wait_until(cv, deadline, __VA_ARGS__, DREADLOCK_SITE)
 
 #else // ENABLE_DREADLOCK
 
 // Production builds replace Dreadlock with std::unique_lock functionality
+// (std::shared_lock for the shared variants), deduced for the mutex type
 
-#define DREADLOCK(mtx) std::unique_lock<std::mutex> lock_##mtx(mtx)
-#define DREADLOCK_DEFER(mtx) std::unique_lock<std::mutex> lock_##mtx(mtx, std::defer_lock)
+#define DREADLOCK(mtx) std::unique_lock lock_##mtx(mtx)
+#define DREADLOCK_DEFER(mtx) std::unique_lock lock_##mtx(mtx, std::defer_lock)
 #define DREADLOCK_LOCK(mtx) lock_##mtx.lock()
 #define DREADLOCK_UNLOCK(mtx) lock_##mtx.unlock()
 #define DREADLOCK_UNLOCK_AND_DESTRUCT(mtx) lock_##mtx.unlock()
 #define DREADLOCK_DESTRUCT(mtx)
 
-#define DREADLOCK_ID(mtx, id) std::unique_lock<std::mutex> lock_##id(mtx);
-#define DREADLOCK_DEFER_ID(mtx, id) std::unique_lock<std::mutex> lock_##id(mtx, std::defer_lock);
+#define DREADLOCK_ID(mtx, id) std::unique_lock lock_##id(mtx)
+#define DREADLOCK_DEFER_ID(mtx, id) std::unique_lock lock_##id(mtx, std::defer_lock)
 #define DREADLOCK_LOCK_ID(mtx, id) lock_##id.lock()
 #define DREADLOCK_UNLOCK_ID(mtx, id) lock_##id.unlock()
 #define DREADLOCK_UNLOCK_AND_DESTRUCT_ID(mtx, id) lock_##id.unlock()
 #define DREADLOCK_DESTRUCT_ID(mtx, id)
 
+#define DREADLOCK_SHARED(mtx) std::shared_lock lock_##mtx(mtx)
+#define DREADLOCK_SHARED_DEFER(mtx) std::shared_lock lock_##mtx(mtx, std::defer_lock)
+#define DREADLOCK_SHARED_ID(mtx, id) std::shared_lock lock_##id(mtx)
+#define DREADLOCK_SHARED_DEFER_ID(mtx, id) std::shared_lock lock_##id(mtx, std::defer_lock)
+
+#define DREADLOCK_BUDGET(mtx, budget) std::unique_lock lock_##mtx(mtx)
+#define DREADLOCK_BUDGET_ID(mtx, id, budget) std::unique_lock lock_##id(mtx)
+#define DREADLOCK_SHARED_BUDGET(mtx, budget) std::shared_lock lock_##mtx(mtx)
+#define DREADLOCK_SHARED_BUDGET_ID(mtx, id, budget) std::shared_lock lock_##id(mtx)
+
+// the hierarchy's compile-time checks stay; the run-time one goes
+
+#define DREADLOCK_LEVEL(mtx, level)                                                                                                                  \
+	[[maybe_unused]] constexpr int dreadlock_level_##mtx{level};                                                                                     \
+	std::unique_lock lock_##mtx(mtx)
+#define DREADLOCK_LEVEL_ID(mtx, id, level)                                                                                                           \
+	[[maybe_unused]] constexpr int dreadlock_level_##id{level};                                                                                      \
+	std::unique_lock lock_##id(mtx)
+#define DREADLOCK_SHARED_LEVEL(mtx, level)                                                                                                           \
+	[[maybe_unused]] constexpr int dreadlock_level_##mtx{level};                                                                                     \
+	std::shared_lock lock_##mtx(mtx)
+#define DREADLOCK_SHARED_LEVEL_ID(mtx, id, level)                                                                                                    \
+	[[maybe_unused]] constexpr int dreadlock_level_##id{level};                                                                                      \
+	std::shared_lock lock_##id(mtx)
+
+#define DREADLOCK_NESTED_LEVEL(outer, mtx, level)                                                                                                    \
+	static_assert((level) > dreadlock_level_##outer, "lock hierarchy inverted: " #mtx " is nested in " #outer " at a lower level");                  \
+	DREADLOCK_LEVEL(mtx, level)
+#define DREADLOCK_NESTED_LEVEL_ID(outer, mtx, id, level)                                                                                             \
+	static_assert((level) > dreadlock_level_##outer, "lock hierarchy inverted: " #id " is nested in " #outer " at a lower level");                   \
+	DREADLOCK_LEVEL_ID(mtx, id, level)
+
+#define DREADLOCK_CONCAT_(x, y) x##y
+#define DREADLOCK_CONCAT(x, y) DREADLOCK_CONCAT_(x, y)
+
+#define DREADLOCK_MULTI(...) std::scoped_lock DREADLOCK_CONCAT(lock_multi_, __LINE__)(__VA_ARGS__)
+#define DREADLOCK_MULTI_ID(id, ...) std::scoped_lock lock_##id(__VA_ARGS__)
+
+#define DREADLOCK_WAIT(cv, mtx, ...) cv.wait(lock_##mtx, __VA_ARGS__)
+#define DREADLOCK_WAIT_FOR(cv, mtx, timeout, ...) cv.wait_for(lock_##mtx, timeout, __VA_ARGS__)
+#define DREADLOCK_WAIT_UNTIL(cv, mtx, deadline, ...) cv.wait_until(lock_##mtx, deadline, __VA_ARGS__)
+#define DREADLOCK_WAIT_ID(cv, id, ...) cv.wait(lock_##id, __VA_ARGS__)
+#define DREADLOCK_WAIT_FOR_ID(cv, id, timeout, ...) cv.wait_for(lock_##id, timeout, __VA_ARGS__)
+#define DREADLOCK_WAIT_UNTIL_ID(cv, id, deadline, ...) cv.wait_until(lock_##id, deadline, __VA_ARGS__)
+
 #endif // ENABLE_DREADLOCK
@@ -0,0 +1,468 @@
+#pragma once
+
+//------------------------------------------------------------------------------
+// MIT License
+//
+// Copyright (c) 2021 Bob Hood
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//------------------------------------------------------------------------------
+
+/// @file DreadlockStd.h
+/// Drop-in Dreadlock replacements for the standard lock types.
+///
+/// DreadlockLockGuard, DreadlockUniqueLock, DreadlockSharedLock and
+/// DreadlockConditionVariable are used like std::lock_guard,
+/// std::unique_lock, std::shared_lock and std::condition_variable,
+/// and track every lock through a Dreadlock instance, taking their
+/// sites from the compiler instead of DREADLOCK_SITE.  A mutex type
+/// Dreadlock can't track (one without try_lock(), say) gets the
+/// standard type itself.  Production builds turn them all back into
+/// the standard types.
+///
+/// With DREADLOCK_INTERPOSE_STD defined, the standard names themselves
+/// are redirected to them, so code written against std::unique_lock
+/// and friends is tracked without changing a line of it: force-include
+/// this header into a whole target (g++ -include DreadlockStd.h, or
+/// cl /FI) and build it with ENABLE_DREADLOCK.
+
+#include "Dreadlock.h"
+
+#if defined(ENABLE_DREADLOCK)
+
+#include <optional>
+#include <system_error>
+#include <utility>
+
+/// @struct DreadlockLocation
+/// @brief The caller's location, captured by a default argument
+///
+/// Default arguments are evaluated where the call is made, so a
+/// function taking 'DreadlockLocation where = DreadlockLocation::current()'
+/// learns its caller's file and line, as with std::source_location
+/// (which GCC, Clang and MSVC build on the same builtins).
+
+struct DreadlockLocation
+{
+	const char* file;
+	int line;
+
+	static constexpr DreadlockLocation current(const char* file = __builtin_FILE(), int line = __builtin_LINE()) { return {file, line}; }
+
+	const DreadlockSite& site() const { return Dreadlock::site_at(file, line); }
+};
+
+// whether Dreadlock can track a mutex type, exclusively or shared
+template <typename Mutex, typename = void>
+struct DreadlockTrackable : std::false_type
+{
+};
+
+template <typename Mutex>
+struct DreadlockTrackable<Mutex, std::void_t<decltype(std::declval<Mutex&>().lock(), std::declval<Mutex&>().try_lock(), std::declval<Mutex&>().unlock())>>
+	: std::true_type
+{
+};
+
+template <typename Mutex, typename = void>
+struct DreadlockSharedTrackable : std::false_type
+{
+};
+
+template <typename Mutex>
+struct DreadlockSharedTrackable<
+	Mutex,
+	std::void_t<decltype(std::declval<Mutex&>().lock_shared(), std::declval<Mutex&>().try_lock_shared(), std::declval<Mutex&>().unlock_shared())>>
+	: std::true_type
+{
+};
+
+// the standard type, for a mutex Dreadlock can't track
+template <typename Mutex, typename = void>
+class DreadlockLockGuard : public std::lock_guard<Mutex>
+{
+public:
+	using std::lock_guard<Mutex>::lock_guard;
+};
+
+template <typename Mutex>
+class DreadlockLockGuard<Mutex, std::enable_if_t<DreadlockTrackable<Mutex>::value>>
+{
+private: // data members
+	Dreadlock dreadlock;
+
+public:
+	using mutex_type = Mutex;
+
+	explicit DreadlockLockGuard(Mutex& mtx, DreadlockLocation where = DreadlockLocation::current())
+		: dreadlock(mtx, Dreadlock::name_at(&mtx), where.site())
+	{
+	}
+
+	DreadlockLockGuard(Mutex& mtx, std::adopt_lock_t, DreadlockLocation where = DreadlockLocation::current())
+		: dreadlock(mtx, Dreadlock::name_at(&mtx), where.site(), true)
+	{
+		dreadlock.adopt(where.site());
+	}
+
+	DreadlockLockGuard(const DreadlockLockGuard&) = delete;
+	DreadlockLockGuard& operator=(const DreadlockLockGuard&) = delete;
+};
+
+template <typename Mutex>
+DreadlockLockGuard(Mutex&) -> DreadlockLockGuard<Mutex>;
+template <typename Mutex>
+DreadlockLockGuard(Mutex&, std::adopt_lock_t) -> DreadlockLockGuard<Mutex>;
+
+// the std::unique_lock and std::shared_lock interface, for the mutex
+// types Dreadlock can track.  the timed tries wait on the mutex itself,
+// and the lock is tracked once they succeed.
+template <typename Mutex, bool Shared>
+class DreadlockStdLock
+{
+private: // data members
+	std::optional<Dreadlock> dreadlock;
+	Mutex* mtx{nullptr};
+
+	friend class DreadlockConditionVariable;
+
+public:
+	using mutex_type = Mutex;
+
+	DreadlockStdLock() noexcept = default;
+
+	explicit DreadlockStdLock(Mutex& mtx, DreadlockLocation where = DreadlockLocation::current())
+	{
+		emplace(mtx, where.site(), false);
+	}
+
+	DreadlockStdLock(Mutex& mtx, std::defer_lock_t, DreadlockLocation where = DreadlockLocation::current())
+	{
+		emplace(mtx, where.site(), true);
+	}
+
+	DreadlockStdLock(Mutex& mtx, std::try_to_lock_t, DreadlockLocation where = DreadlockLocation::current())
+	{
+		emplace(mtx, where.site(), true);
+		dreadlock->try_lock(where.site());
+	}
+
+	DreadlockStdLock(Mutex& mtx, std::adopt_lock_t, DreadlockLocation where = DreadlockLocation::current())
+	{
+		emplace(mtx, where.site(), true);
+		dreadlock->adopt(where.site());
+	}
+
+	template <typename Clock, typename Duration>
+	DreadlockStdLock(Mutex& mtx, const std::chrono::time_point<Clock, Duration>& deadline, DreadlockLocation where = DreadlockLocation::current())
+	{
+		emplace(mtx, where.site(), true);
+		try_lock_until(deadline, where);
+	}
+
+	template <typename Rep, typename Period>
+	DreadlockStdLock(Mutex& mtx, const std::chrono::duration<Rep, Period>& timeout, DreadlockLocation where = DreadlockLocation::current())
+	{
+		emplace(mtx, where.site(), true);
+		try_lock_for(timeout, where);
+	}
+
+	DreadlockStdLock(DreadlockStdLock&& other) noexcept { swap(other); }
+
+	DreadlockStdLock& operator=(DreadlockStdLock&& other) noexcept
+	{
+		DreadlockStdLock(std::move(other)).swap(*this);
+		return *this;
+	}
+
+	void lock(DreadlockLocation where = DreadlockLocation::current())
+	{
+		lockable();
+		dreadlock->lock(where.site());
+	}
+
+	bool try_lock(DreadlockLocation where = DreadlockLocation::current())
+	{
+		lockable();
+		return dreadlock->try_lock(where.site());
+	}
+
+	template <typename Clock, typename Duration>
+	bool try_lock_until(const std::chrono::time_point<Clock, Duration>& deadline, DreadlockLocation where = DreadlockLocation::current())
+	{
+		lockable();
+
+		bool locked;
+		if constexpr (Shared)
+			locked = mtx->try_lock_shared_until(deadline);
+		else
+			locked = mtx->try_lock_until(deadline);
+
+		if (locked)
+			dreadlock->adopt(where.site());
+		return locked;
+	}
+
+	template <typename Rep, typename Period>
+	bool try_lock_for(const std::chrono::duration<Rep, Period>& timeout, DreadlockLocation where = DreadlockLocation::current())
+	{
+		return try_lock_until(std::chrono::steady_clock::now() + timeout, where);
+	}
+
+	void unlock(DreadlockLocation where = DreadlockLocation::current())
+	{
+		if (!owns_lock())
+			throw std::system_error(std::make_error_code(std::errc::operation_not_permitted));
+		dreadlock->unlock(where.site());
+	}
+
+	// hands the mutex over, still locked, and no longer tracked
+	Mutex* release(DreadlockLocation where = DreadlockLocation::current()) noexcept
+	{
+		if (dreadlock)
+			dreadlock->forget(where.site());
+		dreadlock.reset();
+		return std::exchange(mtx, nullptr);
+	}
+
+	void swap(DreadlockStdLock& other) noexcept
+	{
+		std::swap(mtx, other.mtx);
+
+		std::optional<Dreadlock> ours;
+		if (dreadlock)
+			ours.emplace(std::move(*dreadlock));
+		dreadlock.reset();
+		if (other.dreadlock)
+			dreadlock.emplace(std::move(*other.dreadlock));
+		other.dreadlock.reset();
+		if (ours)
+			other.dreadlock.emplace(std::move(*ours));
+	}
+
+	bool owns_lock() const noexcept { return dreadlock && dreadlock->owns_lock(); }
+	explicit operator bool() const noexcept { return owns_lock(); }
+	Mutex* mutex() const noexcept { return mtx; }
+
+private:
+	void emplace(Mutex& mutex, const DreadlockSite& site, bool defer)
+	{
+		mtx = &mutex;
+		if constexpr (Shared)
+			dreadlock.emplace(mutex, Dreadlock::name_at(&mutex), site, defer, Dreadlock::Shared{});
+		else
+			dreadlock.emplace(mutex, Dreadlock::name_at(&mutex), site, defer);
+	}
+
+	// the errors std::unique_lock throws for a lock it can't take
+	void lockable() const
+	{
+		if (!dreadlock)
+			throw std::system_error(std::make_error_code(std::errc::operation_not_permitted));
+		if (dreadlock->owns_lock())
+			throw std::system_error(std::make_error_code(std::errc::resource_deadlock_would_occur));
+	}
+};
+
+template <typename Mutex, typename = void>
+class DreadlockUniqueLock : public std::unique_lock<Mutex>
+{
+public:
+	using std::unique_lock<Mutex>::unique_lock;
+};
+
+template <typename Mutex>
+class DreadlockUniqueLock<Mutex, std::enable_if_t<DreadlockTrackable<Mutex>::value>> : public DreadlockStdLock<Mutex, false>
+{
+public:
+	using DreadlockStdLock<Mutex, false>::DreadlockStdLock;
+};
+
+template <typename Mutex, typename = void>
+class DreadlockSharedLock : public std::shared_lock<Mutex>
+{
+public:
+	using std::shared_lock<Mutex>::shared_lock;
+};
+
+template <typename Mutex>
+class DreadlockSharedLock<Mutex, std::enable_if_t<DreadlockSharedTrackable<Mutex>::value>> : public DreadlockStdLock<Mutex, true>
+{
+public:
+	using DreadlockStdLock<Mutex, true>::DreadlockStdLock;
+};
+
+// inherited constructors take no part in deducing the arguments
+template <typename Mutex>
+DreadlockUniqueLock(Mutex&) -> DreadlockUniqueLock<Mutex>;
+template <typename Mutex>
+DreadlockUniqueLock(Mutex&, std::defer_lock_t) -> DreadlockUniqueLock<Mutex>;
+template <typename Mutex>
+DreadlockUniqueLock(Mutex&, std::try_to_lock_t) -> DreadlockUniqueLock<Mutex>;
+template <typename Mutex>
+DreadlockUniqueLock(Mutex&, std::adopt_lock_t) -> DreadlockUniqueLock<Mutex>;
+template <typename Mutex, typename Clock, typename Duration>
+DreadlockUniqueLock(Mutex&, const std::chrono::time_point<Clock, Duration>&) -> DreadlockUniqueLock<Mutex>;
+template <typename Mutex, typename Rep, typename Period>
+DreadlockUniqueLock(Mutex&, const std::chrono::duration<Rep, Period>&) -> DreadlockUniqueLock<Mutex>;
+template <typename Mutex>
+DreadlockSharedLock(Mutex&) -> DreadlockSharedLock<Mutex>;
+template <typename Mutex>
+DreadlockSharedLock(Mutex&, std::defer_lock_t) -> DreadlockSharedLock<Mutex>;
+template <typename Mutex>
+DreadlockSharedLock(Mutex&, std::try_to_lock_t) -> DreadlockSharedLock<Mutex>;
+template <typename Mutex>
+DreadlockSharedLock(Mutex&, std::adopt_lock_t) -> DreadlockSharedLock<Mutex>;
+template <typename Mutex, typename Clock, typename Duration>
+DreadlockSharedLock(Mutex&, const std::chrono::time_point<Clock, Duration>&) -> DreadlockSharedLock<Mutex>;
+template <typename Mutex, typename Rep, typename Period>
+DreadlockSharedLock(Mutex&, const std::chrono::duration<Rep, Period>&) -> DreadlockSharedLock<Mutex>;
+
+/// @class DreadlockConditionVariable
+/// @brief A std::condition_variable that waits with a DreadlockUniqueLock
+///
+/// Waits go through Dreadlock::wait() and friends, so the tracking is
+/// released and taken up again along with the mutex.  The waits
+/// without a predicate wake once, as the standard ones do.
+
+class DreadlockConditionVariable
+{
+private: // data members
+	std::condition_variable cv;
+
+	using Lock = DreadlockUniqueLock<std::mutex>;
+
+	static Dreadlock& tracked(Lock& lock)
+	{
+		if (!lock.owns_lock())
+			throw std::system_error(std::make_error_code(std::errc::operation_not_permitted));
+		return *lock.dreadlock;
+	}
+
+	friend void DreadlockNotifyAllAtThreadExit(DreadlockConditionVariable& cv, Lock lock, DreadlockLocation where);
+
+public:
+	using native_handle_type = std::condition_variable::native_handle_type;
+
+	void notify_one() noexcept { cv.notify_one(); }
+	void notify_all() noexcept { cv.notify_all(); }
+	native_handle_type native_handle() { return cv.native_handle(); }
+
+	void wait(Lock& lock, DreadlockLocation where = DreadlockLocation::current())
+	{
+		bool woken{false};
+		tracked(lock).wait(cv, [&woken] { return std::exchange(woken, true); }, where.site());
+	}
+
+	template <typename Predicate>
+	void wait(Lock& lock, Predicate pred, DreadlockLocation where = DreadlockLocation::current())
+	{
+		tracked(lock).wait(cv, std::move(pred), where.site());
+	}
+
+	template <typename Clock, typename Duration>
+	std::cv_status wait_until(Lock& lock, const std::chrono::time_point<Clock, Duration>& deadline, DreadlockLocation where = DreadlockLocation::current())
+	{
+		bool woken{false};
+		tracked(lock).wait_until(cv, deadline, [&woken] { return std::exchange(woken, true); }, where.site());
+		return Clock::now() < deadline ? std::cv_status::no_timeout : std::cv_status::timeout;
+	}
+
+	template <typename Clock, typename Duration, typename Predicate>
+	bool wait_until(Lock& lock, const std::chrono::time_point<Clock, Duration>& deadline, Predicate pred, DreadlockLocation where = DreadlockLocation::current())
+	{
+		return tracked(lock).wait_until(cv, deadline, std::move(pred), where.site());
+	}
+
+	template <typename Rep, typename Period>
+	std::cv_status wait_for(Lock& lock, const std::chrono::duration<Rep, Period>& timeout, DreadlockLocation where = DreadlockLocation::current())
+	{
+		return wait_until(lock, std::chrono::steady_clock::now() + timeout, where);
+	}
+
+	template <typename Rep, typename Period, typename Predicate>
+	bool wait_for(Lock& lock, const std::chrono::duration<Rep, Period>& timeout, Predicate pred, DreadlockLocation where = DreadlockLocation::current())
+	{
+		return wait_until(lock, std::chrono::steady_clock::now() + timeout, std::move(pred), where);
+	}
+};
+
+// std::notify_all_at_thread_exit(), which takes over the lock, so it's
+// no longer tracked from here
+inline void DreadlockNotifyAllAtThreadExit(DreadlockConditionVariable& cv, DreadlockUniqueLock<std::mutex> lock, DreadlockLocation where = DreadlockLocation::current())
+{
+	if (!lock.owns_lock())
+		throw std::system_error(std::make_error_code(std::errc::operation_not_permitted));
+	std::notify_all_at_thread_exit(cv.cv, std::unique_lock<std::mutex>(*lock.release(where), std::adopt_lock));
+}
+
+#if defined(DREADLOCK_INTERPOSE_STD)
+
+// every standard header that uses these names has to be read before
+// they're redirected, or it would no longer compile
+#include <atomic>
+#include <future>
+#include <memory>
+#include <memory_resource>
+#include <thread>
+#if __cplusplus >= 202002L
+#include <barrier>
+#include <latch>
+#include <semaphore>
+#include <stop_token>
+#if __has_include(<syncstream>)
+#include <syncstream>
+#endif
+#endif
+
+// the standard names lead to these types from here on: every
+// translation unit that passes the lock types between functions has to
+// be built the same way, as their mangled names change.  std::scoped_lock
+// and std::condition_variable_any are left as they are, and std::lock()
+// takes the lock types as it does the standard ones.
+namespace std
+{
+using ::DreadlockConditionVariable;
+using ::DreadlockLockGuard;
+using ::DreadlockNotifyAllAtThreadExit;
+using ::DreadlockSharedLock;
+using ::DreadlockUniqueLock;
+} // namespace std
+
+#define lock_guard DreadlockLockGuard
+#define unique_lock DreadlockUniqueLock
+#define shared_lock DreadlockSharedLock
+#define condition_variable DreadlockConditionVariable
+#define notify_all_at_thread_exit DreadlockNotifyAllAtThreadExit
+
+#endif // DREADLOCK_INTERPOSE_STD
+
+#else // ENABLE_DREADLOCK
+
+#include <condition_variable>
+#include <mutex>
+#include <shared_mutex>
+
+#define DreadlockLockGuard std::lock_guard
+#define DreadlockUniqueLock std::unique_lock
+#define DreadlockSharedLock std::shared_lock
+#define DreadlockConditionVariable std::condition_variable
+#define DreadlockNotifyAllAtThreadExit std::notify_all_at_thread_exit
+
+#endif // ENABLE_DREADLOCK
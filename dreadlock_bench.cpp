@@ -0,0 +1,315 @@
+// Measures what Dreadlock costs, by running each scenario once with
+// plain std::unique_lock (what the macros become in production) and
+// once with the DREADLOCK macros, at increasing thread counts:
+//
+//   g++ -std=c++17 -O2 -DENABLE_DREADLOCK -DNDEBUG dreadlock_bench.cpp Dreadlock.cpp -pthread -o dreadlock_bench
+//   ./dreadlock_bench [--time ms] [--threads max] [--scenario name] [--sample one_in [hot_threshold]] [--csv path] [--label name]
+//
+// --csv appends the results to a file, labelled with --label, so they
+// can be compared from build to build (dreadlock_stress does the same
+// for the time to detect).
+// Without ENABLE_DREADLOCK both columns measure std::unique_lock,
+// which is a useful check on the noise.  Add -DDREADLOCK_VERBOSE to
+// measure the logging path (redirect the output somewhere).
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Dreadlock.h"
+
+namespace
+{
+const int MutexCount = 64; // for the "many" scenario
+const int NestDepth = 3;   // for the "nested" scenario
+
+struct alignas(64) Guarded
+{
+	std::mutex mtx;
+	uint64_t value{0};
+};
+
+struct alignas(64) Counter
+{
+	uint64_t ops{0};
+};
+
+Guarded guarded[MutexCount];
+
+std::atomic<bool> running{false};
+std::atomic<bool> stopping{false};
+
+// a cheap per-thread generator for picking mutexes
+uint32_t next_random(uint32_t& state)
+{
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+// each scenario is one operation, repeated by every thread until
+// stopped; 'Instrumented' selects Dreadlock or std::unique_lock
+
+template <bool Instrumented>
+void uncontended(int thread, uint32_t&)
+{
+	// each thread has a mutex of its own
+	auto& g{guarded[thread % MutexCount]};
+	if constexpr (Instrumented)
+	{
+		DREADLOCK_ID(g.mtx, g);
+		++g.value;
+		DREADLOCK_UNLOCK_ID(g.mtx, g);
+	}
+	else
+	{
+		std::unique_lock<std::mutex> lock(g.mtx);
+		++g.value;
+		lock.unlock();
+	}
+}
+
+template <bool Instrumented>
+void contended(int, uint32_t&)
+{
+	// every thread on the same mutex
+	auto& g{guarded[0]};
+	if constexpr (Instrumented)
+	{
+		DREADLOCK_ID(g.mtx, g);
+		++g.value;
+		DREADLOCK_UNLOCK_ID(g.mtx, g);
+	}
+	else
+	{
+		std::unique_lock<std::mutex> lock(g.mtx);
+		++g.value;
+		lock.unlock();
+	}
+}
+
+template <bool Instrumented>
+void many(int, uint32_t& random)
+{
+	// every thread on a random one of many mutexes
+	auto& g{guarded[next_random(random) % MutexCount]};
+	if constexpr (Instrumented)
+	{
+		DREADLOCK_ID(g.mtx, g);
+		++g.value;
+		DREADLOCK_UNLOCK_ID(g.mtx, g);
+	}
+	else
+	{
+		std::unique_lock<std::mutex> lock(g.mtx);
+		++g.value;
+		lock.unlock();
+	}
+}
+
+template <bool Instrumented>
+void nested(int, uint32_t& random)
+{
+	// a few mutexes, always locked in ascending order
+	auto first{next_random(random) % (MutexCount - NestDepth + 1)};
+	auto& a{guarded[first]};
+	auto& b{guarded[first + 1]};
+	auto& c{guarded[first + 2]};
+	if constexpr (Instrumented)
+	{
+		DREADLOCK_ID(a.mtx, a);
+		DREADLOCK_ID(b.mtx, b);
+		DREADLOCK_ID(c.mtx, c);
+		++c.value;
+		DREADLOCK_UNLOCK_ID(c.mtx, c);
+		DREADLOCK_UNLOCK_ID(b.mtx, b);
+		DREADLOCK_UNLOCK_ID(a.mtx, a);
+	}
+	else
+	{
+		std::unique_lock<std::mutex> lock_a(a.mtx);
+		std::unique_lock<std::mutex> lock_b(b.mtx);
+		std::unique_lock<std::mutex> lock_c(c.mtx);
+		++c.value;
+		lock_c.unlock();
+		lock_b.unlock();
+		lock_a.unlock();
+	}
+}
+
+template <bool Instrumented>
+void multi(int, uint32_t& random)
+{
+	// two random mutexes locked together, in either order
+	auto first{next_random(random) % MutexCount};
+	auto second{(first + 1 + next_random(random) % (MutexCount - 1)) % MutexCount};
+	auto& a{guarded[first]};
+	auto& b{guarded[second]};
+	if constexpr (Instrumented)
+	{
+		DREADLOCK_MULTI(a.mtx, b.mtx);
+		++a.value;
+		++b.value;
+	}
+	else
+	{
+		std::scoped_lock lock(a.mtx, b.mtx);
+		++a.value;
+		++b.value;
+	}
+}
+
+struct Scenario
+{
+	const char* name;
+	void (*bare)(int, uint32_t&);
+	void (*instrumented)(int, uint32_t&);
+};
+
+const Scenario scenarios[] = {
+	{"uncontended", uncontended<false>, uncontended<true>},
+	{"contended", contended<false>, contended<true>},
+	{"many", many<false>, many<true>},
+	{"nested", nested<false>, nested<true>},
+	{"multi", multi<false>, multi<true>},
+};
+
+// runs 'op' on 'threads' threads for 'time_ms', returning the average
+// wall-clock time per operation in nanoseconds (the inverse of the
+// combined throughput)
+double measure(void (*op)(int, uint32_t&), int threads, int time_ms)
+{
+	std::vector<Counter> counters(threads);
+	std::vector<std::thread> workers;
+
+	running = false;
+	stopping = false;
+
+	for (int i = 0; i < threads; ++i)
+	{
+		workers.emplace_back([op, i, &counters]() {
+			uint32_t random{0x9E3779B9u * (i + 1)};
+			uint64_t ops{0};
+
+			while (!running.load(std::memory_order_acquire))
+				std::this_thread::yield();
+
+			while (!stopping.load(std::memory_order_relaxed))
+			{
+				for (int j = 0; j < 64; ++j)
+					op(i, random);
+				ops += 64;
+			}
+
+			counters[i].ops = ops;
+		});
+	}
+
+	auto start{std::chrono::steady_clock::now()};
+	running.store(true, std::memory_order_release);
+	std::this_thread::sleep_for(std::chrono::milliseconds(time_ms));
+	stopping.store(true, std::memory_order_relaxed);
+
+	for (auto& worker : workers)
+		worker.join();
+	auto elapsed{std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count()};
+
+	uint64_t total{0};
+	for (const auto& counter : counters)
+		total += counter.ops;
+
+	return total ? elapsed / total : 0.0;
+}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+	int time_ms{200};
+	int max_threads{64};
+	const char* only{nullptr};
+	const char* csv_path{nullptr};
+	const char* label{""};
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (!strcmp(argv[i], "--time") && i + 1 < argc)
+			time_ms = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+			max_threads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--scenario") && i + 1 < argc)
+			only = argv[++i];
+		else if (!strcmp(argv[i], "--csv") && i + 1 < argc)
+			csv_path = argv[++i];
+		else if (!strcmp(argv[i], "--label") && i + 1 < argc)
+			label = argv[++i];
+#if defined(ENABLE_DREADLOCK)
+		else if (!strcmp(argv[i], "--sample") && i + 1 < argc)
+		{
+			auto one_in{static_cast<uint32_t>(atoi(argv[++i]))};
+			uint32_t hot_threshold{0};
+			if (i + 1 < argc && argv[i + 1][0] != '-')
+				hot_threshold = static_cast<uint32_t>(atoi(argv[++i]));
+			Dreadlock::set_sampling(one_in, hot_threshold);
+		}
+#endif
+		else
+		{
+			fprintf(stderr, "usage: %s [--time ms] [--threads max] [--scenario name] [--sample one_in [hot_threshold]] [--csv path] [--label name]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	FILE* csv{nullptr};
+	if (csv_path)
+	{
+		csv = fopen(csv_path, "a");
+		if (!csv)
+		{
+			fprintf(stderr, "can't open %s\n", csv_path);
+			return 1;
+		}
+		if (ftell(csv) == 0)
+			fprintf(csv, "label,scenario,threads,unique_lock_ns,dreadlock_ns,overhead\n");
+	}
+
+#if !defined(ENABLE_DREADLOCK)
+	printf("(built without ENABLE_DREADLOCK: both columns are std::unique_lock)\n");
+#endif
+	printf("%-12s %7s %14s %10s %14s %10s %9s\n", "scenario", "threads", "unique_lock", "Mops/s", "dreadlock", "Mops/s", "overhead");
+
+	for (const auto& scenario : scenarios)
+	{
+		if (only && strcmp(only, scenario.name))
+			continue;
+
+		for (int threads = 1; threads <= max_threads; threads *= 2)
+		{
+			auto bare{measure(scenario.bare, threads, time_ms)};
+			auto instrumented{measure(scenario.instrumented, threads, time_ms)};
+
+			printf("%-12s %7d %11.1fns %10.2f %11.1fns %10.2f %8.2fx\n",
+				   scenario.name,
+				   threads,
+				   bare,
+				   bare ? 1000.0 / bare : 0.0,
+				   instrumented,
+				   instrumented ? 1000.0 / instrumented : 0.0,
+				   bare ? instrumented / bare : 0.0);
+			fflush(stdout);
+
+			if (csv)
+				fprintf(csv, "%s,%s,%d,%.1f,%.1f,%.2f\n", label, scenario.name, threads, bare, instrumented, bare ? instrumented / bare : 0.0);
+		}
+	}
+
+	if (csv)
+		fclose(csv);
+
+	return 0;
+}
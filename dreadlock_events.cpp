@@ -0,0 +1,410 @@
+// Reads the binary event log written by a process that called
+// Dreadlock::set_event_log() (or set DREADLOCK_EVENT_LOG), after it
+// crashed, hung or asserted on a deadlock: it merges the threads'
+// rings into one timeline, replays it to work out who held and waited
+// for what, and prints the last events, the locks held and waited for,
+// and any cycle of waits, as they stood at the first deadlock verdict
+// (or at the end of the log):
+//
+//   g++ -std=c++17 -O2 -DENABLE_DREADLOCK dreadlock_events.cpp -o dreadlock_events
+//   ./dreadlock_events [--last events] [--to-end] path
+//
+// The log records its own capacities, so the tool needn't be built
+// with the program's DREADLOCK_EVENT_LOG_* settings.  It exits with 2
+// when it finds a cycle.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Dreadlock.h"
+
+namespace
+{
+struct Log
+{
+	DreadlockEventLogHeader* header;
+	size_t size;
+
+	const char* text(uint32_t offset, const char* unknown = "?") const
+	{
+		auto used{std::min(header->strings_used.load(std::memory_order_relaxed), header->string_capacity)};
+		if (!offset || offset > used)
+			return unknown;
+
+		// the text may have been cut short by a crash while it was written
+		auto text{header->strings() + offset - 1};
+		return memchr(text, 0, used - (offset - 1)) ? text : unknown;
+	}
+};
+
+struct Hold
+{
+	uint32_t thread;
+	uint32_t depth; // a recursive mutex's re-locks by the same thread
+	int64_t since;
+	uint32_t name;
+	uint32_t site;
+};
+
+struct Wait
+{
+	uint64_t mutex;
+	int64_t since;
+	uint32_t name;
+	uint32_t site;
+};
+
+// what the replay has found, as of some point in the timeline
+struct State
+{
+	std::map<uint64_t, Hold> owners;
+	std::map<uint64_t, std::vector<Hold>> readers;
+	std::map<uint32_t, Wait> waits;
+};
+
+void format_duration(char* buffer, size_t size, int64_t ns)
+{
+	if (ns < 1000000)
+		snprintf(buffer, size, "%.1fus", ns / 1000.0);
+	else if (ns < 1000000000)
+		snprintf(buffer, size, "%.1fms", ns / 1000000.0);
+	else
+		snprintf(buffer, size, "%.2fs", ns / 1000000000.0);
+}
+
+// the wall time of an event, from the clocks the log started with
+void format_time(char* buffer, size_t size, const Log& log, int64_t time, bool date = false)
+{
+	auto wall{log.header->system_start + (time - log.header->clock_start)};
+	auto seconds{static_cast<time_t>(wall / 1000000000)};
+	struct tm local;
+	localtime_r(&seconds, &local);
+
+	char whole[32];
+	strftime(whole, sizeof(whole), date ? "%Y-%m-%d %H:%M:%S" : "%H:%M:%S", &local);
+	snprintf(buffer, size, "%s.%06d", whole, static_cast<int>(wall % 1000000000 / 1000));
+}
+
+void apply(State& state, const DreadlockEvent& event)
+{
+	switch (event.kind)
+	{
+	case DreadlockEvent::Waiting:
+		state.waits[event.thread] = Wait{event.mutex, event.time, event.name, event.site};
+		break;
+
+	case DreadlockEvent::Acquired:
+		state.waits.erase(event.thread);
+		if (event.shared)
+			state.readers[event.mutex].push_back(Hold{event.thread, 1, event.time, event.name, event.site});
+		else
+		{
+			auto found{state.owners.find(event.mutex)};
+			if (found != state.owners.end() && found->second.thread == event.thread)
+				++found->second.depth;
+			else
+				state.owners[event.mutex] = Hold{event.thread, 1, event.time, event.name, event.site};
+		}
+		break;
+
+	case DreadlockEvent::Released:
+		// the acquisition may have come before the ring's oldest event
+		if (event.shared)
+		{
+			auto& readers{state.readers[event.mutex]};
+			auto found{std::find_if(readers.begin(), readers.end(), [&](const Hold& hold) { return hold.thread == event.thread; })};
+			if (found != readers.end())
+				readers.erase(found);
+		}
+		else
+		{
+			auto found{state.owners.find(event.mutex)};
+			if (found != state.owners.end() && found->second.thread == event.thread && !--found->second.depth)
+				state.owners.erase(found);
+		}
+		break;
+
+	case DreadlockEvent::Deadlocked:
+		state.waits.erase(event.thread);
+		break;
+
+	case DreadlockEvent::ThreadExited:
+		state.waits.erase(event.thread);
+		break;
+	}
+}
+
+void print_event(const Log& log, const DreadlockEvent& event)
+{
+	char time[32];
+	format_time(time, sizeof(time), log, event.time);
+
+	auto what{""};
+	switch (event.kind)
+	{
+	case DreadlockEvent::Waiting: what = event.shared ? "waits to share" : "waits for"; break;
+	case DreadlockEvent::Acquired: what = event.shared ? "shares" : "acquires"; break;
+	case DreadlockEvent::Released: what = "releases"; break;
+	case DreadlockEvent::Deadlocked: what = "gives up waiting, deadlocked, for"; break;
+	case DreadlockEvent::ThreadStarted: printf("  %s  thread %u starts\n", time, event.thread); return;
+	case DreadlockEvent::ThreadExited: printf("  %s  thread %u exits\n", time, event.thread); return;
+	default: printf("  %s  thread %u: an event of unknown kind %u\n", time, event.thread, event.kind); return;
+	}
+
+	printf("  %s  thread %u %s %s (%#llx)%s module %s\n",
+		   time,
+		   event.thread,
+		   what,
+		   log.text(event.name),
+		   static_cast<unsigned long long>(event.mutex),
+		   event.kind == DreadlockEvent::Released ? ", locked in" : " in",
+		   log.text(event.site));
+}
+
+// prints the state, returning the number of cycles of waits in it
+int print_state(const Log& log, const State& state, int64_t now)
+{
+	char duration[16];
+
+	std::vector<uint32_t> threads;
+	for (const auto& owner : state.owners)
+		threads.push_back(owner.second.thread);
+	for (const auto& readers : state.readers)
+	{
+		for (const auto& reader : readers.second)
+			threads.push_back(reader.thread);
+	}
+	for (const auto& wait : state.waits)
+		threads.push_back(wait.first);
+	std::sort(threads.begin(), threads.end());
+	threads.erase(std::unique(threads.begin(), threads.end()), threads.end());
+
+	if (threads.empty())
+		printf("   nothing held or waited for\n");
+
+	for (auto thread : threads)
+	{
+		for (const auto& owner : state.owners)
+		{
+			if (owner.second.thread != thread)
+				continue;
+
+			format_duration(duration, sizeof(duration), now - owner.second.since);
+			printf("   thread %u holds %s, locked in module %s (%s)\n", thread, log.text(owner.second.name), log.text(owner.second.site), duration);
+		}
+
+		for (const auto& readers : state.readers)
+		{
+			for (const auto& reader : readers.second)
+			{
+				if (reader.thread != thread)
+					continue;
+
+				format_duration(duration, sizeof(duration), now - reader.since);
+				printf("   thread %u shares %s, locked in module %s (%s)\n", thread, log.text(reader.name), log.text(reader.site), duration);
+			}
+		}
+
+		auto wait{state.waits.find(thread)};
+		if (wait == state.waits.end())
+			continue;
+
+		format_duration(duration, sizeof(duration), now - wait->second.since);
+		printf("   thread %u waits for %s in module %s (%s)", thread, log.text(wait->second.name), log.text(wait->second.site), duration);
+
+		auto owner{state.owners.find(wait->second.mutex)};
+		auto readers{state.readers.find(wait->second.mutex)};
+		if (owner != state.owners.end())
+			printf("; held by thread %u\n", owner->second.thread);
+		else if (readers != state.readers.end() && !readers->second.empty())
+			printf("; held shared by %u threads\n", static_cast<unsigned>(readers->second.size()));
+		else
+			printf("\n");
+	}
+
+	// every thread waits for at most one mutex, which has at most one
+	// exclusive owner, so the waits form chains, and a chain that comes
+	// back to its first thread is a cycle, printed from its lowest one
+	int cycles{0};
+	for (const auto& start : state.waits)
+	{
+		std::vector<uint32_t> chain;
+		auto thread{start.first};
+		bool found{false};
+		for (;;)
+		{
+			chain.push_back(thread);
+			auto wait{state.waits.find(thread)};
+			auto owner{wait == state.waits.end() ? state.owners.end() : state.owners.find(wait->second.mutex)};
+			if (owner == state.owners.end())
+				break;
+
+			thread = owner->second.thread;
+			if (thread == start.first)
+			{
+				found = true;
+				break;
+			}
+			if (std::find(chain.begin(), chain.end(), thread) != chain.end())
+				break;
+		}
+
+		if (!found || *std::min_element(chain.begin(), chain.end()) != start.first)
+			continue;
+
+		if (!cycles++)
+			printf("Cycles of waits:\n");
+
+		printf("  ");
+		for (auto member : chain)
+			printf(" thread %u waits for %s ->", member, log.text(state.waits.find(member)->second.name));
+		printf(" thread %u\n", start.first);
+	}
+
+	if (!cycles)
+		printf("No cycles of waits\n");
+
+	return cycles;
+}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+	int last{40};
+	bool to_end{false};
+	const char* path{nullptr};
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (!strcmp(argv[i], "--last") && i + 1 < argc)
+			last = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--to-end"))
+			to_end = true;
+		else if (argv[i][0] != '-' && !path)
+			path = argv[i];
+		else
+		{
+			path = nullptr;
+			break;
+		}
+	}
+
+	if (!path)
+	{
+		fprintf(stderr, "usage: %s [--last events] [--to-end] path\n", argv[0]);
+		return 1;
+	}
+
+	auto fd{open(path, O_RDONLY)};
+	struct stat info;
+	if (fd < 0 || fstat(fd, &info))
+	{
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	if (static_cast<size_t>(info.st_size) < sizeof(DreadlockEventLogHeader))
+	{
+		fprintf(stderr, "%s: not an event log\n", path);
+		return 1;
+	}
+
+	auto memory{mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_SHARED, fd, 0)};
+	close(fd);
+	if (memory == MAP_FAILED)
+	{
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	Log log{static_cast<DreadlockEventLogHeader*>(memory), static_cast<size_t>(info.st_size)};
+	auto header{log.header};
+	if (memcmp(header->magic, "DREADEV", sizeof(header->magic)))
+	{
+		fprintf(stderr, "%s: not an event log\n", path);
+		return 1;
+	}
+
+	if (header->version != DreadlockEventLogHeader::CurrentVersion ||
+		header->event_size != sizeof(DreadlockEvent) ||
+		!header->event_capacity || (header->event_capacity & (header->event_capacity - 1)) ||
+		log.size < DreadlockEventLogHeader::size_for(header->string_capacity, header->ring_capacity, header->event_capacity))
+	{
+		fprintf(stderr, "%s: an event log of a version this tool doesn't read\n", path);
+		return 1;
+	}
+
+	// each ring holds its thread's last events, oldest first from the
+	// head.  until every thread's ring is back in view, a wrapped ring
+	// may have lost events the others' refer to.
+	std::vector<DreadlockEvent> events;
+	int64_t complete_from{0};
+	auto rings{std::min(header->rings_used.load(std::memory_order_relaxed), header->ring_capacity)};
+	for (uint32_t i = 0; i < rings; ++i)
+	{
+		auto ring{header->ring(i)};
+		auto head{ring->head.load(std::memory_order_acquire)};
+		auto count{std::min<uint64_t>(head, header->event_capacity)};
+		auto ring_events{header->events(ring)};
+		for (auto n = head - count; n < head; ++n)
+			events.push_back(ring_events[n & (header->event_capacity - 1)]);
+
+		if (head > header->event_capacity && count)
+			complete_from = std::max(complete_from, events[events.size() - count].time);
+	}
+
+	std::stable_sort(events.begin(), events.end(), [](const DreadlockEvent& a, const DreadlockEvent& b) { return a.time < b.time; });
+
+	char time[48];
+	format_time(time, sizeof(time), log, header->clock_start, true);
+	printf("Event log %s: process %u, started %s, %u threads, %u events\n", path, header->pid, time, rings, static_cast<unsigned>(events.size()));
+	if (rings == header->ring_capacity)
+		printf("Every ring is in use, so later threads may be missing (see DREADLOCK_EVENT_LOG_THREADS)\n");
+	if (complete_from)
+	{
+		format_time(time, sizeof(time), log, complete_from);
+		printf("Every thread's history is complete from %s; what was held before then may be missing\n", time);
+	}
+
+	// the replay stops just before the first deadlock verdict, where
+	// the waits that made it are still in place
+	auto end{events.end()};
+	if (!to_end)
+	{
+		end = std::find_if(events.begin(), events.end(), [](const DreadlockEvent& event) { return event.kind == DreadlockEvent::Deadlocked; });
+		if (end == events.end())
+			to_end = true;
+	}
+
+	State state;
+	for (auto event = events.begin(); event != end; ++event)
+		apply(state, *event);
+
+	auto shown_end{to_end ? end : end + 1};
+	auto shown{std::min<size_t>(static_cast<size_t>(std::max(last, 0)), static_cast<size_t>(shown_end - events.begin()))};
+	if (shown)
+	{
+		printf("The last %u events%s:\n", static_cast<unsigned>(shown), to_end ? "" : ", up to the first deadlock");
+		for (auto event = shown_end - shown; event != shown_end; ++event)
+			print_event(log, *event);
+	}
+
+	auto now{events.empty() ? header->clock_start : (to_end ? events.back().time : end->time)};
+	format_time(time, sizeof(time), log, now);
+	printf("%s (%s):\n", to_end ? "At the end of the log" : "At the first deadlock", time);
+
+	auto cycles{print_state(log, state, now)};
+	fflush(stdout);
+	return cycles ? 2 : 0;
+}
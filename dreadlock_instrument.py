@@ -2,9 +2,13 @@ import os
 import re
 import sys
 import glob
+import json
+import hashlib
 import tempfile
 import subprocess
 
+from concurrent.futures import ProcessPoolExecutor
+
 from ast import parse
 from optparse import OptionParser
 
@@ -428,6 +432,147 @@ def instrument(lines, scopes, options):
 
     return new_lines, changed
 
+def content_hash(data, *salt):
+    # everything that can change a result goes into its key
+    digest = hashlib.sha1(data)
+    for item in salt:
+        digest.update(b'\0' + repr(item).encode('utf-8'))
+    return digest.hexdigest()
+
+def cached_scopes(module, data, options):
+    # scope maps are keyed on the module's content (and whether it went
+    # through clang-format), so a module that hasn't changed since the
+    # last run isn't mapped again
+    cache_file = None
+    if options.cache_dir:
+        key = content_hash(data, options.sanitize_input)
+        cache_file = os.path.join(options.cache_dir, f'{key}.scopes')
+        if os.path.exists(cache_file):
+            try:
+                with open(cache_file) as f:
+                    entry = json.load(f)
+                return entry['lines'], entry['scopes']
+            except (OSError, ValueError, KeyError):
+                pass  # a damaged entry is simply replaced
+
+    file_lines = []
+    scopes = map_scopes(module, file_lines, options)
+
+    if cache_file:
+        # written under a temporary name first, so a concurrent run
+        # never sees half an entry
+        handle, temp_name = tempfile.mkstemp(dir=options.cache_dir)
+        with os.fdopen(handle, "w") as f:
+            json.dump({'lines': file_lines, 'scopes': scopes}, f)
+        os.replace(temp_name, cache_file)
+
+    return file_lines, scopes
+
+def apply_module(module, options):
+    # instruments one module, returning what it has to say rather than
+    # printing it, so parallel jobs don't interleave their output
+    output = []
+
+    with open(module, 'rb') as f:
+        data = f.read()
+
+    # a module that came through unmodified last time, with the same
+    # options, will again
+    unchanged_file = None
+    if options.cache_dir and not options.debug:
+        key = content_hash(data, options.sanitize_input, options.indent, options.align, options.disable_revert, sorted(options.excludes))
+        unchanged_file = os.path.join(options.cache_dir, f'{key}.unchanged')
+        if os.path.exists(unchanged_file):
+            if options.overwrite:
+                output.append(f"Instrumenting '{module}' ... file was not modified (cached).")
+            else:
+                output.append(" file was not modified (cached).")
+            return '\n'.join(output)
+
+    file_lines, scopes = cached_scopes(module, data, options)
+    if options.debug:
+        for i in range(len(scopes)):
+            s = "{}: {}".format(i, scopes[i])
+            s += ' ' * (20 - len(s))
+            if len(scopes[i]):
+                s += '!> {}'.format(file_lines[i])
+            else:
+                s += '-> {}'.format(file_lines[i])
+            output.append(s)
+        return '\n'.join(output)
+
+    progress = ''
+    if options.overwrite:
+        progress = f"Instrumenting '{module}' ..."
+
+    new_lines, changed = instrument(file_lines, scopes, options)
+    if changed:
+        if not options.dry_run:
+            if not options.overwrite:
+                output.append('\n'.join(new_lines))
+            else:
+                with open(module, 'w') as f:
+                    f.write('\n'.join(new_lines))
+
+                    # always terminate a file with a newline.
+                    # the universe will thank you...
+                    if not new_lines[-1].endswith('\n'):
+                        f.write('\n')
+
+        output.append(progress + " done.")
+    else:
+        if unchanged_file:
+            open(unchanged_file, 'w').close()
+        output.append(progress + " file was not modified.")
+
+    return '\n'.join(output)
+
+def revert_module(module, options):
+    dreadlock_include_re = r'\s*#include\s*"Dreadlock\.h"' # no capture
+    changed = False
+    new_lines = []
+    reverts_found = 0
+    output = []
+
+    with open(module) as f:
+        for line in f:
+            result = re.search(dreadlock_include_re, line)
+            if result == None:
+                line = line.rstrip()
+                if 'DREADLOCK' in line:
+                    dreadlock_ndx = line.find('DREADLOCK')
+
+                    if '{{' in line:
+                        changed = True
+                        reverts_found += 1
+
+                        original_start_ndx = line.find('{{')
+                        original_end_ndx = line.find('}}')
+
+                        line = line[original_start_ndx+2:original_end_ndx]
+                        new_lines.append(line)
+                    else:
+                        pass  # we don't capture this line (it was automatically added)
+                else:
+                    new_lines.append(line)
+
+    if changed:
+        if not options.dry_run:
+            if not options.overwrite:
+                output.append('\n'.join(new_lines))
+            else:
+                with open(module, 'w') as f:
+                    f.write('\n'.join(new_lines))
+    else:
+        output.append(f"No revert markers were found in '{module}'! (Did you explicitly disable revert for this file?)")
+
+    return '\n'.join(output)
+
+def process_module(module, options):
+    if options.apply:
+        return apply_module(module, options)
+    return revert_module(module, options)
+
 if __name__ == "__main__":
     print('Dreadlock Instrument -- infuse C++ modules with dread of mutex deadlocks.')
     print('by Bob Hood\n')
@@ -444,6 +589,9 @@ if __name__ == "__main__":
     parser.add_option("-x", "--exclude", action="append", dest="excludes", default=[], help="Exclude specific mutex declarations or modules from Dreadlock instrumentation.")
     parser.add_option("-A", "--align", action="store_true", dest="align", default=False, help="Align additions to previous indents, if possible; use scope level otherwise.")
     parser.add_option("-D", "--dry-run", action="store_true", dest="dry_run", default=False, help="Perform all processing, but do not generate output.")
+    parser.add_option("-j", "--jobs", action="store", type="int", dest="jobs", default=1, help="Process this many modules at once (0 for one per CPU).")
+    parser.add_option("-c", "--cache", action="store", dest="cache_dir", default=os.path.join(tempfile.gettempdir(), 'dreadlock_cache'), help="Directory of cached scope maps, keyed on module content.")
+    parser.add_option("-C", "--no-cache", action="store_const", const=None, dest="cache_dir", help="Neither use nor update the scope map cache.")
     #parser.add_option("-D", "--destruct", action="store_true", dest="destruct", default=False, help="Add Dreadlock destruct tracking for each instrumented mutex.")
     (options, args) = parser.parse_args()
 
@@ -462,6 +610,12 @@ if __name__ == "__main__":
             else:
                 options.clangformat = 'clang-format'
 
+    if options.cache_dir:
+        os.makedirs(options.cache_dir, exist_ok=True)
+
+    if options.jobs <= 0:
+        options.jobs = os.cpu_count() or 1
+
     new_excludes = []
     for exclude in options.excludes:
         if os.path.exists(exclude):
@@ -482,6 +636,7 @@ if __name__ == "__main__":
         print("No files specified!  Nothing to do!", file=sys.stderr)
         sys.exit(1)
 
+    selected = []
     for module in modules:
         assert os.path.exists(module), f"File '{module}' does not exist!"
 
@@ -498,76 +653,24 @@ if __name__ == "__main__":
             print(f"Excluding file '{module}'.")
             continue
 
-        if options.apply:
-            file_lines = []
-            scopes = map_scopes(module, file_lines, options)
-            if options.debug:
-                for i in range(len(scopes)):
-                    s = "{}: {}".format(i, scopes[i])
-                    s += ' ' * (20 - len(s))
-                    if len(scopes[i]):
-                        s += '!> {}'.format(file_lines[i])
-                    else:
-                        s += '-> {}'.format(file_lines[i])
-                    print(s)
-                sys.exit(0)
-
-            if options.overwrite:
-                print(f"Instrumenting '{module}' ...", end='')
+        selected.append(module)
+
+    if options.debug:
+        # the scope map of the first module is all we show
+        if len(selected):
+            print(process_module(selected[0], options))
+        sys.exit(0)
+
+    if options.jobs == 1 or len(selected) < 2:
+        for module in selected:
+            result = process_module(module, options)
+            if len(result):
+                print(result)
+            sys.stdout.flush()
+    else:
+        # results come back in module order, as each one is ready
+        with ProcessPoolExecutor(max_workers=options.jobs) as pool:
+            for result in pool.map(process_module, selected, [options] * len(selected), chunksize=4):
+                if len(result):
+                    print(result)
                 sys.stdout.flush()
-
-            new_lines, changed = instrument(file_lines, scopes, options)
-            if changed:
-                if not options.dry_run:
-                    if not options.overwrite:
-                        print('\n'.join(new_lines))
-                    else:
-                        with open(module, 'w') as f:
-                            f.write('\n'.join(new_lines))
-
-                            # always terminate a file with a newline.
-                            # the universe will thank you...
-                            if not new_lines[-1].endswith('\n'):
-                                f.write('\n')
-
-                print(" done.")
-            else:
-                print(" file was not modified.")
-
-        elif options.revert:
-            dreadlock_include_re = r'\s*#include\s*"Dreadlock\.h"' # no capture
-            changed = False
-            new_lines = []
-            reverts_found = 0
-
-            with open(module) as f:
-                for line in f:
-                    result = re.search(dreadlock_include_re, line)
-                    if result == None:
-                        line = line.rstrip()
-                        if 'DREADLOCK' in line:
-                            dreadlock_ndx = line.find('DREADLOCK')
-
-                            if '{{' in line:
-                                changed = True
-                                reverts_found += 1
-
-                                original_start_ndx = line.find('{{')
-                                original_end_ndx = line.find('}}')
-
-                                line = line[original_start_ndx+2:original_end_ndx]
-                                new_lines.append(line)
-                            else:
-                                pass  # we don't capture this line (it was automatically added)
-                        else:
-                            new_lines.append(line)
-
-            if changed:
-                if not options.dry_run:
-                    if not options.overwrite:
-                        print('\n'.join(new_lines))
-                    else:
-                        with open(module, 'w') as f:
-                            f.write('\n'.join(new_lines))
-            else:
-                print(f"No revert markers were found in '{module}'! (Did you explicitly disable revert for this file?)")
@@ -0,0 +1,544 @@
+// Reproduces the bugs Dreadlock is meant to catch, over and over, with
+// the scheduling shaken up around every lock and unlock (see
+// Dreadlock::set_perturbation()), and measures how each detection mode
+// copes with them:
+//
+//   g++ -std=c++17 -O2 -DENABLE_DREADLOCK -DNDEBUG dreadlock_stress.cpp Dreadlock.cpp -pthread -o dreadlock_stress
+//   ./dreadlock_stress [--trials n] [--seed n] [--perturb max_us] [--timeout ms] [--threads n]
+//                      [--scenario name] [--mode name] [--csv path] [--label name]
+//
+// Every scenario comes in two versions: one with the bug, which has to
+// be reported (the threads meet at a barrier before closing a cycle, so
+// a deadlock forms every time), and one without it, which mustn't
+// raise the same report (a false positive).  Reports of other kinds,
+// such as the performance warnings a busy mutex earns while a
+// deadlock is being waited out, don't count either way.
+// Each trial runs in a process of its own, so Dreadlock starts from
+// scratch (the lock order and the reports it has already made are
+// remembered for the life of a process), and a trial that hangs can be
+// killed.  The time to detect runs from the moment the bug is in place
+// (the last thread of a cycle going for its second mutex, say) until
+// the report has been raised.
+//
+// Trial n of a run uses the seed given plus n, and the seed of any
+// trial that went wrong is printed, so it can be run again on its own
+// with --seed and --trials 1.  The exit status is 2 if any trial went
+// wrong.  --csv appends the results to a file, labelled with --label,
+// to be compared from build to build along with dreadlock_bench's.
+//
+// POSIX only (each trial is a fork()ed child).
+
+#if !defined(ENABLE_DREADLOCK) || !defined(NDEBUG)
+#error "dreadlock_stress has to be built with ENABLE_DREADLOCK and NDEBUG (Dreadlock asserts on the bugs it reproduces)"
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "Dreadlock.h"
+
+namespace
+{
+const int MaxThreads = 16; // for the "cycle" scenario
+const int Rounds = 100;	   // for the versions without the bug
+
+int timeout_ms{100}; // the deadlock timeout; the other timeouts are scaled to it
+int cycle_threads{4};
+
+std::mutex mutexes[MaxThreads];
+
+int64_t now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// when the bug was put in place; for a cycle, the last thread to go
+// for its second mutex sets it
+std::atomic<int64_t> triggered{0};
+
+void trigger()
+{
+	auto at{now()};
+	auto current{triggered.load(std::memory_order_relaxed)};
+	while (current < at && !triggered.compare_exchange_weak(current, at, std::memory_order_relaxed))
+		;
+}
+
+// holds each thread back until all 'count' of them have arrived
+struct Barrier
+{
+	std::atomic<int> arrived{0};
+
+	void wait(int count)
+	{
+		arrived.fetch_add(1, std::memory_order_acq_rel);
+		while (arrived.load(std::memory_order_acquire) < count)
+			std::this_thread::yield();
+	}
+};
+
+void run_threads(int count, void (*body)(int, bool, Barrier&), bool buggy)
+{
+	Barrier barrier;
+	std::vector<std::thread> threads;
+	for (int i = 0; i < count; ++i)
+		threads.emplace_back(body, i, buggy, std::ref(barrier));
+	for (auto& thread : threads)
+		thread.join();
+}
+
+// two threads lock the same two mutexes, in opposite orders (AB/BA)
+void inversion_thread(int thread, bool buggy, Barrier& barrier)
+{
+	auto& a{mutexes[0]};
+	auto& b{mutexes[1]};
+
+	for (int round = 0; round < (buggy ? 1 : Rounds); ++round)
+	{
+		auto& first{(buggy && thread) ? b : a};
+		auto& second{(buggy && thread) ? a : b};
+
+		DREADLOCK_ID(first, first);
+		if (buggy)
+		{
+			barrier.wait(2);
+			trigger();
+		}
+		DREADLOCK_ID(second, second);
+	}
+}
+
+void inversion(bool buggy)
+{
+	run_threads(2, inversion_thread, buggy);
+}
+
+// each thread locks its own mutex, then its neighbour's, so the threads
+// form a ring; the fixed version always locks the lower one first
+void cycle_thread(int thread, bool buggy, Barrier& barrier)
+{
+	auto own{thread};
+	auto next{(thread + 1) % cycle_threads};
+
+	for (int round = 0; round < (buggy ? 1 : Rounds); ++round)
+	{
+		auto& first{mutexes[buggy ? own : std::min(own, next)]};
+		auto& second{mutexes[buggy ? next : std::max(own, next)]};
+
+		DREADLOCK_ID(first, first);
+		if (buggy)
+		{
+			barrier.wait(cycle_threads);
+			trigger();
+		}
+		DREADLOCK_ID(second, second);
+	}
+}
+
+void cycle(bool buggy)
+{
+	run_threads(cycle_threads, cycle_thread, buggy);
+}
+
+// a thread locks a mutex it already holds
+void relock(bool buggy)
+{
+	auto& m{mutexes[0]};
+
+	for (int round = 0; round < (buggy ? 1 : Rounds); ++round)
+	{
+		DREADLOCK_ID(m, held);
+		if (!buggy)
+			DREADLOCK_UNLOCK_ID(m, held);
+
+		trigger();
+		DREADLOCK_ID(m, again);
+	}
+}
+
+// a thread unlocks a mutex another thread locked
+void foreign(bool buggy)
+{
+	auto& m{mutexes[0]};
+	std::atomic<int> step{0};
+
+	DREADLOCK_ID(m, held);
+
+	std::thread other([&] {
+		if (buggy)
+		{
+			trigger();
+			DREADLOCK_UNLOCK_ID(m, held);
+		}
+		step.store(1, std::memory_order_release);
+	});
+
+	while (!step.load(std::memory_order_acquire))
+		std::this_thread::yield();
+	DREADLOCK_UNLOCK_ID(m, held);
+
+	other.join();
+}
+
+// a thread holds a mutex past the performance timeout while another
+// waits for it; the fixed version lets go well within it
+void long_hold(bool buggy)
+{
+	auto& m{mutexes[0]};
+	std::atomic<bool> holding{false};
+	auto hold{std::chrono::milliseconds(buggy ? timeout_ms / 2 : timeout_ms / 16)};
+
+	std::thread holder([&] {
+		DREADLOCK_ID(m, held);
+		holding.store(true, std::memory_order_release);
+		std::this_thread::sleep_for(hold);
+	});
+
+	while (!holding.load(std::memory_order_acquire))
+		std::this_thread::yield();
+
+	if (buggy)
+		trigger();
+	{
+		DREADLOCK_ID(m, waited);
+	}
+
+	holder.join();
+}
+
+struct Scenario
+{
+	const char* name;
+	void (*run)(bool buggy);
+	const char* reported;			 // the report the buggy version has to raise
+	const char* reported_lock_order; // ...with lock-order checking, if it's different
+	const char* reported_sampled;	 // ...when sampling, if it's different ("" if sampling can't see it)
+};
+
+// an untracked (sampled out) first lock is invisible, so a relock just
+// waits for itself, and a foreign unlock goes unnoticed
+const Scenario scenarios[] = {
+	{"inversion", inversion, "Deadlock detected", "Potential deadlock", nullptr},
+	{"cycle", cycle, "Deadlock detected", "Potential deadlock", nullptr},
+	{"relock", relock, "Illegal lock", nullptr, "Deadlock detected"},
+	{"foreign", foreign, "by a thread that didn't lock it", nullptr, ""},
+	{"long-hold", long_hold, "longer than", nullptr, nullptr},
+};
+
+struct Mode
+{
+	const char* name;
+	bool blocking_wait;
+	bool watch_waits;
+	bool detect_lock_order;
+	bool sampled; // tracks only the acquisitions that have to wait (see Dreadlock::set_sampling())
+};
+
+const Mode modes[] = {
+	{"poll", false, false, false, false},
+	{"blocking", true, false, false, false},
+	{"watchdog", true, true, false, false},
+	{"watch-poll", false, true, false, false},
+	{"lock-order", false, false, true, false},
+	{"sampled", true, false, false, true},
+};
+
+// the report a scenario's bug raises in a mode, or nullptr if the mode
+// can't see it
+const char* expected_report(const Scenario& scenario, const Mode& mode)
+{
+	if (mode.detect_lock_order && scenario.reported_lock_order)
+		return scenario.reported_lock_order;
+	if (mode.sampled && scenario.reported_sampled)
+		return *scenario.reported_sampled ? scenario.reported_sampled : nullptr;
+	return scenario.reported;
+}
+
+// what a trial sends back to the harness
+struct Outcome
+{
+	int64_t latency{-1}; // nanoseconds from the trigger to the first report
+	int reports{0};
+};
+
+// runs one version of a scenario in this (child) process, counting
+// the reports it was expected to raise in Dreadlock's output
+Outcome run_trial(const Scenario& scenario, const Mode& mode, bool buggy, uint32_t seed, int perturb_us, const char* output)
+{
+	auto settings{Dreadlock::settings()};
+	settings.assert_on_deadlock = false;
+	settings.deadlock_timeout = timeout_ms;
+	settings.performance_timeout = timeout_ms / 4;
+	settings.watchdog_interval = std::max(1, timeout_ms / 20);
+	settings.blocking_wait = mode.blocking_wait;
+	settings.watch_waits = mode.watch_waits;
+	settings.detect_lock_order = mode.detect_lock_order;
+	Dreadlock::configure(settings);
+	Dreadlock::set_sampling(mode.sampled ? 0 : 1);
+	Dreadlock::set_output(Dreadlock::OutputFile, output);
+	Dreadlock::set_perturbation(perturb_us, seed);
+
+	auto expected{expected_report(scenario, mode)};
+
+	Outcome outcome;
+	std::atomic<bool> finished{false};
+
+	std::thread monitor([&] {
+		auto file{fopen(output, "r")};
+		char line[1024];
+
+		for (bool last = false; !last;)
+		{
+			last = finished.load(std::memory_order_acquire);
+			Dreadlock::flush();
+			auto seen{now()};
+
+			while (file && fgets(line, sizeof(line), file))
+			{
+				if (strncmp(line, "[[ Dreadlock ]]", 15) || !strstr(line, expected))
+					continue;
+				if (!outcome.reports++)
+					outcome.latency = seen - triggered.load(std::memory_order_relaxed);
+			}
+			if (file)
+				clearerr(file);
+
+			if (!last)
+				std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
+
+		if (file)
+			fclose(file);
+	});
+
+	scenario.run(buggy);
+
+	Dreadlock::set_perturbation(0);
+	finished.store(true, std::memory_order_release);
+	monitor.join();
+
+	return outcome;
+}
+
+enum class Result
+{
+	Passed,
+	Missed, // the bug went unreported
+	FalsePositive, // the fixed version was reported
+	Hung,
+	Crashed,
+};
+
+// runs a trial in a child process, giving up on it after 'limit_ms'
+Result fork_trial(const Scenario& scenario, const Mode& mode, bool buggy, uint32_t seed, int perturb_us, int limit_ms, int64_t& latency)
+{
+	char output[] = "/tmp/dreadlock_stress_XXXXXX";
+	auto output_fd{mkstemp(output)};
+	if (output_fd < 0)
+		return Result::Crashed;
+	close(output_fd);
+
+	int fds[2];
+	if (pipe(fds))
+	{
+		unlink(output);
+		return Result::Crashed;
+	}
+
+	fflush(stdout);
+	auto child{fork()};
+	if (child < 0)
+	{
+		close(fds[0]);
+		close(fds[1]);
+		unlink(output);
+		return Result::Crashed;
+	}
+	if (child == 0)
+	{
+		close(fds[0]);
+		auto outcome{run_trial(scenario, mode, buggy, seed, perturb_us, output)};
+		auto written{write(fds[1], &outcome, sizeof(outcome))};
+		_exit(written == sizeof(outcome) ? 0 : 1);
+	}
+	close(fds[1]);
+
+	Outcome outcome;
+	auto result{Result::Crashed};
+
+	pollfd ready{fds[0], POLLIN, 0};
+	if (poll(&ready, 1, limit_ms) <= 0)
+	{
+		kill(child, SIGKILL);
+		result = Result::Hung;
+	}
+	else if (read(fds[0], &outcome, sizeof(outcome)) == sizeof(outcome))
+	{
+		if (buggy)
+			result = outcome.reports ? Result::Passed : Result::Missed;
+		else
+			result = outcome.reports ? Result::FalsePositive : Result::Passed;
+		latency = outcome.latency;
+	}
+
+	close(fds[0]);
+	waitpid(child, nullptr, 0);
+	unlink(output);
+
+	return result;
+}
+
+double percentile(std::vector<int64_t>& values, int percent)
+{
+	if (values.empty())
+		return 0.0;
+	std::sort(values.begin(), values.end());
+	auto index{std::min(values.size() - 1, values.size() * percent / 100)};
+	return values[index] / 1e6;
+}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+	int trials{20};
+	auto seed{static_cast<uint32_t>(now() / 1000)};
+	int perturb_us{200};
+	const char* only_scenario{nullptr};
+	const char* only_mode{nullptr};
+	const char* csv_path{nullptr};
+	const char* label{""};
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (!strcmp(argv[i], "--trials") && i + 1 < argc)
+			trials = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+			seed = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+		else if (!strcmp(argv[i], "--perturb") && i + 1 < argc)
+			perturb_us = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--timeout") && i + 1 < argc)
+			timeout_ms = std::max(8, atoi(argv[++i]));
+		else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+			cycle_threads = std::min(MaxThreads, std::max(2, atoi(argv[++i])));
+		else if (!strcmp(argv[i], "--scenario") && i + 1 < argc)
+			only_scenario = argv[++i];
+		else if (!strcmp(argv[i], "--mode") && i + 1 < argc)
+			only_mode = argv[++i];
+		else if (!strcmp(argv[i], "--csv") && i + 1 < argc)
+			csv_path = argv[++i];
+		else if (!strcmp(argv[i], "--label") && i + 1 < argc)
+			label = argv[++i];
+		else
+		{
+			fprintf(stderr,
+					"usage: %s [--trials n] [--seed n] [--perturb max_us] [--timeout ms] [--threads n] [--scenario name] [--mode name] [--csv path] "
+					"[--label name]\n",
+					argv[0]);
+			return 1;
+		}
+	}
+
+	FILE* csv{nullptr};
+	if (csv_path)
+	{
+		csv = fopen(csv_path, "a");
+		if (!csv)
+		{
+			fprintf(stderr, "can't open %s\n", csv_path);
+			return 1;
+		}
+		if (ftell(csv) == 0)
+			fprintf(csv, "label,scenario,mode,trials,detected,missed,hung,false_positives,median_ms,p95_ms,max_ms\n");
+	}
+
+	// a trial that's still going well past its timeouts has hung
+	auto limit_ms{timeout_ms * 20 + 2000};
+
+	printf("seed %u, perturbation up to %dus, deadlock timeout %dms\n", seed, perturb_us, timeout_ms);
+	printf("%-10s %-10s %6s %8s %6s %4s %8s %9s %9s %9s\n", "scenario", "mode", "trials", "detected", "missed", "hung", "false+", "median", "p95", "max");
+
+	bool failed{false};
+
+	for (const auto& scenario : scenarios)
+	{
+		if (only_scenario && strcmp(only_scenario, scenario.name))
+			continue;
+
+		for (const auto& mode : modes)
+		{
+			if (only_mode && strcmp(only_mode, mode.name))
+				continue;
+
+			if (!expected_report(scenario, mode))
+			{
+				printf("%-10s %-10s    (not seen in this mode)\n", scenario.name, mode.name);
+				continue;
+			}
+
+			int detected{0}, missed{0}, hung{0}, false_positives{0};
+			std::vector<int64_t> latencies;
+			std::string failures;
+
+			for (int trial = 0; trial < trials; ++trial)
+			{
+				auto trial_seed{seed + static_cast<uint32_t>(trial)};
+				bool trial_failed{false};
+
+				for (bool buggy : {true, false})
+				{
+					int64_t latency{-1};
+					auto result{fork_trial(scenario, mode, buggy, trial_seed, perturb_us, limit_ms, latency)};
+
+					if (result == Result::Passed && buggy)
+					{
+						++detected;
+						latencies.push_back(latency);
+					}
+					else if (result == Result::Missed)
+						++missed;
+					else if (result == Result::FalsePositive)
+						++false_positives;
+					else if (result == Result::Hung || result == Result::Crashed)
+						++hung;
+
+					trial_failed |= result != Result::Passed;
+				}
+
+				if (trial_failed)
+					failures += " " + std::to_string(trial_seed);
+			}
+
+			auto median{percentile(latencies, 50)};
+			auto p95{percentile(latencies, 95)};
+			auto max{percentile(latencies, 100)};
+
+			printf("%-10s %-10s %6d %8d %6d %4d %8d %7.2fms %7.2fms %7.2fms\n", scenario.name, mode.name, trials, detected, missed, hung, false_positives, median, p95, max);
+			if (!failures.empty())
+				printf("    went wrong with seeds:%s\n", failures.c_str());
+			fflush(stdout);
+
+			if (csv)
+				fprintf(csv, "%s,%s,%s,%d,%d,%d,%d,%d,%.3f,%.3f,%.3f\n", label, scenario.name, mode.name, trials, detected, missed, hung, false_positives, median, p95, max);
+
+			failed |= !failures.empty();
+		}
+	}
+
+	if (csv)
+		fclose(csv);
+
+	return failed ? 2 : 0;
+}
@@ -0,0 +1,324 @@
+// Prints the shared ownership table kept by the processes that called
+// Dreadlock::set_shared_table() (or set DREADLOCK_SHARED_TABLE): what
+// each of their threads holds, and waits for, followed by any cycle
+// of waits, which is a deadlock even when it crosses processes.  It
+// only reads the file, so it can be pointed at a live system, or at
+// the file a hung one left behind:
+//
+//   g++ -std=c++17 -O2 -DENABLE_DREADLOCK dreadlock_table.cpp -o dreadlock_table
+//   ./dreadlock_table [--watch seconds] path
+//
+// The table records its own capacities, so the tool needn't be built
+// with the programs' DREADLOCK_SHARED_* settings.  It exits with 2
+// when it finds a cycle.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Dreadlock.h"
+
+namespace
+{
+// a consistent copy of a record, taken under its sequence lock
+struct Thread
+{
+	uint32_t index; // in the table, plus one, as the records refer to it
+	uint32_t pid;
+	uint32_t thread;
+	uint32_t waiting_on;
+	int64_t since;
+	DreadlockSharedSite site;
+};
+
+struct Mutex
+{
+	uint32_t index;
+	uint64_t region;
+	uint64_t offset;
+	uint32_t owner;
+	uint32_t readers;
+	uint32_t acquisitions;
+	int64_t since;
+	char name[48];
+	DreadlockSharedSite site;
+};
+
+template <typename Record, typename Copy>
+bool read_record(const Record& record, Copy copy)
+{
+	for (int attempt = 0; attempt < 16; ++attempt)
+	{
+		auto before{record.sequence.load(std::memory_order_acquire)};
+		if (before & 1)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+
+		copy();
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (record.sequence.load(std::memory_order_relaxed) == before)
+			return true;
+	}
+
+	return false;
+}
+
+bool alive(uint32_t pid)
+{
+	return kill(static_cast<pid_t>(pid), 0) == 0 || errno != ESRCH;
+}
+
+void format_duration(char* buffer, size_t size, int64_t ns)
+{
+	if (ns < 1000000)
+		snprintf(buffer, size, "%.1fus", ns / 1000.0);
+	else if (ns < 1000000000)
+		snprintf(buffer, size, "%.1fms", ns / 1000000.0);
+	else
+		snprintf(buffer, size, "%.2fs", ns / 1000000000.0);
+}
+
+const Mutex* find_mutex(const std::vector<Mutex>& mutexes, uint32_t index)
+{
+	auto found{std::find_if(mutexes.begin(), mutexes.end(), [index](const Mutex& mutex) { return mutex.index == index; })};
+	return found == mutexes.end() ? nullptr : &*found;
+}
+
+const Thread* find_thread(const std::vector<Thread>& threads, uint32_t index)
+{
+	auto found{std::find_if(threads.begin(), threads.end(), [index](const Thread& thread) { return thread.index == index; })};
+	return found == threads.end() ? nullptr : &*found;
+}
+
+// prints the table once, returning the number of cycles found
+int print_table(DreadlockSharedHeader* table, const char* path)
+{
+	std::vector<Thread> threads;
+	std::vector<Mutex> mutexes;
+
+	auto thread_records{table->threads()};
+	for (uint32_t i = 0; i < table->thread_capacity; ++i)
+	{
+		auto& record{thread_records[i]};
+		if (!record.pid.load(std::memory_order_relaxed))
+			continue;
+
+		Thread thread;
+		thread.index = i + 1;
+		if (!read_record(record, [&] {
+				thread.pid = record.pid.load(std::memory_order_relaxed);
+				thread.thread = record.thread.load(std::memory_order_relaxed);
+				thread.waiting_on = record.waiting_on.load(std::memory_order_relaxed);
+				thread.since = record.since.load(std::memory_order_relaxed);
+				thread.site = record.site;
+			}))
+			continue; // too busy to catch still; it isn't stuck
+		if (thread.pid)
+			threads.push_back(thread);
+	}
+
+	auto mutex_records{table->mutexes()};
+	for (uint32_t i = 0; i < table->mutex_capacity; ++i)
+	{
+		auto& record{mutex_records[i]};
+		if (record.claimed.load(std::memory_order_acquire) != DreadlockSharedMutex::InUse)
+			continue;
+
+		Mutex mutex;
+		mutex.index = i + 1;
+		mutex.region = record.region;
+		mutex.offset = record.offset;
+		memcpy(mutex.name, record.name, sizeof(mutex.name));
+		mutex.name[sizeof(mutex.name) - 1] = 0;
+		if (!read_record(record, [&] {
+				mutex.owner = record.owner.load(std::memory_order_relaxed);
+				mutex.readers = record.readers.load(std::memory_order_relaxed);
+				mutex.acquisitions = record.acquisitions.load(std::memory_order_relaxed);
+				mutex.since = record.since.load(std::memory_order_relaxed);
+				mutex.site = record.site;
+			}))
+			continue;
+		mutex.site.module[sizeof(mutex.site.module) - 1] = 0;
+		mutexes.push_back(mutex);
+	}
+
+	std::vector<uint32_t> pids;
+	for (const auto& thread : threads)
+	{
+		if (std::find(pids.begin(), pids.end(), thread.pid) == pids.end())
+			pids.push_back(thread.pid);
+	}
+	std::sort(pids.begin(), pids.end());
+
+	auto now{std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count()};
+	char duration[16];
+
+	printf("Shared table %s: %u processes, %u threads, %u mutexes\n",
+		   path,
+		   static_cast<unsigned>(pids.size()),
+		   static_cast<unsigned>(threads.size()),
+		   static_cast<unsigned>(mutexes.size()));
+
+	for (auto pid : pids)
+	{
+		printf("Process %u%s\n", pid, alive(pid) ? "" : " (no longer running)");
+
+		for (const auto& thread : threads)
+		{
+			if (thread.pid != pid)
+				continue;
+
+			for (const auto& mutex : mutexes)
+			{
+				if (mutex.owner != thread.index)
+					continue;
+
+				format_duration(duration, sizeof(duration), now - mutex.since);
+				printf("   thread %u holds %s, locked in module %s:%d (%s)\n", thread.thread, mutex.name, mutex.site.module, mutex.site.line, duration);
+			}
+
+			auto waited{thread.waiting_on ? find_mutex(mutexes, thread.waiting_on) : nullptr};
+			if (!waited)
+				continue;
+
+			format_duration(duration, sizeof(duration), now - thread.since);
+			printf("   thread %u waits for %s in module %s:%d (%s)", thread.thread, waited->name, thread.site.module, thread.site.line, duration);
+			if (auto owner = find_thread(threads, waited->owner))
+				printf("; held by thread %u of process %u\n", owner->thread, owner->pid);
+			else if (waited->readers)
+				printf("; held shared by %u threads\n", waited->readers);
+			else
+				printf("\n");
+		}
+	}
+
+	// every thread waits for at most one mutex, which has at most one
+	// exclusive owner, so the waits form chains, and a chain that
+	// comes back to one of its own threads is a cycle.  each cycle is
+	// printed once, from its lowest thread record.
+	int cycles{0};
+	for (const auto& start : threads)
+	{
+		std::vector<const Thread*> chain;
+		auto thread{&start};
+		while (thread && std::find(chain.begin(), chain.end(), thread) == chain.end())
+		{
+			chain.push_back(thread);
+			auto waited{thread->waiting_on ? find_mutex(mutexes, thread->waiting_on) : nullptr};
+			thread = waited ? find_thread(threads, waited->owner) : nullptr;
+		}
+
+		if (thread != &start)
+			continue;
+		if (std::any_of(chain.begin(), chain.end(), [&](const Thread* member) { return member->index < start.index; }))
+			continue;
+
+		if (!cycles++)
+			printf("Cycles of waits:\n");
+
+		printf("  ");
+		for (auto member : chain)
+		{
+			auto waited{find_mutex(mutexes, member->waiting_on)};
+			printf(" thread %u of process %u waits for %s ->", member->thread, member->pid, waited->name);
+		}
+		printf(" thread %u of process %u\n", start.thread, start.pid);
+	}
+
+	if (!cycles)
+		printf("No cycles of waits\n");
+
+	fflush(stdout);
+	return cycles;
+}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+	int watch{0};
+	const char* path{nullptr};
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (!strcmp(argv[i], "--watch") && i + 1 < argc)
+			watch = atoi(argv[++i]);
+		else if (argv[i][0] != '-' && !path)
+			path = argv[i];
+		else
+		{
+			path = nullptr;
+			break;
+		}
+	}
+
+	if (!path)
+	{
+		fprintf(stderr, "usage: %s [--watch seconds] path\n", argv[0]);
+		return 1;
+	}
+
+	auto fd{open(path, O_RDONLY)};
+	struct stat info;
+	if (fd < 0 || fstat(fd, &info))
+	{
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	if (static_cast<size_t>(info.st_size) < sizeof(DreadlockSharedHeader))
+	{
+		fprintf(stderr, "%s: not a shared table\n", path);
+		return 1;
+	}
+
+	auto memory{mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_SHARED, fd, 0)};
+	close(fd);
+	if (memory == MAP_FAILED)
+	{
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	auto table{static_cast<DreadlockSharedHeader*>(memory)};
+	if (table->state.load(std::memory_order_acquire) != 2 || memcmp(table->magic, "DREADLK", sizeof(table->magic)))
+	{
+		fprintf(stderr, "%s: not a shared table (or not set up yet)\n", path);
+		return 1;
+	}
+
+	if (table->version != DreadlockSharedHeader::CurrentVersion ||
+		table->thread_size != sizeof(DreadlockSharedThread) ||
+		table->mutex_size != sizeof(DreadlockSharedMutex) ||
+		static_cast<size_t>(info.st_size) < DreadlockSharedHeader::size_for(table->thread_capacity, table->mutex_capacity))
+	{
+		fprintf(stderr, "%s: a shared table of a version this tool doesn't read\n", path);
+		return 1;
+	}
+
+	int cycles{0};
+	for (;;)
+	{
+		cycles = print_table(table, path);
+		if (watch <= 0)
+			break;
+
+		std::this_thread::sleep_for(std::chrono::seconds(watch));
+		printf("\n");
+	}
+
+	return cycles ? 2 : 0;
+}